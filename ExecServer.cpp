@@ -1,4 +1,7 @@
 #include "xmlrpcpp/XmlRpc.h"
+#include "xmlrpcpp/XmlRpcSocket.h"
+#include "xmlrpcpp/XmlRpcMutex.h"
+#include "xmlrpcpp/base64.h"
 #include "sha1.h"
 #include "util.h"
 #include "version.h"
@@ -9,29 +12,38 @@
 #include <time.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/stat.h>
 
 #if defined(_WINDOWS)
 #include <direct.h>
 #include <io.h>
+#include <sys/utime.h>
 
 #define F_OK 0
 #define W_OK 2
 #define R_OK 4
 
-#define mkdir(__path,__mode) _mkdir(__path)
+#define realpath(__path,__resolved) _fullpath(__resolved,__path,_MAX_PATH)
 
 #pragma warning (disable:4996)
 
 #define DIR_SEPARATOR '\\'
 
 #else
+#include <unistd.h>
+#include <signal.h>
+#include <utime.h>
 
 #define DIR_SEPARATOR '/'
 
 #endif
 
 #include <vector>
+#include <list>
+#include <deque>
+#include <map>
+#include <algorithm>
 #include <string>
 #include <sstream>
 #include <iomanip>
@@ -53,6 +65,12 @@ void throw_on_os_error(const char* desc /*=NULL*/) {
     }
 }
 
+/* gives up a long operation on a worker once its client has disconnected */
+static void throw_if_client_gone() {
+    if(XmlRpcSession::clientGone())
+        throw XmlRpcException("cancelled: the client has disconnected");
+}
+
 
 /* converts string to char*, or NULL if string is empty */
 const char* str(const string& s) {
@@ -61,6 +79,13 @@ const char* str(const string& s) {
     return s.c_str();
 }
 
+/* converts an integer or double XML-RPC value to seconds */
+double seconds(XmlRpcValue& v) {
+    if(v.getType()==XmlRpcValue::TypeDouble)
+        return double(v);
+    return int(v);
+}
+
 /* converts vector<string> to NULL-terminated char** */
 class strlist {
     char** data;
@@ -124,6 +149,78 @@ public:
     operator FILE*() {
         return f;
     }
+    /* let go of the file, which the caller closes */
+    FILE* release() {
+        FILE* r=f;
+        f=NULL;
+        return r;
+    }
+};
+
+static bool is_absolute(const string& path) {
+#if defined(_WINDOWS)
+    return path[0]=='\\' || path[0]=='/' || (path.size()>1 && path[1]==':');
+#else
+    return path[0]=='/';
+#endif
+}
+
+/* The working directory of a client connection. dir.chdir moves it
+   without touching the server's own, which stays the start directory,
+   and the relative paths given to the dir.*, file.* and process methods
+   are resolved against it. Clients which never change directory share
+   the start directory */
+class Session: public XmlRpcSession {
+    int dirfd_;
+    string path_;
+
+    Session(int dirfd, const string& path): dirfd_(dirfd), path_(path) {}
+public:
+    ~Session() {
+        if(dirfd_!=PDIR_CWD)
+            pdirclose(dirfd_);
+    }
+
+    /* descriptor to resolve relative paths against */
+    int dirfd() const { return dirfd_; }
+
+    /* absolute path of the directory, empty for the start directory */
+    const string& path() const { return path_; }
+
+    /* <name> resolved to a path, for what takes paths rather than
+       a directory descriptor */
+    string resolve(const string& name) const {
+        if(name.empty() || path_.empty() || is_absolute(name))
+            return name;
+        return path_+DIR_SEPARATOR+name;
+    }
+
+    /* the session of the calling client */
+    static const Session& current() {
+        static Session start(PDIR_CWD, string());
+        Session* s=static_cast<Session*>(XmlRpcSession::current());
+        return s? *s: start;
+    }
+
+    /* moves the calling client to <dir>, or back to the start directory
+       if it is empty; returns the absolute path of the new directory */
+    static string chdir(const string& dir) {
+        Path buf;
+        clear_error();
+        if(dir.empty()) {
+            XmlRpcSession::setCurrent(NULL);
+            getcwd(buf, buf.size());
+            throw_on_os_error("getcwd");
+            return string(buf);
+        }
+        if(!realpath(current().resolve(dir).c_str(), buf))
+            throw_on_os_error("chdir");
+        int fd=pdiropen(buf);
+        if(fd<0)
+            throw_on_os_error("chdir");
+        XmlRpcSession::setCurrent(new Session(fd, string(buf)));
+        return string(buf);
+    }
 };
 
 class M_dir_tmpname: public XmlRpcServerMethod {
@@ -135,21 +232,26 @@ public:
     }
     void execute(XmlRpcValue& /*params*/, XmlRpcValue& result) {
 	int attempts=256;
-	Path cwd;
+	const Session& s=Session::current();
+	Path cwd(str(s.path()));
 	clear_error();
-	getcwd(cwd, cwd.size());
-	throw_on_os_error("getcwd");
-	if(access(cwd, W_OK)<0) {
+	if(s.path().empty()) {
+	    getcwd(cwd, cwd.size());
+	    throw_on_os_error("getcwd");
+	}
+	if(paccess(s.dirfd(), ".", W_OK)<0) {
 	    throw XmlRpcException("Current directory is not writeable");
 	}
-        Path fname;
+        char name[16];
 	for(int i=(rand() << 8) ^ (int)(time(NULL)); attempts; ++i,--attempts) {
-	    snprintf(fname, fname.size(), "%s%cEX%06x", cwd.get(), DIR_SEPARATOR, i&0xFFFFFF);
+	    snprintf(name, sizeof(name), "EX%06x", i&0xFFFFFF);
 	    clear_error();
-	    if(access(fname, F_OK)<0) {
+	    if(paccess(s.dirfd(), name, F_OK)<0) {
 		if(errno == ENOENT) {
 		    /* great! this file doesn't exist */
 		    clear_error();
+		    Path fname;
+		    snprintf(fname, fname.size(), "%s%c%s", cwd.get(), DIR_SEPARATOR, name);
 		    result=fname;
 		    return;
 		}
@@ -165,13 +267,15 @@ public:
         XmlRpcServerMethod("dir.chdir", server) {}
 
     std::string help() {
-        return "dir.chdir([dir]): change current directory\n"
+        return "dir.chdir([dir]): change the current directory of this connection\n"
 	       "    If <dir> is empty, go to the start directory\n"
                "Return value: current directory";
     }
 
+    /* the calls after it in a parallel multicall use the new directory */
+    bool parallelSafe() const { return false; }
+
     void execute(XmlRpcValue& params, XmlRpcValue& result) {
-        Path buf;
         string dir;
         try {
             if(params.getType()!=XmlRpcValue::TypeInvalid)
@@ -179,13 +283,7 @@ public:
         } catch(...) {
             throw XmlRpcException("parameters error");
         }
-	if(dir.empty()) dir=cfg()->start_dir;
-        clear_error();
-	chdir(dir.c_str());
-	throw_on_os_error("chdir");
-        getcwd(buf, buf.size());
-        throw_on_os_error("getcwd");
-        result=string(buf);
+        result=Session::chdir(dir);
     }
 };
 
@@ -208,7 +306,7 @@ public:
         }
         if(dir.empty()) throw XmlRpcException("directory name is empty");
         clear_error();
-        mkdir(dir.c_str(),0777);
+        pmkdir(Session::current().dirfd(), dir.c_str());
         throw_on_os_error("mkdir");
         (void)result;
     }
@@ -224,6 +322,8 @@ public:
         "\tif recursive==True, delete non-empty directory and all its contents";
     }
 
+    Execution execution() const { return Blocking; }
+
     void execute(XmlRpcValue& params, XmlRpcValue& result) {
         string dir;
         bool recursive=false;
@@ -238,15 +338,139 @@ public:
         }
         if(dir.empty()) throw XmlRpcException("directory name is empty");
         clear_error();
-        if(recursive)
-	    rmdir_recursive(dir.c_str());
-	else
-	    rmdir(dir.c_str());
+        prmdir(Session::current().dirfd(), dir.c_str(), recursive);
 	throw_on_os_error("rmdir");
         (void)result;	
     }
 };
 
+/* The data of a large file.put, written a block at a time as the request
+   is read. Whether to append comes after the data, so the data goes to a
+   file beside the target (the file at the end of its symbolic links),
+   which at the end is renamed over the target, so that the target is
+   never left half-written, or is appended to it */
+class PutSink: public XmlRpcSink {
+    int dirfd_;
+    string fname_;
+    string target_;     /* fname_ with its symbolic links followed */
+    string tmpname_;
+    FILE* f_;
+    bool binary_;
+    double written_;
+    string error_;      /* the first error, reported by finish() */
+    int code_;
+
+    void failed(const char* desc) {
+        try {
+            throw_on_os_error(desc);
+            error_=string(desc)+": failed";
+        } catch(XmlRpcException& e) {
+            error_=e.getMessage();
+            code_=e.getCode();
+        }
+    }
+
+    /* the file beside the target, opened at the first block */
+    bool open() {
+        char target[4096];
+        clear_error();
+        if(presolve(dirfd_, fname_.c_str(), target, sizeof(target))<0) {
+            failed("readlink");
+            return false;
+        }
+        target_=target;
+        char suffix[40];
+        sprintf(suffix, ".put-%lx", (unsigned long)this);
+        tmpname_=target_+suffix;
+        if(!(f_=pfopen(dirfd_, tmpname_.c_str(), binary_? "w+b": "w+"))) {
+            failed("fopen");
+            return false;
+        }
+        return true;
+    }
+
+public:
+    enum { BUFSZ = 1024*64 };
+
+    PutSink(int dirfd, const string& fname, bool binary):
+            dirfd_(dirfd), fname_(fname), f_(NULL), binary_(binary),
+            written_(0), code_(-1) {}
+
+    ~PutSink() {
+        if(f_) {
+            fclose(f_);
+            punlink(dirfd_, tmpname_.c_str());
+        }
+    }
+
+    /* the data is translated as a small put would translate it */
+    bool write(const char* data, int n) {
+        if(!error_.empty())
+            return false;
+        if(!f_ && !open())
+            return false;
+        clear_error();
+        if(fwrite(data, 1, n, f_)!=(size_t)n) {
+            failed("fwrite");
+            return false;
+        }
+        written_+=n;
+        return true;
+    }
+
+    void finish(XmlRpcValue& params, XmlRpcValue& result) {
+        bool append=false;
+        try {
+            if(params.size()>2) append=bool(params[2]);
+        } catch(...) {
+            throw XmlRpcException("parameters error");
+        }
+        if(!error_.empty())
+            throw XmlRpcException(error_, code_);
+        throw_if_client_gone();
+
+        clear_error();
+        if(!f_) {
+            /* no data */
+            FileHolder fo=pfopen(dirfd_, fname_.c_str(),
+                binary_?
+                    (append? "ab":"wb"):
+                    (append? "a":"w"));
+            if(!fo)
+                throw_on_os_error("fopen");
+        } else if(!append) {
+            FILE* f=f_;
+            f_=NULL;
+            bool ok=pfsync(f)==0;
+            if(fclose(f)!=0)
+                ok=false;
+            if(!ok || preplace(dirfd_, tmpname_.c_str(), target_.c_str())<0) {
+                int e=errno;
+                punlink(dirfd_, tmpname_.c_str());
+                errno=e;
+                throw_on_os_error(ok? "rename": "fsync");
+                throw XmlRpcException(ok? "rename: failed": "fsync: failed");
+            }
+        } else {
+            /* the target is not given up on once it is being written */
+            if(fflush(f_)!=0 || fseek(f_, 0, SEEK_SET)!=0)
+                throw_on_os_error("fseek");
+            FileHolder fo=pfopen(dirfd_, fname_.c_str(), binary_? "ab": "a");
+            if(!fo)
+                throw_on_os_error("fopen");
+            char buf[BUFSZ];
+            size_t nr;
+            while((nr=fread(buf, 1, BUFSZ, f_))>0)
+                if(fwrite(buf, 1, nr, fo)!=nr)
+                    throw_on_os_error("fwrite");
+            if(ferror(f_))
+                throw_on_os_error("fread");
+        }
+
+        result=written_<INT_MAX? (int)written_: INT_MAX;
+    }
+};
+
 class M_file_put: public XmlRpcServerMethod {
 public:
     M_file_put(XmlRpcServer* server = 0): 
@@ -255,7 +479,25 @@ public:
     std::string help() {
         return "file.put(filename, data, [append=False]): write to file <filename> the string <data> (or a base64 encoded <data>)\n"
         	"\tIf append==True, append to the end of file\n"
-        	"Return value: number of bytes written";
+        	"\tThe data of a request from 1 MB on is written as it is received to a file\n"
+        	"\tbeside <filename>, which replaces <filename> (a new file, with its permissions)\n"
+        	"\tor is appended to it once the whole request is read\n"
+        	"Return value: number of bytes written, an int (2147483647 for more)";
+    }
+
+    Execution execution() const { return Blocking; }
+
+    int sinkParam() const { return 1; }
+
+    XmlRpcSink* openSink(XmlRpcValue& params, int type) {
+        string fname;
+        try {
+            fname=string(params[0]);
+        } catch(...) {
+            return NULL;    /* execute() reports it */
+        }
+        return new PutSink(Session::current().dirfd(), fname,
+                           type==XmlRpcValue::TypeBase64);
     }
 
     void execute(XmlRpcValue& params, XmlRpcValue& result) {
@@ -284,7 +526,7 @@ public:
         }
 
         clear_error();
-        FileHolder fo=fopen(fname.c_str(),
+        FileHolder fo=pfopen(Session::current().dirfd(), fname.c_str(),
             binary? 
         	(append? "ab":"wb"): 
         	(append? "a":"w"));
@@ -297,6 +539,81 @@ public:
     }
 };
 
+/* The contents of a file sent by file.get a buffer at a time, as the
+   response is written, so a large file is never in memory whole. Base64
+   is encoded a whole number of lines at a time, which gives the same
+   encoding as in one go, and its length is known in advance */
+class FileStream: public XmlRpcStream {
+    FILE* f_;
+    bool binary_;
+    long left_;     /* bytes of the file still to send, -1 for all; binary
+                       files must have them, since the length was given */
+    long length_;   /* the length of the XML, or -1 */
+    bool started_;
+
+public:
+    /* 1213 lines of 18 groups of 3 bytes */
+    enum { BUFSZ = 54*1213 };
+
+    FileStream(FILE* f, bool binary, long size):
+            f_(f), binary_(binary), left_(size), length_(-1), started_(false) {
+        if(binary_ && size>=0)
+            length_=strlen("<value><base64>")+base64_length(size)+
+                    strlen("</base64></value>");
+    }
+
+    ~FileStream() {
+        if(f_)
+            fclose(f_);
+    }
+
+    /* the encoder puts 4 characters per 3 bytes (or part), and a newline
+       after each 18 complete groups */
+    static long base64_length(long n) {
+        return (n+2)/3*4+n/3/18;
+    }
+
+    long length() {
+        return length_;
+    }
+
+    int read(string& buf) {
+        if(!started_) {
+            started_=true;
+            buf=binary_? "<value><base64>": "<value>";
+            return (int)buf.size();
+        }
+        if(!f_ || left_==0) {
+            if(f_==NULL)
+                return 0;
+            fclose(f_);
+            f_=NULL;
+            buf=binary_? "</base64></value>": "</value>";
+            return (int)buf.size();
+        }
+        char data[BUFSZ];
+        size_t nr=left_<0 || left_>BUFSZ? (size_t)BUFSZ: (size_t)left_;
+        nr=fread(data, 1, nr, f_);
+        if(nr==0) {
+            if(ferror(f_) || (binary_ && left_>0))
+                return -1;  /* an error, or the file has shrunk */
+            left_=0;
+            return read(buf);
+        }
+        if(left_>0)
+            left_-=nr;
+        if(binary_) {
+            base64<char> encoder;
+            int iostatus=0;
+            std::back_insert_iterator<string> ins=std::back_inserter(buf);
+            encoder.put(data, data+nr, ins, iostatus, base64<>::crlf());
+        } else {
+            buf=XmlRpcUtil::xmlEncode(string(data, nr));
+        }
+        return (int)buf.size();
+    }
+};
+
 class M_file_get: public XmlRpcServerMethod {
 public:
     M_file_get(XmlRpcServer* server = 0): 
@@ -310,12 +627,24 @@ public:
                "   pos:      initial position in file\n"
                "   maxbytes: maximum number of bytes to send, file will be truncated\n"
                "Return value:\n"
-               "   the contents of the file (string or base64 on demand)\n";
+               "   the contents of the file (string or base64 on demand)\n"
+               "   from STREAM_MIN bytes (1 MB) on, the response is sent while the file is read,\n"
+               "   with its length in advance if binary, otherwise in chunks (HTTP/1.1)\n";
     }
 
-    enum { BUFSZ = 1024*64 };
+    Execution execution() const { return Blocking; }
+
+    enum { BUFSZ = 1024*64, STREAM_MIN = 1024*1024 };
 
     void execute(XmlRpcValue& params, XmlRpcValue& result) {
+        get(params, result, false);
+    }
+
+    XmlRpcStream* executeStream(XmlRpcValue& params, XmlRpcValue& result) {
+        return get(params, result, true);
+    }
+
+    XmlRpcStream* get(XmlRpcValue& params, XmlRpcValue& result, bool stream) {
         string fname;
         bool binary=false;
         int pos=0, maxbytes=-1;
@@ -335,7 +664,7 @@ public:
         }
 
         clear_error();
-        FileHolder fi=fopen(fname.c_str(), binary? "rb":"r");
+        FileHolder fi=pfopen(Session::current().dirfd(), fname.c_str(), binary? "rb":"r");
         if(!fi)
             throw_on_os_error("fopen");
         if(pos) {
@@ -343,6 +672,17 @@ public:
             throw_on_os_error("fseek");
         }
 
+        /* what is left of a regular file decides whether to stream it */
+        struct stat st;
+        if(stream && fstat(fileno(fi), &st)==0 &&
+           (st.st_mode&S_IFMT)==S_IFREG) {
+            long size=(long)st.st_size-pos;
+            if(maxbytes>=0 && maxbytes<size)
+                size=maxbytes;
+            if(size>=STREAM_MIN)
+                return new FileStream(fi.release(), binary, binary? size: maxbytes);
+        }
+
         string res;
         char buf[BUFSZ];
         while(maxbytes) {
@@ -351,6 +691,7 @@ public:
                 nr=BUFSZ;
             if(!nr)
                 break;
+            throw_if_client_gone();
             nr=fread(buf,1,nr,fi);
             if(!nr) {
                 throw_on_os_error("fread");
@@ -365,9 +706,19 @@ public:
         } else {
             result=res;
         }
+        return NULL;
     }
 };
 
+/* returns the digest of what <sha1> has been fed, in hex */
+static string hexdigest(SHA1& sha1) {
+    unsigned rd[5];
+    if(!sha1.Result(rd)) throw XmlRpcException("SHA message corrupted");
+    stringstream ss;
+    for(int i=0; i<5; ++i) ss << hex << setw(8) << setfill('0') << rd[i];
+    return ss.str();
+}
+
 class M_file_sha1: public XmlRpcServerMethod {
 public:
     M_file_sha1(XmlRpcServer* server = 0): 
@@ -377,6 +728,8 @@ public:
         return "file.sha1(filename): return SHA1 hexdigest of a file";
     }
 
+    Execution execution() const { return Blocking; }
+
     enum { BUFSZ = 1024*64 };
 
     void execute(XmlRpcValue& params, XmlRpcValue& result) {
@@ -388,7 +741,7 @@ public:
         }
 
         clear_error();
-        FileHolder fi=fopen(fname.c_str(), "rb");
+        FileHolder fi=pfopen(Session::current().dirfd(), fname.c_str(), "rb");
         if(!fi)
             throw_on_os_error("fopen");
 
@@ -401,6 +754,7 @@ public:
                 nr=BUFSZ;
             if(!nr)
                 break;
+            throw_if_client_gone();
             nr=fread(buf,1,nr,fi);
             if(!nr) {
                 throw_on_os_error("fread");
@@ -408,11 +762,7 @@ public:
             }
 	    sha1.Input(buf, nr);
         }
-	unsigned rd[5];
-	if(!sha1.Result(rd)) throw XmlRpcException("SHA message corrupted");
-	stringstream ss;
-	for(int i=0; i<5; ++i) ss << hex << setw(8) << setfill('0') << rd[i];
-	result=ss.str();
+	result=hexdigest(sha1);
     }
 };
 
@@ -434,186 +784,3938 @@ public:
         }
 
         clear_error();
-        unlink(fname.c_str());
+        punlink(Session::current().dirfd(), fname.c_str());
         throw_on_os_error("unlink");
         (void)result;        
     }
 };
 
-class M_process_spawn: public XmlRpcServerMethod {
+/* creates a pipe for a child's standard stream, returns the child's end
+   and makes ours non-blocking */
+static int pipe_child_end(int fds[2], bool output) {
+    clear_error();
+    if(ppipe(fds)<0)
+        throw_on_os_error("pipe");
+    XmlRpcSocket::setNonBlocking(fds[output? 0: 1]);
+    return fds[output? 1: 0];
+}
+
+/* The server end of a pipe from a child's stdout or stderr,
+   read on the event loop */
+class PipeReader: public XmlRpcSource {
+    XmlRpcDispatch* disp_;
+
+protected:
+    enum { BUFSZ = 1024*64 };
+
+    /* called with each chunk read */
+    virtual void received(const char* data, size_t size)=0;
+
+    /* called at end of file, after the pipe is closed;
+       may delete the reader */
+    virtual void closed() {}
+
 public:
-    M_process_spawn(XmlRpcServer * server = 0): 
-        XmlRpcServerMethod("process.spawn", server) {}
-    std::string help() {
-        return "process.spawn(args, timeout, options): spawn a subprocess\n"
-               "Arguments:\n"
-               "    args:    list of parameters (first is the program name)\n"
-               "    timeout: if zero, the process is started asynchronously, otherwise, it's a maximum execution time\n"
-               "    options: an optional struct with the following keys:\n"
-               "        cwd:     the process will chdir there before execution\n"
-               "        stdin:   name of a file to be fed to the subprocess's stdin\n"
-               "        stdout:  name of a file where the suprocess's stdout will be written\n"
-               "        stderr:  name of a file where the suprocess's stderr will be written\n"
-               "        env:     dict of environment variables to set\n"
-               "Return value:\n"
-               "    for asynchronous requests:\n"
-               "        pid (integer)\n"
-               "    for synchronous requests:\n"
-               "        return value (integer)\n"
-               "    on timeout:\n"
-               "        kill process and raise Fault";
+    PipeReader(int fd): XmlRpcSource(fd), disp_(NULL) {}
+
+    /* start reading on the event loop */
+    void watch(XmlRpcDispatch* disp) {
+        disp_=disp;
+        disp_->addSource(this, XmlRpcDispatch::ReadableEvent);
     }
-    void execute(XmlRpcValue& params, XmlRpcValue& result) {
-        vector<string> args, envs;
-        string argstr;
-        string cwd, fin, fout, ferr;
-        int timeout=0;
 
-        try {
-            XmlRpcValue& vargs=params[0];
-            switch(vargs.getType()) {
-            case XmlRpcValue::TypeArray:
-                for(int i=0; i<vargs.size(); ++i) {
-                    args.push_back(string(vargs[i]));
-                }
-                break;
-            case XmlRpcValue::TypeString:
-                args.push_back(string(vargs));
-                break;
-            default:
-                throw XmlRpcException("parameters error");
-            }
-            if(params.size()>1) {
-                timeout=int(params[1]);
-            }
-            if(params.size()>2) {
-                XmlRpcValue& vopts=params[2];
-                if(vopts.hasMember("cwd"))
-                    cwd=string(vopts["cwd"]);
-                if(vopts.hasMember("stdin"))
-                    fin=string(vopts["stdin"]);
-                if(vopts.hasMember("stdout"))
-                    fout=string(vopts["stdout"]);
-                if(vopts.hasMember("stderr"))
-                    ferr=string(vopts["stderr"]);
-                if(vopts.hasMember("env")) {
-                    XmlRpcValue& venv=vopts["env"];
-                    vector<string> keys=venv.keys();
-                    for(vector<string>::const_iterator p=keys.begin();
-                    	    p!=keys.end(); ++p) {
-                    	envs.push_back(*p+string("=")+string(venv[*p]));
-              	    }
-                }
+    /* read what is available; returns false on end of file */
+    bool drain() {
+        char buf[BUFSZ];
+        while(getfd()>=0) {
+            int nr=read(getfd(), buf, sizeof(buf));
+            if(nr>0) {
+                received(buf, nr);
+            } else if(nr<0 && errno==EINTR) {
+                continue;
+            } else {
+                return nr<0 && (errno==EAGAIN || errno==EWOULDBLOCK);
             }
-
-        } catch(...) {
-            throw XmlRpcException("parameters error");
         }
+        return false;
+    }
 
-        clear_error();
-        int pid=pspawn(strlist(args), strlist(envs), str(cwd),
-                       str(fin), str(fout), str(ferr));
-        if(pid<0)
-            throw_on_os_error("exec");
+    /* read the remaining output and stop watching the pipe */
+    void finish() {
+        drain();
+        if(disp_)
+            disp_->removeSource(this);
+        close();
+    }
 
-        if(timeout==0) {
-            result=pid;
-        } else {
-            int res=pwait(pid, timeout);
-            if(res<0) {
-                pkill(pid);
-                throw_on_os_error("kill");
-                throw XmlRpcException("Process killed on timeout");
-            }
-            result=res;
+    unsigned handleEvent(unsigned /*eventType*/) {
+        if(drain())
+            return XmlRpcDispatch::ReadableEvent;
+        disp_->removeSource(this);
+        close();
+        closed();
+        return 0;
+    }
+};
+
+/* Collects a child's output for process.run up to a limit,
+   the rest is discarded */
+class OutputCapture: public PipeReader {
+    string data_;
+    size_t limit_;
+    bool truncated_;
+
+protected:
+    void received(const char* data, size_t size) {
+        size_t room=limit_-data_.size();
+        if(size>room) {
+            size=room;
+            truncated_=true;
         }
+        data_.append(data, size);
     }
 
+public:
+    OutputCapture(int fd, size_t limit):
+        PipeReader(fd), limit_(limit), truncated_(false) {}
+
+    const string& data() const { return data_; }
+    bool truncated() const { return truncated_; }
 };
 
-class M_process_wait: public XmlRpcServerMethod {
+/* The last bytes written to a stream, addressed by their offset
+   from the start of the stream */
+class RingBuffer {
+    vector<char> data_;
+    unsigned long total_; /* bytes ever appended */
+
 public:
-    M_process_wait(XmlRpcServer* server = 0): 
-        XmlRpcServerMethod("process.wait", server) {}
+    RingBuffer(size_t capacity): data_(capacity), total_(0) {}
 
-    std::string help() {
-        return "process.wait(pid, timeout): wait for completion of <pid> or for <timeout> seconds";
+    /* offset of the oldest byte kept */
+    unsigned long start() const {
+        return total_<data_.size()? 0: total_-data_.size();
     }
 
-    void execute(XmlRpcValue& params, XmlRpcValue& result) {
-        int pid, timeout=0;
-        try {
-            pid=params[0];
-            timeout=params[1];
-        } catch(...) {
-            throw XmlRpcException("parameters error");
+    /* offset after the newest byte */
+    unsigned long end() const { return total_; }
+
+    void append(const char* p, size_t n) {
+        size_t cap=data_.size();
+        if(n>cap) {
+            /* only the tail survives */
+            total_+=n-cap;
+            p+=n-cap;
+            n=cap;
         }
+        if(!n)
+            return;
+        size_t pos=total_%cap;
+        size_t first=n<cap-pos? n: cap-pos;
+        memcpy(&data_[pos], p, first);
+        memcpy(&data_[0], p+first, n-first);
+        total_+=n;
+    }
 
-        clear_error();
-        int res=pwait(pid, timeout);
-        throw_on_os_error("wait");
-        result=res;
+    /* copy the bytes from <offset> (not before start()) to the end */
+    void read(unsigned long offset, string& out) const {
+        size_t cap=data_.size();
+        if(offset>=total_)
+            return;
+        size_t n=total_-offset;
+        size_t pos=offset%cap;
+        size_t first=n<cap-pos? n: cap-pos;
+        out.assign(&data_[pos], first);
+        out.append(&data_[0], n-first);
     }
 };
 
-class M_process_kill: public XmlRpcServerMethod {
+class OutputWaiter;
+class Child;
+class InputStream;
+
+/* A child's stdout or stderr kept in a ring buffer for process.read.
+   The buffer is shared with worker threads, under the child table lock. */
+class OutputStream: public PipeReader {
+    Child* child_;
+    RingBuffer buf_;
+    bool eof_;
+    list<OutputWaiter*> waiters_;
+
+    void wakeup();
+
+protected:
+    void received(const char* data, size_t size);
+    void closed();
+
 public:
-    M_process_kill(XmlRpcServer* server = 0): 
-        XmlRpcServerMethod("process.kill", server) {}
+    OutputStream(int fd, Child* child, size_t capacity):
+        PipeReader(fd), child_(child), buf_(capacity), eof_(false) {}
 
-    std::string help() {
-        return "process.kill(pid): kill the process <pid>";
+    /* the answer to process.read from <offset>; called with the lock held */
+    void result(unsigned long offset, bool binary, XmlRpcValue& result) const;
+
+    /* whether process.read from <offset> should wait for more output;
+       called with the lock held */
+    bool pending(unsigned long offset) const {
+        return !eof_ && offset>=buf_.end();
     }
 
-    void execute(XmlRpcValue& params, XmlRpcValue& result) {
-        int pid;
-        try {
-            pid=params[0];
-        } catch(...) {
-            throw XmlRpcException("parameters error");
-        }
+    /* called on the dispatcher thread */
+    void addWaiter(OutputWaiter* w) { waiters_.push_back(w); }
+    void removeWaiter(OutputWaiter* w) { waiters_.remove(w); }
+};
 
-        clear_error();
-        int res=pkill(pid);
-        throw_on_os_error("kill");
-        result=res;
-    }
+/* Notified on the dispatcher thread when a child exits */
+class ExitWatcher {
+public:
+    virtual ~ExitWatcher() {}
+    virtual void child_exited(int pid)=0;
 };
 
-class M_system_version: public XmlRpcServerMethod {
+/* A child started by process.spawn or process.run. Its exit code is
+   kept until it is waited for, its piped output (see process.read) for
+   as long as the child stays in the table. */
+class Child: public XmlRpcThreadPool::Job {
 public:
-    M_system_version(XmlRpcServer* server = 0): XmlRpcServerMethod("system.version", server) {}
+    int pid;
+    bool exited;
+    int code;
+    bool waited; /* the exit code has been collected */
+    bool killing; /* its group is due a SIGKILL after SIGTERM */
+    double started, ended; /* wall-clock times */
+    struct pusage usage; /* valid once exited */
+    OutputStream* output[2]; /* stdout and stderr pipes, or NULL */
+    InputStream* input; /* stdin pipe, or NULL */
+    XmlRpcDispatch* disp; /* where the pipes are watched */
+    int open_streams;
+    bool orphan; /* dropped from the table while its pipes were open */
+    list<ExitWatcher*> watchers;
+    string cgroup; /* of the child, if it has one */
+    string limit;  /* the limit which the child has hit: "cpu", "fsize"
+                      or "memory", once exited */
+    vector<string> args;
 
-    std::string help() {
-        return "system.version(): return ExecServer version";
+    /* the resources the child was using at a time */
+    struct Sample {
+        double time;  /* wall-clock */
+        double cpu;   /* percent of a CPU since the previous sample */
+        long rss;     /* kilobytes */
+        int threads;
+        double read_bytes, write_bytes;
+    };
+    deque<Sample> samples; /* the latest ones, oldest first */
+    double sampled_cpu;    /* CPU seconds at the latest sample */
+
+    enum { MAX_SAMPLES = 60 };
+
+    Child(int pid_=0, XmlRpcDispatch* disp_=NULL):
+            pid(pid_), exited(false), code(0), waited(false), killing(false),
+            started(wall_clock()), ended(0), input(NULL), disp(disp_),
+            open_streams(0), orphan(false), sampled_cpu(0) {
+        output[0]=output[1]=NULL;
+        memset(&usage, 0, sizeof(usage));
     }
 
-    void execute(XmlRpcValue& /*params*/, XmlRpcValue& result) {
-    	result = _VERSION_;
+    /* record the exit of the child */
+    void exit(int code_, double ended_, const struct pusage& usage_) {
+        exited=true;
+        code=code_;
+        ended=ended_;
+        usage=usage_;
+#if defined(SIGXCPU)
+        if(code==0x100+SIGXCPU)
+            limit="cpu";
+        if(code==0x100+SIGXFSZ)
+            limit="fsize";
+#endif
+        /* the table removes the cgroup, out of its lock */
+        if(!cgroup.empty() && pcgroup_oom(cgroup.c_str()))
+            limit="memory";
     }
-};
 
-class M_system_uname: public XmlRpcServerMethod {
-public:
-    M_system_uname(XmlRpcServer* server = 0): XmlRpcServerMethod("system.uname", server) {}
+    /* record a sample taken at <now> */
+    void sampled(double now, const struct psample& s) {
+        double since=samples.empty()? started: samples.back().time;
+        Sample sample;
+        sample.time=now;
+        sample.cpu=now>since? 100*(s.cpu-sampled_cpu)/(now-since): 0;
+        sample.rss=s.rss;
+        sample.threads=s.threads;
+        sample.read_bytes=s.read_bytes;
+        sample.write_bytes=s.write_bytes;
+        sampled_cpu=s.cpu;
+        samples.push_back(sample);
+        if(samples.size()>MAX_SAMPLES)
+            samples.pop_front();
+    }
 
-    std::string help() {
-        return "system.uname(): return machine info";
+    static void sample_result(const Sample& s, XmlRpcValue& result) {
+        result["time"]=s.time;
+        result["cpu"]=s.cpu;
+        result["rss"]=(int)s.rss;
+        result["threads"]=s.threads;
+        result["read_bytes"]=s.read_bytes;
+        result["write_bytes"]=s.write_bytes;
     }
 
-    void execute(XmlRpcValue& /*params*/, XmlRpcValue& result) {
-    	struct utsname un;
-    	uname(&un);
-    	result["sysname"]=un.sysname;
-    	result["nodename"]=un.nodename;
-    	result["release"]=un.release;
-    	result["version"]=un.version;
-    	result["machine"]=un.machine;    	
+    /* an entry of process.list: the state, and the latest sample */
+    void summary(XmlRpcValue& result) const {
+        result["pid"]=pid;
+        result["running"]=!exited;
+        result["start"]=started;
+        XmlRpcValue& vargs=result["args"];
+        vargs.setSize((int)args.size());
+        for(size_t i=0; i<args.size(); ++i)
+            vargs[(int)i]=args[i];
+        if(exited)
+            result["exitcode"]=code;
+        else if(!samples.empty())
+            sample_result(samples.back(), result["sample"]);
     }
-};
 
-class M_system_getenv: public XmlRpcServerMethod {
-public:
+    /* the answer to process.status */
+    void status(XmlRpcValue& result) const {
+        result["pid"]=pid;
+        result["running"]=!exited;
+        result["start"]=started;
+        if(!exited) {
+            result["wall"]=wall_clock()-started;
+            return;
+        }
+        result["exitcode"]=code;
+        if(!limit.empty())
+            result["limit"]=limit;
+        result["end"]=ended;
+        result["wall"]=ended-started;
+        XmlRpcValue& ru=result["rusage"];
+        ru["utime"]=usage.utime;
+        ru["stime"]=usage.stime;
+        ru["maxrss"]=(int)usage.maxrss;
+        ru["majflt"]=(int)usage.majflt;
+        ru["nvcsw"]=(int)usage.nvcsw;
+        ru["nivcsw"]=(int)usage.nivcsw;
+    }
+
+    ~Child();
+
+    /* whether the child has exited and its pipes are closed */
+    bool finished() const {
+        return exited && open_streams==0;
+    }
+
+    /* XmlRpcThreadPool::Job: watch the pipes on the dispatcher thread */
+    void run() {}
+    void complete() {
+        for(int i=0; i<2; ++i)
+            if(output[i])
+                output[i]->watch(disp);
+    }
+};
+
+/* Removes the cgroup of a child which has exited from a timer of the
+   dispatcher thread, retrying for as long as processes the child left
+   behind take to die */
+class CgroupRemover: public XmlRpcThreadPool::Job, public XmlRpcSource {
+    string path_;
+    XmlRpcDispatch* disp_;
+    double delay_;
+
+    enum { MAX_DELAY_MS = 1000 };
+public:
+    CgroupRemover(const string& path, XmlRpcDispatch* disp):
+            path_(path), disp_(disp), delay_(0.001) {}
+
+    void run() {}
+
+    /* on the dispatcher thread */
+    void complete() {
+        handleEvent(XmlRpcDispatch::TimerEvent);
+    }
+
+    unsigned handleEvent(unsigned /*eventType*/) {
+        clear_error();
+        if(pcgroup_remove(path_.c_str())==0 || errno!=EBUSY) {
+            delete this;
+            return 0;
+        }
+        disp_->scheduleTimer(this, delay_);
+        delay_=min(2*delay_, MAX_DELAY_MS/1000.0);
+        return 0;
+    }
+};
+
+/* The children of the server, by pid. The table reaps them on the event
+   loop when SIGCHLD arrives, or polls where that cannot be selected on,
+   and keeps the last MAX_FINISHED finished ones. Worker threads share it
+   under lock(); the watchers and pipes belong to the dispatcher thread.
+   A child is reaped under the lock, so a pid found running under the
+   lock cannot have been reused. */
+class ChildTable: public XmlRpcSource {
+    typedef map<int, Child*> ChildMap;
+    ChildMap children_;
+    list<Child*> finished_; /* oldest first */
+    /* exits reaped before the spawner added the child */
+    struct Exit {
+        int code;
+        double ended;
+        struct pusage usage;
+    };
+    typedef map<int, Exit> ExitMap;
+    ExitMap unclaimed_;
+    XmlRpcMutex lock_;
+    XmlRpcServer* server_;
+    XmlRpcDispatch* disp_;
+    bool threaded_;
+
+    enum { MAX_FINISHED = 1024 };
+    static const double POLL_INTERVAL;
+    static const double UNCLAIMED_TTL;
+
+    /* called with the lock held */
+    void drop(Child* c) {
+        ChildMap::iterator it=children_.find(c->pid);
+        if(it!=children_.end() && it->second==c)
+            children_.erase(it);
+        finished_.remove(c);
+        if(c->open_streams==0)
+            delete c;
+        else
+            c->orphan=true;
+    }
+
+    /* called with the lock held */
+    void finish(Child* c) {
+        finished_.push_back(c);
+        if(finished_.size()>MAX_FINISHED)
+            drop(finished_.front());
+    }
+
+    /* defined after InputStream */
+    static bool shut_input(Child* c);
+
+    /* record the exits of all children which have exited */
+    void reap() {
+        int pid;
+        Exit e;
+        double now=wall_clock();
+        while((pid=pexited())>0) {
+            list<ExitWatcher*> watchers;
+            string cgroup;
+            e.ended=now;
+            {
+                XmlRpcMutex::Lock l(lock_);
+                Child* c=find(pid);
+                /* the grace period after SIGTERM ends with the child,
+                   while its pid still holds the group */
+                if(c && c->killing && !c->exited) {
+                    pkill(pid, 1);
+                    c->killing=false;
+                }
+                /* reaped meanwhile by a spawner whose exec failed, so
+                   pexited() no longer returns it */
+                if(preap(pid, &e.code, &e.usage)!=pid)
+                    continue;
+                if(!c) {
+                    unclaimed_[pid]=e;
+                    continue;
+                }
+                c->exit(e.code, e.ended, e.usage);
+                cgroup.swap(c->cgroup);
+                if(c->input && shut_input(c))
+                    --c->open_streams;
+                watchers.swap(c->watchers);
+                if(c->finished())
+                    finish(c);
+            }
+            remove_cgroup(cgroup);
+            for(list<ExitWatcher*>::iterator it=watchers.begin(); it!=watchers.end(); ++it)
+                (*it)->child_exited(pid);
+        }
+
+        /* not ours, or a failed exec */
+        XmlRpcMutex::Lock l(lock_);
+        for(ExitMap::iterator it=unclaimed_.begin(); it!=unclaimed_.end(); ) {
+            if(now-it->second.ended>UNCLAIMED_TTL)
+                unclaimed_.erase(it++);
+            else
+                ++it;
+        }
+    }
+
+public:
+    ChildTable(): server_(NULL), disp_(NULL), threaded_(false) {}
+
+    /* start reaping children on the event loop of <server>; <threaded>
+       tells whether worker threads run methods, rather than the
+       dispatcher thread */
+    void start(XmlRpcServer* server, bool threaded) {
+        server_=server;
+        disp_=server->getDispatch();
+        threaded_=threaded;
+        setfd(pchild_fd());
+        if(getfd()>=0)
+            disp_->addSource(this, XmlRpcDispatch::ReadableEvent);
+        else
+            disp_->scheduleTimer(this, POLL_INTERVAL);
+    }
+
+    /* the dispatcher the table runs on */
+    XmlRpcDispatch* dispatch() const { return disp_; }
+
+    /* hand <job> to the dispatcher thread, from any thread */
+    void post(XmlRpcThreadPool::Job* job) { server_->post(job); }
+
+    /* called by waiters polling from a private dispatcher: without worker
+       threads that runs on the dispatcher thread, which cannot reap */
+    void poll() {
+        if(!threaded_ && disp_)
+            reap();
+    }
+
+    XmlRpcMutex& lock() { return lock_; }
+
+    /* called with the lock held */
+    Child* find(int pid) {
+        ChildMap::iterator it=children_.find(pid);
+        return it==children_.end()? NULL: it->second;
+    }
+
+    /* remove the cgroup <path> of a child which has exited, if it has
+       one, from any thread */
+    void remove_cgroup(const string& path) {
+        if(!path.empty())
+            server_->post(new CgroupRemover(path, disp_));
+    }
+
+    /* add a child which has just been spawned */
+    void add(Child* c) {
+        string cgroup;
+        {
+            XmlRpcMutex::Lock l(lock_);
+            for(int i=0; i<2; ++i)
+                if(c->output[i])
+                    ++c->open_streams;
+            if(c->input)
+                ++c->open_streams;
+            Child* old=find(c->pid);
+            if(old)
+                drop(old); /* the pid has been reused */
+            children_[c->pid]=c;
+            ExitMap::iterator it=unclaimed_.find(c->pid);
+            if(it!=unclaimed_.end()) {
+                c->exit(it->second.code, it->second.ended, it->second.usage);
+                cgroup.swap(c->cgroup);
+                unclaimed_.erase(it);
+                if(c->input && shut_input(c))
+                    --c->open_streams;
+                if(c->finished())
+                    finish(c);
+            }
+        }
+        remove_cgroup(cgroup);
+    }
+
+    /* signal a running child and its group (see pkill); returns -1 with
+       ESRCH if it is not one of ours or has been reaped. With <later>,
+       the group is due a SIGKILL (see kill_due), and *started is set to
+       when the child started, which tells it from a later one with the
+       same pid. */
+    int kill(int pid, int force, bool later=false, double* started=NULL) {
+        XmlRpcMutex::Lock l(lock_);
+        Child* c=find(pid);
+        if(!c || c->exited) {
+            errno=ESRCH;
+            return -1;
+        }
+        int res=pkill(pid, force);
+        if(res==0 && later) {
+            c->killing=true;
+            *started=c->started;
+        }
+        return res;
+    }
+
+    /* the grace period of a child is over: SIGKILL its group, unless the
+       child has exited, when that has been done as it was reaped */
+    void kill_due(int pid, double started) {
+        XmlRpcMutex::Lock l(lock_);
+        Child* c=find(pid);
+        if(c && c->killing && !c->exited && c->started==started) {
+            pkill(pid, 1);
+            c->killing=false;
+        }
+    }
+
+    /* collect the exit code of a child: returns 1 and stores it in *code
+       if the child has exited, 0 if it is running, or -1 if it is not
+       in the table or has been waited for already */
+    int collect(int pid, int* code) {
+        XmlRpcMutex::Lock l(lock_);
+        Child* c=find(pid);
+        if(!c || c->waited)
+            return -1;
+        if(!c->exited)
+            return 0;
+        c->waited=true;
+        *code=c->code;
+        return 1;
+    }
+
+    /* collect the exit codes of several children at once, for
+       process.wait_any (<all> false) and process.wait_all: unless <now>,
+       only once one of them has exited, or all of them. Each exit is
+       stored in <exits> as (pid, code). Returns -1 and stores in *bad
+       the first of <pids> which is not in the table or has been waited
+       for, without collecting any */
+    int collect(const vector<int>& pids, bool all, bool now,
+                vector< pair<int, int> >& exits, int* bad) {
+        XmlRpcMutex::Lock l(lock_);
+        size_t exited=0;
+        for(size_t i=0; i<pids.size(); ++i) {
+            Child* c=find(pids[i]);
+            if(!c || c->waited) {
+                *bad=pids[i];
+                return -1;
+            }
+            if(c->exited)
+                ++exited;
+        }
+        if(!now && !pids.empty() && (all? exited<pids.size(): exited==0))
+            return 0;
+        for(size_t i=0; i<pids.size(); ++i) {
+            Child* c=find(pids[i]);
+            if(c->exited) {
+                c->waited=true;
+                exits.push_back(make_pair(pids[i], c->code));
+            }
+        }
+        return 0;
+    }
+
+    /* the answer to process.status; returns false if the child is not
+       in the table */
+    bool status(int pid, XmlRpcValue& result) {
+        XmlRpcMutex::Lock l(lock_);
+        Child* c=find(pid);
+        if(!c)
+            return false;
+        c->status(result);
+        return true;
+    }
+
+    /* the answer to process.list: the running children, or with <all>,
+       every child in the table */
+    void listing(bool all, XmlRpcValue& result) {
+        XmlRpcMutex::Lock l(lock_);
+        result.setSize(0);
+        for(ChildMap::iterator it=children_.begin(); it!=children_.end(); ++it)
+            if(all || !it->second->exited)
+                it->second->summary(result[result.size()]);
+    }
+
+    /* the answer to process.sample; returns false if the child is not
+       in the table */
+    bool samples(int pid, XmlRpcValue& result) {
+        XmlRpcMutex::Lock l(lock_);
+        Child* c=find(pid);
+        if(!c)
+            return false;
+        result["pid"]=pid;
+        result["running"]=!c->exited;
+        XmlRpcValue& vsamples=result["samples"];
+        vsamples.setSize((int)c->samples.size());
+        for(size_t i=0; i<c->samples.size(); ++i)
+            Child::sample_result(c->samples[i], vsamples[(int)i]);
+        return true;
+    }
+
+    /* the pids of the running children */
+    void running(vector<int>& pids) {
+        XmlRpcMutex::Lock l(lock_);
+        for(ChildMap::iterator it=children_.begin(); it!=children_.end(); ++it)
+            if(!it->second->exited)
+                pids.push_back(it->first);
+    }
+
+    /* record a sample of a running child */
+    void sampled(int pid, double now, const struct psample& s) {
+        XmlRpcMutex::Lock l(lock_);
+        Child* c=find(pid);
+        if(c && !c->exited)
+            c->sampled(now, s);
+    }
+
+    /* have <w> told when the child exits; returns false if it has
+       exited already (or is unknown). Dispatcher thread only. */
+    bool watch(int pid, ExitWatcher* w) {
+        XmlRpcMutex::Lock l(lock_);
+        Child* c=find(pid);
+        if(!c || c->exited)
+            return false;
+        c->watchers.push_back(w);
+        return true;
+    }
+
+    void unwatch(int pid, ExitWatcher* w) {
+        XmlRpcMutex::Lock l(lock_);
+        Child* c=find(pid);
+        if(c)
+            c->watchers.remove(w);
+    }
+
+    /* called on the dispatcher thread when a pipe of the child is closed;
+       the child may be deleted */
+    void stream_closed(Child* c) {
+        XmlRpcMutex::Lock l(lock_);
+        if(--c->open_streams>0)
+            return;
+        if(c->orphan)
+            delete c;
+        else if(c->exited)
+            finish(c);
+    }
+
+    /* SIGCHLD has arrived, or it is time to poll */
+    unsigned handleEvent(unsigned eventType) {
+        if(eventType==XmlRpcDispatch::TimerEvent) {
+            disp_->scheduleTimer(this, POLL_INTERVAL);
+        } else {
+            char buf[64];
+            while(read(getfd(), buf, sizeof(buf))>0)
+                ;
+        }
+        reap();
+        return XmlRpcDispatch::ReadableEvent;
+    }
+
+    /* the SIGCHLD pipe stays open for the life of the process */
+    void close() {
+        setfd(-1);
+    }
+};
+
+const double ChildTable::POLL_INTERVAL=0.05;
+const double ChildTable::UNCLAIMED_TTL=10.0;
+
+static ChildTable children;
+
+/* Samples the resources used by the running children from a timer of
+   the dispatcher thread, for process.list and process.sample. Children
+   are only reaped on that thread, so a pid sampled is still the child's */
+class Sampler: public XmlRpcSource {
+    XmlRpcDispatch* disp_;
+    double interval_;
+public:
+    Sampler(): disp_(NULL), interval_(0) {}
+
+    /* sample every <interval_ms>, if positive */
+    void start(XmlRpcDispatch* disp, int interval_ms) {
+        disp_=disp;
+        interval_=interval_ms/1000.0;
+        if(interval_>0)
+            disp_->scheduleTimer(this, interval_);
+    }
+
+    /* seconds between samples, 0 if there are none */
+    double interval() const { return interval_; }
+
+    unsigned handleEvent(unsigned /*eventType*/) {
+        vector<int> pids;
+        children.running(pids);
+        double now=wall_clock();
+        for(size_t i=0; i<pids.size(); ++i) {
+            struct psample s;
+            if(psample(pids[i], &s)==0)
+                children.sampled(pids[i], now, s);
+        }
+        disp_->scheduleTimer(this, interval_);
+        return 0;
+    }
+};
+
+static Sampler sampler;
+
+/* Sends SIGKILL to the process group of a child once the grace period
+   after SIGTERM is over, from a timer of the dispatcher thread. The
+   period ends early when the child exits: the table kills the group
+   before reaping the child, while its pid cannot have been reused. */
+class Terminator: public XmlRpcThreadPool::Job, public XmlRpcSource {
+    int pid_;
+    double started_;
+    double grace_;
+public:
+    Terminator(int pid, double started, double grace):
+            pid_(pid), started_(started), grace_(grace) {}
+
+    void run() {}
+
+    /* on the dispatcher thread */
+    void complete() {
+        children.dispatch()->scheduleTimer(this, grace_);
+    }
+
+    unsigned handleEvent(unsigned /*eventType*/) {
+        children.kill_due(pid_, started_);
+        delete this;
+        return 0;
+    }
+};
+
+/* terminate a child and its process group: SIGTERM at once, SIGKILL
+   after <grace_ms> (the kill_grace_ms of ExecServer.conf if negative),
+   or once the child exits if that is sooner */
+static int terminate(int pid, int grace_ms=-1) {
+    if(grace_ms<0)
+        grace_ms=cfg()->kill_grace_ms;
+    double started;
+    int res=children.kill(pid, grace_ms==0, grace_ms>0, &started);
+    if(res==0 && grace_ms>0)
+        children.post(new Terminator(pid, started, grace_ms/1000.0));
+    return res;
+}
+
+/* A process.read waiting for output on the event loop */
+class OutputWaiter: public XmlRpcSource {
+    XmlRpcDeferred* deferred_;
+    XmlRpcDispatch* disp_;
+    OutputStream* stream_;
+    unsigned long offset_;
+    bool binary_;
+
+public:
+    OutputWaiter(OutputStream* stream, unsigned long offset, bool binary,
+                 double timeout, XmlRpcDeferred* deferred):
+            deferred_(deferred), disp_(deferred->dispatch()),
+            stream_(stream), offset_(offset), binary_(binary) {
+        stream_->addWaiter(this);
+        disp_->scheduleTimer(this, timeout);
+    }
+
+    ~OutputWaiter() {
+        disp_->cancelTimer(this);
+    }
+
+    /* answer with the output there is, and delete the waiter */
+    void answer() {
+        XmlRpcValue result;
+        {
+            XmlRpcMutex::Lock l(children.lock());
+            stream_->result(offset_, binary_, result);
+        }
+        deferred_->succeed(result);
+        delete this;
+    }
+
+    /* the wait has timed out */
+    unsigned handleEvent(unsigned /*eventType*/) {
+        stream_->removeWaiter(this);
+        answer();
+        return 0;
+    }
+};
+
+void OutputStream::received(const char* data, size_t size) {
+    {
+        XmlRpcMutex::Lock l(children.lock());
+        buf_.append(data, size);
+    }
+    wakeup();
+}
+
+void OutputStream::closed() {
+    {
+        XmlRpcMutex::Lock l(children.lock());
+        eof_=true;
+    }
+    wakeup();
+    children.stream_closed(child_);
+}
+
+void OutputStream::wakeup() {
+    list<OutputWaiter*> waiters;
+    waiters.swap(waiters_);
+    for(list<OutputWaiter*>::iterator it=waiters.begin(); it!=waiters.end(); ++it)
+        (*it)->answer();
+}
+
+void OutputStream::result(unsigned long offset, bool binary, XmlRpcValue& result) const {
+    unsigned long lost=0;
+    if(offset<buf_.start()) {
+        lost=buf_.start()-offset;
+        offset=buf_.start();
+    }
+    if(offset>buf_.end())
+        offset=buf_.end();
+    string data;
+    buf_.read(offset, data);
+    if(binary)
+        result["data"]=XmlRpcValue((void*)data.data(), (int)data.size());
+    else
+        result["data"]=data;
+    result["offset"]=(int)(offset+data.size());
+    result["lost"]=(int)lost;
+    result["eof"]=eof_ && offset+data.size()==buf_.end();
+}
+
+/* The server end of a pipe to a child's stdin, for process.write: what
+   the pipe does not take at once is buffered up to a limit and written
+   on the event loop. Shared with worker threads under the child table
+   lock; it is watched on the dispatcher thread only while there is
+   something to write. */
+class InputStream: public XmlRpcSource {
+    Child* child_;
+    XmlRpcDispatch* disp_;
+    string buf_;
+    size_t pos_;      /* written part of buf_ */
+    size_t limit_;
+    bool armed_;      /* watched, or about to be */
+    bool registered_; /* watched */
+    bool closing_;    /* close once everything is written */
+    bool broken_;     /* the child has closed its end */
+
+    /* write what the pipe takes */
+    void flush() {
+        while(pos_<buf_.size()) {
+            int nw=::write(getfd(), buf_.data()+pos_, buf_.size()-pos_);
+            if(nw>0) {
+                pos_+=nw;
+            } else if(nw<0 && errno==EINTR) {
+                continue;
+            } else if(nw<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+                break;
+            } else {
+                broken_=true;
+                pos_=buf_.size();
+            }
+        }
+        if(pos_==buf_.size()) {
+            buf_.clear();
+            pos_=0;
+        } else if(pos_>buf_.size()/2) {
+            buf_.erase(0, pos_);
+            pos_=0;
+        }
+    }
+
+public:
+    InputStream(int fd, Child* child, XmlRpcDispatch* disp, size_t limit):
+        XmlRpcSource(fd), child_(child), disp_(disp), pos_(0), limit_(limit),
+        armed_(false), registered_(false), closing_(false), broken_(false) {}
+
+    /* bytes accepted but not written yet; called with the lock held */
+    size_t buffered() const { return buf_.size()-pos_; }
+    size_t room() const { return limit_>buffered()? limit_-buffered(): 0; }
+
+    /* whether process.write may still be called; with the lock held */
+    bool writable() const { return getfd()>=0 && !closing_ && !broken_; }
+
+    /* write what the pipe takes, and buffer what there is room for.
+       Returns the number of bytes accepted, or -1 if the pipe is broken.
+       *arm is set if the caller must post an InputArm once it has
+       released the lock. Called with the lock held */
+    int write(const char* data, size_t size, bool* arm) {
+        size_t taken=0;
+        flush();
+        while(!broken_ && buffered()==0 && taken<size) {
+            int nw=::write(getfd(), data+taken, size-taken);
+            if(nw>0)
+                taken+=nw;
+            else if(nw<0 && errno==EINTR)
+                continue;
+            else if(nw<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+                break;
+            else
+                broken_=true;
+        }
+        if(broken_)
+            return -1;
+        size_t n=size-taken;
+        if(n>room())
+            n=room();
+        buf_.append(data+taken, n);
+        size=taken+n;
+        *arm=buffered()>0 && !armed_;
+        if(*arm)
+            armed_=true;
+        return (int)size;
+    }
+
+    /* process.close_stdin: returns true if the pipe has been closed at
+       once, and the caller must call stream_closed once it has released
+       the lock; otherwise it is closed when the buffer has been written.
+       Called with the lock held */
+    bool close_stdin() {
+        if(getfd()<0 || closing_)
+            return false;
+        closing_=true;
+        if(armed_)
+            return false;
+        close();
+        return true;
+    }
+
+    /* the child has exited: stop writing; returns true if the pipe was
+       open. Called on the dispatcher thread with the lock held */
+    bool shut() {
+        if(getfd()<0)
+            return false;
+        if(registered_)
+            disp_->removeSource(this);
+        registered_=false;
+        close();
+        return true;
+    }
+
+    /* start watching the pipe; on the dispatcher thread with the lock held */
+    void arm() {
+        if(getfd()>=0 && !registered_) {
+            disp_->addSource(this, XmlRpcDispatch::WritableEvent);
+            registered_=true;
+        }
+    }
+
+    unsigned handleEvent(unsigned /*eventType*/) {
+        Child* c=child_;
+        {
+            XmlRpcMutex::Lock l(children.lock());
+            flush();
+            if(buffered()>0)
+                return XmlRpcDispatch::WritableEvent;
+            disp_->removeSource(this);
+            registered_=armed_=false;
+            if(!closing_ && !broken_)
+                return 0;
+            close();
+        }
+        children.stream_closed(c); /* may delete the stream */
+        return 0;
+    }
+};
+
+/* Starts watching the stdin pipe of a child on the dispatcher thread */
+class InputArm: public XmlRpcThreadPool::Job {
+    int pid_;
+public:
+    InputArm(int pid): pid_(pid) {}
+
+    void run() {}
+
+    void complete() {
+        {
+            XmlRpcMutex::Lock l(children.lock());
+            Child* c=children.find(pid_);
+            if(c && c->input)
+                c->input->arm();
+        }
+        delete this;
+    }
+};
+
+Child::~Child() {
+    for(int i=0; i<2; ++i)
+        delete output[i];
+    delete input;
+}
+
+bool ChildTable::shut_input(Child* c) {
+    return c->input->shut();
+}
+
+/* Zygotes of process.zygote: children whose args start with the prefix
+   of one are spawned through it */
+class Zygote {
+public:
+    vector<string> prefix, envs;
+    int fd, pid;
+    bool dead;
+    XmlRpcMutex lock; /* one request at a time */
+
+    Zygote(const vector<string>& prefix_, const vector<string>& envs_, int fd_, int pid_):
+            prefix(prefix_), envs(envs_), fd(fd_), pid(pid_), dead(false) {}
+
+    bool matches(const vector<string>& args) const {
+        return args.size()>=prefix.size()
+            && std::equal(prefix.begin(), prefix.end(), args.begin());
+    }
+};
+
+class ZygoteTable {
+    list<Zygote*> zygotes_; /* kept for the life of the server */
+    XmlRpcMutex lock_;
+public:
+    /* the zygote with the longest prefix of <args>, or NULL */
+    Zygote* find(const vector<string>& args) {
+        XmlRpcMutex::Lock l(lock_);
+        Zygote* best=NULL;
+        for(list<Zygote*>::iterator it=zygotes_.begin(); it!=zygotes_.end(); ++it)
+            if(!(*it)->dead && (*it)->matches(args)
+                    && (!best || (*it)->prefix.size()>best->prefix.size()))
+                best=*it;
+        return best;
+    }
+
+    /* the zygote for <prefix>, started if there is none yet; the env of
+       an existing one is replaced if <set_env>. Throws if zygotes are
+       not supported */
+    Zygote* start(const vector<string>& prefix, const vector<string>& envs, bool set_env) {
+        XmlRpcMutex::Lock l(lock_);
+        for(list<Zygote*>::iterator it=zygotes_.begin(); it!=zygotes_.end(); ++it)
+            if(!(*it)->dead && (*it)->prefix==prefix) {
+                if(set_env) {
+                    XmlRpcMutex::Lock zl((*it)->lock);
+                    (*it)->envs=envs;
+                }
+                return *it;
+            }
+        int pid;
+        clear_error();
+        int fd=pzygote(&pid);
+        if(fd<0)
+            throw_on_os_error("zygote");
+        Zygote* z=new Zygote(prefix, envs, fd, pid);
+        zygotes_.push_back(z);
+        return z;
+    }
+
+    /* spawn through the zygote of <args>; returns 0 if there is none,
+       or the zygote has gone, and -1 if the spawn failed */
+    int spawn(const vector<string>& args, const vector<string>& envs, const string& cwd,
+              int fdin, int fdout, int fderr, const struct plimits* limits) {
+        Zygote* z=find(args);
+        if(!z)
+            return 0;
+        XmlRpcMutex::Lock l(z->lock);
+        if(z->dead)
+            return 0;
+        vector<string> env(z->envs);
+        env.insert(env.end(), envs.begin(), envs.end());
+        int pid=pzygote_spawn(z->fd, strlist(args), strlist(env), str(cwd),
+                              fdin, fdout, fderr, limits);
+        if(pid<0 && errno==EPIPE) {
+            z->dead=true;
+            close(z->fd);
+            return 0;
+        }
+        return pid;
+    }
+};
+
+static ZygoteTable zygotes;
+
+/* arguments and options of process.spawn */
+class SpawnRequest {
+public:
+    vector<string> args, envs;
+    string cwd, fin, fout, ferr;
+    double timeout;
+    bool pipe, stdin_pipe, rusage;
+    int buffer_size;
+    struct plimits limits;
+    double memory_max, cpu_max; /* of the child's cgroup */
+
+    enum { BUFFER_SIZE = 1024*1024 };
+
+    SpawnRequest(): timeout(0), pipe(false), stdin_pipe(false), rusage(false),
+            buffer_size(BUFFER_SIZE), memory_max(0), cpu_max(0) {
+        limits.as=limits.cpu=limits.nofile=limits.nproc=limits.fsize=-1;
+        limits.cgroup=NULL;
+    }
+
+    /* whether the child is to be limited */
+    bool limited() const {
+        return limits.as>=0 || limits.cpu>=0 || limits.nofile>=0 || limits.nproc>=0
+            || limits.fsize>=0 || memory_max>0 || cpu_max>0;
+    }
+
+    /* parse the limits option */
+    void parse_limits(XmlRpcValue& v) {
+        struct { const char* name; double* value; } fields[]={
+            { "as", &limits.as }, { "cpu", &limits.cpu }, { "nofile", &limits.nofile },
+            { "nproc", &limits.nproc }, { "fsize", &limits.fsize },
+            { "memory_max", &memory_max }, { "cpu_max", &cpu_max }
+        };
+        for(size_t i=0; i<sizeof(fields)/sizeof(fields[0]); ++i)
+            if(v.hasMember(fields[i].name))
+                *fields[i].value=seconds(v[fields[i].name]);
+    }
+
+    /* whether an asynchronous child keeps pipes in the server */
+    bool piped() const { return pipe || stdin_pipe; }
+
+    /* parse (args, [timeout], [options]) */
+    void parse(XmlRpcValue& params) {
+        try {
+            XmlRpcValue& vargs=params[0];
+            switch(vargs.getType()) {
+            case XmlRpcValue::TypeArray:
+                for(int i=0; i<vargs.size(); ++i) {
+                    args.push_back(string(vargs[i]));
+                }
+                break;
+            case XmlRpcValue::TypeString:
+                args.push_back(string(vargs));
+                break;
+            default:
+                throw XmlRpcException("parameters error");
+            }
+            if(params.size()>1) {
+                timeout=seconds(params[1]);
+            }
+            if(params.size()>2) {
+                XmlRpcValue& vopts=params[2];
+                if(vopts.hasMember("cwd"))
+                    cwd=string(vopts["cwd"]);
+                if(vopts.hasMember("stdin"))
+                    fin=string(vopts["stdin"]);
+                if(vopts.hasMember("stdout"))
+                    fout=string(vopts["stdout"]);
+                if(vopts.hasMember("stderr"))
+                    ferr=string(vopts["stderr"]);
+                if(vopts.hasMember("pipe"))
+                    pipe=bool(vopts["pipe"]);
+                if(vopts.hasMember("stdin_pipe"))
+                    stdin_pipe=bool(vopts["stdin_pipe"]);
+                if(vopts.hasMember("buffer_size"))
+                    buffer_size=int(vopts["buffer_size"]);
+                if(vopts.hasMember("rusage"))
+                    rusage=bool(vopts["rusage"]);
+                if(vopts.hasMember("limits"))
+                    parse_limits(vopts["limits"]);
+                if(vopts.hasMember("env")) {
+                    XmlRpcValue& venv=vopts["env"];
+                    vector<string> keys=venv.keys();
+                    for(vector<string>::const_iterator p=keys.begin();
+                    	    p!=keys.end(); ++p) {
+                    	envs.push_back(*p+string("=")+string(venv[*p]));
+              	    }
+                }
+            }
+
+        } catch(...) {
+            throw XmlRpcException("parameters error");
+        }
+        if(buffer_size<0)
+            throw XmlRpcException("parameters error");
+
+        /* children start in the client's directory */
+        const Session& s=Session::current();
+        cwd=cwd.empty()? s.path(): s.resolve(cwd);
+        fin=s.resolve(fin);
+        fout=s.resolve(fout);
+        ferr=s.resolve(ferr);
+    }
+
+    /* start the process, return its pid */
+    int spawn() {
+        if(zygotes.find(args) || limited())
+            return spawn(-1, -1, -1);
+        clear_error();
+        int pid=pspawn(strlist(args), strlist(envs), str(cwd),
+                       str(fin), str(fout), str(ferr));
+        if(pid<0)
+            throw_on_os_error("exec");
+        Child* c=new Child(pid);
+        c->args=args;
+        children.add(c);
+        return pid;
+    }
+
+    /* start the process with descriptors for those standard streams
+       which are not -1, and the files of the options for the others;
+       <c> is the table entry to use, if it has been prepared */
+    int spawn(int fdin, int fdout, int fderr, Child* c=NULL) {
+        int fds[3]={ fdin, fdout, fderr };
+        const string* files[3]={ &fin, &fout, &ferr };
+        int opened[3]={ -1, -1, -1 };
+        int pid=-1;
+        Path cgroup;
+        struct plimits lim=limits;
+        clear_error();
+        if((memory_max>0 || cpu_max>0)) {
+            if(pcgroup_create(memory_max, cpu_max, cgroup, cgroup.size())<0)
+                throw_on_os_error("cgroup");
+            lim.cgroup=cgroup;
+        }
+        const struct plimits* plim=limited()? &lim: NULL;
+        int i;
+        for(i=0; i<3; ++i) {
+            if(fds[i]<0 && (fds[i]=opened[i]=pstdfd(str(*files[i]), i>0))<0)
+                break;
+        }
+        if(i==3 && (pid=zygotes.spawn(args, envs, cwd, fds[0], fds[1], fds[2], plim))==0)
+            pid=pspawn_fd(strlist(args), strlist(envs), str(cwd),
+                          fds[0], fds[1], fds[2], plim);
+        int e=errno;
+        for(i=0; i<3; ++i) {
+            if(opened[i]>=0)
+                close(opened[i]);
+        }
+        if(pid<0 && lim.cgroup)
+            children.remove_cgroup(lim.cgroup);
+        errno=e;
+        if(pid<0)
+            throw_on_os_error("exec");
+        if(!c)
+            c=new Child;
+        c->pid=pid;
+        c->args=args;
+        if(lim.cgroup)
+            c->cgroup=lim.cgroup;
+        children.add(c);
+        return pid;
+    }
+};
+
+/* Receives the outcome of a child watched by SpawnWaiter */
+class SpawnListener {
+public:
+    virtual ~SpawnListener() {}
+    /* the child has exited with <res> */
+    virtual void exited(int res)=0;
+    /* the timeout has expired, the child is still running */
+    virtual void timed_out(int pid)=0;
+    /* the child is not in the table, or someone else has waited for it */
+    virtual void lost()=0;
+};
+
+/* Waits on the event loop for a child to exit, up to a timeout, and
+   collects its exit code. On the server's dispatcher the child table
+   tells it of the exit; on a private one (see SyncDeferred) it polls. */
+class SpawnWaiter: public XmlRpcSource, public ExitWatcher {
+    SpawnListener* listener_;
+    XmlRpcDispatch* disp_;
+    int pid_;
+    double deadline_; /* <0: no timeout */
+    bool watching_;
+
+    static const double POLL_INTERVAL;
+
+    /* notify the listener and delete the waiter if the wait is over */
+    void check() {
+        int code;
+        if(!watching_)
+            children.poll();
+        int r=children.collect(pid_, &code);
+        if(r>0)
+            listener_->exited(code);
+        else if(r<0)
+            listener_->lost();
+        else if(deadline_>=0 && disp_->getTime()>=deadline_)
+            listener_->timed_out(pid_);
+        else {
+            if(!watching_)
+                disp_->scheduleTimer(this, POLL_INTERVAL);
+            return;
+        }
+        delete this;
+    }
+
+public:
+    SpawnWaiter(int pid, double timeout, XmlRpcDispatch* disp, SpawnListener* listener):
+            listener_(listener), disp_(disp), pid_(pid) {
+        deadline_=timeout>0? disp_->getTime()+timeout: -1;
+        watching_=disp_==children.dispatch() && children.watch(pid_, this);
+        if(!watching_)
+            disp_->scheduleTimer(this, 0); /* check at once, or start polling */
+        else if(timeout>0)
+            disp_->scheduleTimer(this, timeout);
+    }
+
+    ~SpawnWaiter() {
+        disp_->cancelTimer(this);
+        if(watching_)
+            children.unwatch(pid_, this);
+    }
+
+    void child_exited(int /*pid*/) {
+        watching_=false;
+        check();
+    }
+
+    unsigned handleEvent(unsigned /*eventType*/) {
+        check();
+        return 0;
+    }
+};
+
+const double SpawnWaiter::POLL_INTERVAL=0.01;
+
+/* Answers a deferred process.spawn with the exit code of the child,
+   which is killed if the client disconnects */
+class SpawnAnswer: public SpawnListener, public XmlRpcCancellable {
+    XmlRpcDeferred* deferred_;
+    int pid_;
+    bool status_;
+public:
+    /* <status>: answer with the struct of process.status, rather than
+       the exit code */
+    SpawnAnswer(XmlRpcDeferred* deferred, int pid, bool status):
+            deferred_(deferred), pid_(pid), status_(status) {
+        deferred_->setCancellable(this);
+    }
+
+    void cancel() {
+        terminate(pid_);
+    }
+
+    void exited(int res) {
+        XmlRpcValue result(res);
+        if(status_) {
+            result.clear();
+            children.status(pid_, result);
+        }
+        deferred_->succeed(result);
+        delete this;
+    }
+
+    void timed_out(int pid) {
+        terminate(pid);
+        deferred_->fail("Process killed on timeout");
+        delete this;
+    }
+
+    void lost() {
+        deferred_->fail("wait: the process has been waited for already");
+        delete this;
+    }
+};
+
+/* Runs a deferred method to completion on a private dispatcher,
+   for callers which need the result at once (e.g. system.multicall).
+   Work which can be cancelled is, once the client has disconnected. */
+class SyncDeferred: public XmlRpcDeferred {
+    XmlRpcDispatch disp_;
+    XmlRpcValue& result_;
+    string error_;
+    int code_;
+    bool failed_;
+    XmlRpcCancellable* cancellable_;
+
+    static const double CHECK_INTERVAL;
+public:
+    SyncDeferred(XmlRpcValue& result): result_(result), code_(0), failed_(false),
+            cancellable_(NULL) {}
+
+    void succeed(XmlRpcValue& result) {
+        result_=result;
+        cancellable_=NULL;
+    }
+
+    void fail(string const& msg, int errorCode) {
+        error_=msg;
+        code_=errorCode;
+        failed_=true;
+        cancellable_=NULL;
+    }
+
+    XmlRpcDispatch* dispatch() {
+        return &disp_;
+    }
+
+    void setCancellable(XmlRpcCancellable* c) {
+        cancellable_=c;
+    }
+
+    /* work until everything the method started has finished */
+    void wait() {
+        while(cancellable_) {
+            disp_.work(CHECK_INTERVAL);
+            if(cancellable_ && XmlRpcSession::clientGone()) {
+                XmlRpcCancellable* c=cancellable_;
+                cancellable_=NULL;
+                c->cancel();
+            }
+        }
+        disp_.work(-1.0);
+        if(failed_)
+            throw XmlRpcException(error_, code_);
+    }
+};
+
+const double SyncDeferred::CHECK_INTERVAL=0.1;
+
+/* The server end of a pipe to a child's stdin: feeds it the data,
+   then closes the pipe. A child which exits early gets no more. */
+class PipeWriter: public XmlRpcSource {
+    string data_;
+    size_t written_;
+
+public:
+    PipeWriter(int fd, const string& data):
+        XmlRpcSource(fd), data_(data), written_(0) {}
+
+    void finish(XmlRpcDispatch* disp) {
+        disp->removeSource(this);
+        close();
+    }
+
+    unsigned handleEvent(unsigned /*eventType*/) {
+        while(written_<data_.size()) {
+            int nw=write(getfd(), data_.data()+written_, data_.size()-written_);
+            if(nw>0)
+                written_+=nw;
+            else if(nw<0 && errno==EINTR)
+                continue;
+            else if(nw<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+                return XmlRpcDispatch::WritableEvent;
+            else
+                break; /* EPIPE: the child has closed its stdin */
+        }
+        return 0;
+    }
+};
+
+/* reads the whole file <path> into <data>; false if it cannot be read */
+static bool read_file(const string& path, string& data) {
+    FileHolder f=fopen(path.c_str(), "rb");
+    if(!f)
+        return false;
+    data.clear();
+    char buf[64*1024];
+    size_t nr;
+    while((nr=fread(buf, 1, sizeof(buf), f))>0)
+        data.append(buf, nr);
+    return !ferror(f);
+}
+
+/* feeds the contents of a file to <sha1> a buffer at a time */
+static bool hash_file(const string& path, SHA1& sha1) {
+    FileHolder f=fopen(path.c_str(), "rb");
+    if(!f)
+        return false;
+    char buf[64*1024];
+    size_t nr;
+    while((nr=fread(buf, 1, sizeof(buf), f))>0)
+        sha1.Input(buf, (unsigned)nr);
+    return !ferror(f);
+}
+
+static bool write_file(const string& path, const string& data) {
+    FileHolder f=fopen(path.c_str(), "wb");
+    return f && fwrite(data.data(), 1, data.size(), f)==data.size() && fflush(f)==0;
+}
+
+/* What a process.run with the cache option is memoized by: the
+   directory of the child, the args, the variables set by the env option
+   and the selected ones of the server's environment, the input to stdin
+   or the name and contents of the stdin file, the binary and limit
+   options, and the names and contents of the declared input files. The
+   declared output files are stored with the result, and restored on a hit */
+class CachedRun {
+    /* feeds <s> to <sha1>, prefixed by its length so that fields
+       cannot run into each other */
+    static void feed(SHA1& sha1, const string& s) {
+        char len[16];
+        snprintf(len, sizeof(len), "%u:", (unsigned)s.size());
+        sha1.Input(len, (unsigned)strlen(len));
+        sha1.Input(s.data(), (unsigned)s.size());
+    }
+
+    static void feed(SHA1& sha1, const vector<string>& vs) {
+        char n[16];
+        snprintf(n, sizeof(n), "%u", (unsigned)vs.size());
+        feed(sha1, n);
+        for(size_t i=0; i<vs.size(); ++i)
+            feed(sha1, vs[i]);
+    }
+
+public:
+    vector<string> args;
+    vector<string> envs;     /* NAME=value set by the env option */
+    vector<string> env;      /* NAME=value, or NAME if it is not set */
+    vector<string> inputs, outputs;
+    string input;
+    bool has_input;
+    string fin;              /* the stdin file, if any */
+    bool binary;
+    int out_limit, err_limit;
+    string dir;              /* of the child: relative inputs and outputs
+                                are there; empty for the start directory */
+    string cwd;              /* of the child, absolute */
+    string key;              /* once computed */
+
+    CachedRun(): has_input(false), binary(false), out_limit(0), err_limit(0) {}
+
+    string path(const string& name) const {
+        if(dir.empty() || name.empty() || is_absolute(name))
+            return name;
+        return dir+DIR_SEPARATOR+name;
+    }
+
+    /* hashes the input files into the key; returns false if one
+       cannot be read, in which case the call is not memoized */
+    bool compute_key() {
+        SHA1 sha1;
+        feed(sha1, "process.run 3");
+        feed(sha1, cwd);
+        feed(sha1, args);
+        feed(sha1, envs);
+        feed(sha1, env);
+        feed(sha1, has_input? "input": "no input");
+        feed(sha1, input);
+        feed(sha1, fin);
+        if(!fin.empty()) {
+            SHA1 content;
+            if(!hash_file(path(fin), content))
+                return false;
+            feed(sha1, hexdigest(content));
+        }
+        char opts[64];
+        snprintf(opts, sizeof(opts), "%d %d %d", binary? 1: 0, out_limit, err_limit);
+        feed(sha1, opts);
+        feed(sha1, inputs);
+        for(size_t i=0; i<inputs.size(); ++i) {
+            SHA1 content;
+            if(!hash_file(path(inputs[i]), content))
+                return false;
+            feed(sha1, hexdigest(content));
+        }
+        feed(sha1, outputs);
+        key=hexdigest(sha1);
+        return true;
+    }
+};
+
+/* The store of the results memoized by process.run, in cache_dir:
+   objects, named by the SHA1 of their contents, and entries, named by
+   their key with ".run", which list the exit code and the objects of
+   stdout, stderr and the output files:
+
+       exitcode <n>
+       stdout <sha1>
+       stderr <sha1>
+       output <sha1> <name>
+
+   The entries used least recently are evicted, with the objects no other
+   entry refers to, to keep the store within cache_size_mb. Files are
+   written under temporary names and renamed, so a crash leaves no partial
+   ones. The file IO is done on the calling thread, which is a worker
+   when there are any; the index is shared under the lock. */
+class RunCache {
+public:
+    /* a memoized result */
+    struct Result {
+        int code;
+        string out, err;
+        vector< pair<string, string> > outputs; /* (name, contents) */
+        Result(): code(0) {}
+    };
+
+private:
+    struct Entry {
+        int code;
+        string out, err;                         /* objects */
+        vector< pair<string, string> > outputs;  /* (name, object) */
+        double size;                             /* of the entry file */
+        list<string>::iterator lru;
+        Entry(): code(0), size(0) {}
+    };
+
+    struct Object {
+        int refs;
+        double size;
+        Object(): refs(0), size(0) {}
+    };
+
+    XmlRpcMutex lock_;
+    XmlRpcServer* server_;
+    bool threaded_;
+    string dir_;   /* empty if the store cannot be used */
+    double limit_, size_;
+    map<string, Entry> entries_;
+    map<string, Object> objects_;
+    list<string> lru_; /* keys, the most recently used first */
+    unsigned tmpseq_;
+
+    string object_path(const string& name) const {
+        return dir_+DIR_SEPARATOR+name;
+    }
+
+    string entry_path(const string& key) const {
+        return dir_+DIR_SEPARATOR+key+".run";
+    }
+
+    static bool is_digest(const string& s) {
+        if(s.size()!=40)
+            return false;
+        for(size_t i=0; i<s.size(); ++i)
+            if(!isxdigit((unsigned char)s[i]))
+                return false;
+        return true;
+    }
+
+    static string format(const Entry& e) {
+        stringstream ss;
+        ss << "exitcode " << e.code << "\n"
+           << "stdout " << e.out << "\n"
+           << "stderr " << e.err << "\n";
+        for(size_t i=0; i<e.outputs.size(); ++i)
+            ss << "output " << e.outputs[i].second << " " << e.outputs[i].first << "\n";
+        return ss.str();
+    }
+
+    static bool parse(const string& text, Entry& e) {
+        stringstream ss(text);
+        string line;
+        bool code=false;
+        while(getline(ss, line)) {
+            string::size_type sp=line.find(' ');
+            if(sp==string::npos)
+                return false;
+            string field=line.substr(0, sp), value=line.substr(sp+1);
+            if(field=="exitcode") {
+                e.code=atoi(value.c_str());
+                code=true;
+            } else if(field=="stdout") {
+                e.out=value;
+            } else if(field=="stderr") {
+                e.err=value;
+            } else if(field=="output" && value.size()>41 && value[40]==' ') {
+                e.outputs.push_back(make_pair(value.substr(41), value.substr(0, 40)));
+            } else {
+                return false;
+            }
+        }
+        if(!code || !is_digest(e.out) || !is_digest(e.err))
+            return false;
+        for(size_t i=0; i<e.outputs.size(); ++i)
+            if(!is_digest(e.outputs[i].second))
+                return false;
+        return true;
+    }
+
+    /* the objects of an entry */
+    static vector<string> objects(const Entry& e) {
+        vector<string> names;
+        names.push_back(e.out);
+        names.push_back(e.err);
+        for(size_t i=0; i<e.outputs.size(); ++i)
+            names.push_back(e.outputs[i].second);
+        return names;
+    }
+
+    /* takes a reference to each of <names>; an object which is new
+       to the index has the size of the matching <sizes> */
+    void ref(const vector<string>& names, const vector<double>& sizes) {
+        for(size_t i=0; i<names.size(); ++i) {
+            Object& o=objects_[names[i]];
+            if(o.refs++==0) {
+                o.size=sizes[i];
+                size_+=o.size;
+            }
+        }
+    }
+
+    /* drops a reference to each of <names>, removing the objects
+       which are left without any */
+    void unref(const vector<string>& names) {
+        for(size_t i=0; i<names.size(); ++i) {
+            map<string, Object>::iterator it=objects_.find(names[i]);
+            if(it==objects_.end() || --it->second.refs>0)
+                continue;
+            remove(object_path(it->first).c_str());
+            size_-=it->second.size;
+            objects_.erase(it);
+        }
+    }
+
+    /* removes the entry <key>, and its file if <file> */
+    void drop(const string& key, bool file) {
+        map<string, Entry>::iterator it=entries_.find(key);
+        if(it==entries_.end())
+            return;
+        if(file)
+            remove(entry_path(key).c_str());
+        size_-=it->second.size;
+        lru_.erase(it->second.lru);
+        vector<string> names=objects(it->second);
+        entries_.erase(it);
+        unref(names);
+    }
+
+    void evict() {
+        while(size_>limit_ && !lru_.empty())
+            drop(lru_.back(), true);
+    }
+
+    /* adds an entry of the index as the most recently used one */
+    void insert(const string& key, const Entry& e) {
+        Entry& ie=entries_[key];
+        ie=e;
+        lru_.push_front(key);
+        ie.lru=lru_.begin();
+        size_+=e.size;
+    }
+
+    /* writes <data> to <path> through a temporary file */
+    bool write_atomic(const string& path, const string& data) {
+        string tmp;
+        {
+            XmlRpcMutex::Lock lock(lock_);
+            stringstream ss;
+            ss << dir_ << DIR_SEPARATOR << "tmp." << ++tmpseq_;
+            tmp=ss.str();
+        }
+        if(!write_file(tmp, data)) {
+            remove(tmp.c_str());
+            return false;
+        }
+        if(rename(tmp.c_str(), path.c_str())<0) {
+            /* Windows does not replace files */
+            remove(path.c_str());
+            if(rename(tmp.c_str(), path.c_str())<0) {
+                remove(tmp.c_str());
+                return false;
+            }
+        }
+        return true;
+    }
+
+    struct Listing {
+        map<string, pair<double, double> > files; /* name -> (size, mtime) */
+    };
+
+    static void list_file(void* arg, const char* name, double size, double mtime) {
+        ((Listing*)arg)->files[name]=make_pair(size, mtime);
+    }
+
+    /* loads the index from the entries in the store, oldest first, and
+       removes what no entry refers to */
+    void load() {
+        Listing l;
+        if(plistdir(dir_.c_str(), list_file, &l)<0) {
+            dir_.clear();
+            return;
+        }
+        vector< pair<double, string> > found; /* (mtime, key) */
+        map<string, pair<double, double> >::iterator it;
+        for(it=l.files.begin(); it!=l.files.end(); ++it) {
+            const string& name=it->first;
+            if(name.size()==44 && name.compare(40, 4, ".run")==0 && is_digest(name.substr(0, 40)))
+                found.push_back(make_pair(it->second.second, name.substr(0, 40)));
+        }
+        sort(found.begin(), found.end());
+        for(size_t i=0; i<found.size(); ++i) {
+            const string& key=found[i].second;
+            string text;
+            Entry e;
+            bool ok=read_file(entry_path(key), text) && parse(text, e);
+            vector<string> names;
+            vector<double> sizes;
+            if(ok) {
+                names=objects(e);
+                for(size_t j=0; ok && j<names.size(); ++j) {
+                    ok=l.files.find(names[j])!=l.files.end();
+                    if(ok)
+                        sizes.push_back(l.files[names[j]].first);
+                }
+            }
+            if(!ok) {
+                remove(entry_path(key).c_str());
+                continue;
+            }
+            e.size=(double)text.size();
+            insert(key, e);
+            ref(names, sizes);
+        }
+        for(it=l.files.begin(); it!=l.files.end(); ++it) {
+            const string& name=it->first;
+            bool used=name.size()==44? entries_.count(name.substr(0, 40))>0:
+                                       objects_.count(name)>0;
+            if(!used)
+                remove(object_path(name).c_str());
+        }
+        evict();
+    }
+
+public:
+    RunCache(): server_(NULL), threaded_(false), limit_(0), size_(0), tmpseq_(0) {}
+
+    void start(XmlRpcServer* server, bool threaded, const char* dir, int size_mb) {
+        server_=server;
+        threaded_=threaded;
+        limit_=size_mb*1048576.0;
+        if(!dir || !*dir)
+            return;
+        dir_=dir;
+        pmkdir(PDIR_CWD, dir);
+        clear_error();
+        load();
+    }
+
+    /* whether jobs of the cache for a call answered on <disp> should
+       run on a worker */
+    bool offload(XmlRpcDispatch* disp) const {
+        return threaded_ && server_ && disp==server_->getDispatch();
+    }
+
+    /* runs <job>, on a worker if offload(disp) */
+    void run(XmlRpcThreadPool::Job* job, XmlRpcDispatch* disp) {
+        if(offload(disp)) {
+            server_->submit(job);
+        } else {
+            job->run();
+            job->complete();
+        }
+    }
+
+    /* finds the result memoized by <key> */
+    bool lookup(const string& key, Result& r) {
+        Entry e;
+        {
+            XmlRpcMutex::Lock lock(lock_);
+            map<string, Entry>::iterator it=entries_.find(key);
+            if(it==entries_.end())
+                return false;
+            lru_.splice(lru_.begin(), lru_, it->second.lru);
+            e=it->second;
+        }
+        utime(entry_path(key).c_str(), NULL); /* for the order after a restart */
+        r.code=e.code;
+        r.outputs.resize(e.outputs.size());
+        bool ok=read_file(object_path(e.out), r.out) &&
+                read_file(object_path(e.err), r.err);
+        for(size_t i=0; ok && i<e.outputs.size(); ++i) {
+            r.outputs[i].first=e.outputs[i].first;
+            ok=read_file(object_path(e.outputs[i].second), r.outputs[i].second);
+        }
+        if(!ok) {
+            /* the store has been tampered with */
+            XmlRpcMutex::Lock lock(lock_);
+            drop(key, true);
+        }
+        return ok;
+    }
+
+    /* memoizes <r> by <key> */
+    void store(const string& key, const Result& r) {
+        if(dir_.empty())
+            return;
+        Entry e;
+        e.code=r.code;
+        vector<const string*> data;
+        data.push_back(&r.out);
+        data.push_back(&r.err);
+        for(size_t i=0; i<r.outputs.size(); ++i) {
+            if(r.outputs[i].first.find('\n')!=string::npos)
+                return;
+            data.push_back(&r.outputs[i].second);
+        }
+        vector<string> names;
+        vector<double> sizes;
+        for(size_t i=0; i<data.size(); ++i) {
+            SHA1 sha1;
+            sha1.Input(data[i]->data(), (unsigned)data[i]->size());
+            names.push_back(hexdigest(sha1));
+            sizes.push_back((double)data[i]->size());
+        }
+        e.out=names[0];
+        e.err=names[1];
+        for(size_t i=0; i<r.outputs.size(); ++i)
+            e.outputs.push_back(make_pair(r.outputs[i].first, names[i+2]));
+        string text=format(e);
+        e.size=(double)text.size();
+
+        /* the references keep the objects from being evicted meanwhile */
+        {
+            XmlRpcMutex::Lock lock(lock_);
+            ref(names, sizes);
+        }
+        bool ok=true;
+        for(size_t i=0; ok && i<names.size(); ++i) {
+            string path=object_path(names[i]);
+            if(access(path.c_str(), F_OK)<0)
+                ok=write_atomic(path, *data[i]);
+        }
+        ok=ok && write_atomic(entry_path(key), text);
+
+        XmlRpcMutex::Lock lock(lock_);
+        if(ok) {
+            drop(key, false);
+            insert(key, e);
+        } else {
+            unref(names);
+        }
+        evict();
+    }
+};
+
+static RunCache cache;
+
+/* Memoizes the result of a process.run which has missed the cache */
+class CacheStore: public XmlRpcThreadPool::Job {
+    CachedRun* run_;
+    RunCache::Result r_;
+public:
+    CacheStore(CachedRun* run, int code, const string& out, const string& err): run_(run) {
+        r_.code=code;
+        r_.out=out;
+        r_.err=err;
+    }
+
+    ~CacheStore() { delete run_; }
+
+    /* on a worker */
+    void run() {
+        r_.outputs.resize(run_->outputs.size());
+        for(size_t i=0; i<run_->outputs.size(); ++i) {
+            r_.outputs[i].first=run_->outputs[i];
+            if(!read_file(run_->path(run_->outputs[i]), r_.outputs[i].second))
+                return; /* an output is missing: not memoized */
+        }
+        cache.store(run_->key, r_);
+    }
+
+    void complete() {
+        delete this;
+    }
+};
+
+class RunRequest;
+
+/* Passes the outcome of one stage of a RunRequest on to it */
+class StageListener: public SpawnListener {
+    RunRequest* run_;
+    int stage_;
+public:
+    StageListener(RunRequest* run, int stage): run_(run), stage_(stage) {}
+
+    void exited(int res);
+    void timed_out(int pid);
+    void lost();
+};
+
+/* A process.run or process.pipeline call: the stdin of the first stage
+   is fed from a string, the stdout of the last one and the stderr of all
+   of them are collected through pipes on the event loop, and the stages
+   are connected by pipes. Answers when all stages have exited, with what
+   they have written by then. */
+class RunRequest: public XmlRpcCancellable {
+    XmlRpcDeferred* deferred_;
+    XmlRpcDispatch* disp_;
+    PipeWriter* in_;
+    OutputCapture* out_;
+    OutputCapture* err_;
+    vector<int> pids_;
+    vector<int> codes_;
+    int waiting_;  /* stages which have not reported yet */
+    bool answered_;
+
+    enum { OUTPUT_LIMIT = 1024*1024 };
+
+    /* the args of stage <i> */
+    const vector<string>& args(size_t i) const {
+        return i==0? spawn.args: stages[i-1];
+    }
+
+    void answer() {
+        XmlRpcValue result;
+        if(stages.empty()) {
+            result["exitcode"]=codes_[0];
+        } else {
+            XmlRpcValue& codes=result["exitcodes"];
+            codes.setSize((int)codes_.size());
+            for(size_t i=0; i<codes_.size(); ++i)
+                codes[(int)i]=codes_[i];
+            result["exitcode"]=codes_.back();
+        }
+        bool truncated=false;
+        OutputCapture* streams[2]={ out_, err_ };
+        const char* names[2]={ "stdout", "stderr" };
+        string data[2];
+        for(int i=0; i<2; ++i) {
+            if(streams[i]) {
+                streams[i]->finish();
+                data[i]=streams[i]->data();
+                truncated=truncated || streams[i]->truncated();
+            }
+            if(binary)
+                result[names[i]]=XmlRpcValue((void*)data[i].data(), (int)data[i].size());
+            else
+                result[names[i]]=data[i];
+        }
+        result["truncated"]=truncated;
+        if(spawn.limited()) {
+            for(size_t i=0; i<pids_.size(); ++i) {
+                XmlRpcValue status;
+                if(children.status(pids_[i], status) && status.hasMember("limit")) {
+                    result["limit"]=status["limit"];
+                    break;
+                }
+            }
+        }
+        if(cached) {
+            result["cache"]="miss";
+            if(!cached->key.empty() && !truncated) {
+                cache.run(new CacheStore(cached, codes_[0], data[0], data[1]), disp_);
+                cached=NULL;
+            }
+        }
+        if(spawn.rusage) {
+            if(stages.empty()) {
+                children.status(pids_[0], result["status"]);
+            } else {
+                XmlRpcValue& status=result["status"];
+                status.setSize((int)pids_.size());
+                for(size_t i=0; i<pids_.size(); ++i)
+                    children.status(pids_[i], status[(int)i]);
+            }
+        }
+        deferred_->succeed(result);
+    }
+
+    void fail(const char* msg) {
+        if(!answered_)
+            deferred_->fail(msg);
+        answered_=true;
+    }
+
+    /* a stage has reported; the request is deleted after the last one */
+    void reported() {
+        if(--waiting_>0)
+            return;
+        if(!answered_)
+            answer();
+        delete this;
+    }
+
+    static void parse_names(XmlRpcValue& v, vector<string>& names) {
+        if(v.getType()!=XmlRpcValue::TypeArray)
+            throw XmlRpcException("parameters error");
+        for(int i=0; i<v.size(); ++i)
+            names.push_back(string(v[i]));
+    }
+
+    /* parse the cache option: TRUE, or struct {env, inputs, outputs} */
+    void parse_cache(XmlRpcValue& vcache) {
+        vector<string> env;
+        if(vcache.getType()==XmlRpcValue::TypeBoolean) {
+            if(!bool(vcache))
+                return;
+            cached=new CachedRun;
+        } else {
+            cached=new CachedRun;
+            if(vcache.hasMember("env"))
+                parse_names(vcache["env"], env);
+            if(vcache.hasMember("inputs"))
+                parse_names(vcache["inputs"], cached->inputs);
+            if(vcache.hasMember("outputs"))
+                parse_names(vcache["outputs"], cached->outputs);
+        }
+        cached->args=spawn.args;
+        cached->envs=spawn.envs;
+        cached->input=input;
+        cached->has_input=has_input;
+        cached->fin=spawn.fin;
+        cached->binary=binary;
+        cached->out_limit=out_limit;
+        cached->err_limit=err_limit;
+        cached->dir=spawn.cwd;
+        Path cwd;
+        if(realpath(spawn.cwd.empty()? ".": spawn.cwd.c_str(), cwd))
+            cached->cwd=string(cwd);
+        else
+            cached->cwd=spawn.cwd;
+        for(size_t i=0; i<env.size(); ++i) {
+            string prefix=env[i]+"=", var=env[i];
+            const char* value=getenv(env[i].c_str());
+            if(value)
+                var=prefix+value;
+            for(size_t j=0; j<spawn.envs.size(); ++j)
+                if(spawn.envs[j].compare(0, prefix.size(), prefix)==0)
+                    var=spawn.envs[j];
+            cached->env.push_back(var);
+        }
+    }
+
+public:
+    SpawnRequest spawn; /* the options, and the args of the first stage */
+    vector< vector<string> > stages; /* the args of the others */
+    string input;
+    bool has_input, binary;
+    int out_limit, err_limit;
+    CachedRun* cached; /* with the cache option */
+
+    RunRequest(): deferred_(NULL), disp_(NULL), in_(NULL), out_(NULL), err_(NULL),
+            waiting_(0), answered_(false), has_input(false), binary(false),
+            out_limit(OUTPUT_LIMIT), err_limit(OUTPUT_LIMIT), cached(NULL) {}
+
+    ~RunRequest() {
+        delete cached;
+        if(in_) {
+            in_->finish(disp_);
+            delete in_;
+        }
+        if(out_) {
+            out_->finish();
+            delete out_;
+        }
+        if(err_) {
+            err_->finish();
+            delete err_;
+        }
+    }
+
+    /* parse (args, [timeout], [options]) */
+    void parse(XmlRpcValue& params) {
+        spawn.parse(params);
+        try {
+            if(params.size()>2) {
+                XmlRpcValue& vopts=params[2];
+                if(vopts.hasMember("input")) {
+                    XmlRpcValue& vin=vopts["input"];
+                    if(vin.getType()==XmlRpcValue::TypeBase64) {
+                        XmlRpcValue::BinaryData& b(vin);
+                        input.assign(b.begin(), b.end());
+                    } else {
+                        input=string(vin);
+                    }
+                    has_input=true;
+                }
+                if(vopts.hasMember("binary"))
+                    binary=bool(vopts["binary"]);
+                if(vopts.hasMember("stdout_limit"))
+                    out_limit=int(vopts["stdout_limit"]);
+                if(vopts.hasMember("stderr_limit"))
+                    err_limit=int(vopts["stderr_limit"]);
+                if(vopts.hasMember("cache"))
+                    parse_cache(vopts["cache"]);
+            }
+        } catch(...) {
+            throw XmlRpcException("parameters error");
+        }
+        if(out_limit<0 || err_limit<0)
+            throw XmlRpcException("parameters error");
+        if(cached && (!spawn.fout.empty() || !spawn.ferr.empty()))
+            throw XmlRpcException("the cache option is not supported with stdout or stderr redirected to files");
+    }
+
+    /* parse ([args...], [timeout], [options]) */
+    void parsePipeline(XmlRpcValue& params) {
+        XmlRpcValue first;
+        try {
+            XmlRpcValue& vstages=params[0];
+            if(vstages.getType()!=XmlRpcValue::TypeArray || vstages.size()==0)
+                throw XmlRpcException("parameters error");
+            for(int i=1; i<vstages.size(); ++i) {
+                XmlRpcValue& vargs=vstages[i];
+                vector<string> args;
+                if(vargs.getType()==XmlRpcValue::TypeArray) {
+                    for(int j=0; j<vargs.size(); ++j)
+                        args.push_back(string(vargs[j]));
+                } else {
+                    args.push_back(string(vargs));
+                }
+                if(args.empty())
+                    throw XmlRpcException("parameters error");
+                stages.push_back(args);
+            }
+            first[0]=vstages[0];
+            for(int i=1; i<params.size(); ++i)
+                first[i]=params[i];
+        } catch(...) {
+            throw XmlRpcException("parameters error");
+        }
+        parse(first);
+        if(cached)
+            throw XmlRpcException("the cache option is not supported by process.pipeline");
+    }
+
+    /* start the stages; the request deletes itself once they have all
+       exited */
+    void start(XmlRpcDeferred* deferred) {
+        size_t n=stages.size()+1;
+        int pin[2]={ -1, -1 }, pout[2]={ -1, -1 }, perr[2]={ -1, -1 };
+        vector<int> links(2*(n-1), -1); /* the pipes between the stages */
+        int fderr=-1;
+        try {
+            int fdin=has_input? pipe_child_end(pin, false): -1;
+            int fdout=spawn.fout.empty()? pipe_child_end(pout, true): -1;
+            if(spawn.ferr.empty()) {
+                fderr=pipe_child_end(perr, true);
+            } else if(n>1) {
+                /* shared, rather than truncated by each stage */
+                clear_error();
+                if((fderr=pstdfd(spawn.ferr.c_str(), 1))<0)
+                    throw_on_os_error("open");
+            }
+            for(size_t i=0; i+1<n; ++i) {
+                clear_error();
+                if(ppipe(&links[2*i])<0)
+                    throw_on_os_error("pipe");
+            }
+            for(size_t i=0; i<n; ++i) {
+                SpawnRequest stage(spawn);
+                stage.args=args(i);
+                pids_.push_back(stage.spawn(i==0? fdin: links[2*i-2],
+                                            i+1==n? fdout: links[2*i+1], fderr));
+            }
+        } catch(...) {
+            for(size_t i=0; i<pids_.size(); ++i)
+                terminate(pids_[i], 0);
+            for(int i=0; i<2; ++i) {
+                if(pin[i]>=0) close(pin[i]);
+                if(pout[i]>=0) close(pout[i]);
+                if(perr[i]>=0) close(perr[i]);
+            }
+            for(size_t i=0; i<links.size(); ++i)
+                if(links[i]>=0) close(links[i]);
+            if(fderr>=0 && perr[1]<0)
+                close(fderr);
+            delete this;
+            throw;
+        }
+        for(size_t i=0; i<links.size(); ++i)
+            close(links[i]);
+        if(fderr>=0 && perr[1]<0)
+            close(fderr);
+
+        deferred_=deferred;
+        disp_=deferred->dispatch();
+        if(pin[0]>=0) {
+            close(pin[0]);
+            in_=new PipeWriter(pin[1], input);
+            disp_->addSource(in_, XmlRpcDispatch::WritableEvent);
+        }
+        if(pout[0]>=0) {
+            close(pout[1]);
+            out_=new OutputCapture(pout[0], out_limit);
+            out_->watch(disp_);
+        }
+        if(perr[0]>=0) {
+            close(perr[1]);
+            err_=new OutputCapture(perr[0], err_limit);
+            err_->watch(disp_);
+        }
+        codes_.resize(n, -1);
+        waiting_=(int)n;
+        for(size_t i=0; i<n; ++i)
+            new SpawnWaiter(pids_[i], spawn.timeout, disp_, new StageListener(this, (int)i));
+        deferred_->setCancellable(this);
+    }
+
+    /* the client has gone: the stages are killed, and nothing is cached */
+    void cancel() {
+        for(size_t i=0; i<pids_.size(); ++i)
+            terminate(pids_[i]);
+        fail("cancelled: the client has disconnected");
+    }
+
+    void stage_exited(int stage, int res) {
+        codes_[stage]=res;
+        reported();
+    }
+
+    /* all stages are killed when the first one times out */
+    void stage_timed_out() {
+        if(!answered_)
+            for(size_t i=0; i<pids_.size(); ++i)
+                terminate(pids_[i]);
+        fail("Process killed on timeout");
+        reported();
+    }
+
+    void stage_lost() {
+        fail("wait: the process has been waited for already");
+        reported();
+    }
+};
+
+void StageListener::exited(int res) {
+    run_->stage_exited(stage_, res);
+    delete this;
+}
+
+void StageListener::timed_out(int /*pid*/) {
+    run_->stage_timed_out();
+    delete this;
+}
+
+void StageListener::lost() {
+    run_->stage_lost();
+    delete this;
+}
+
+/* Looks a process.run with the cache option up, restoring the output
+   files on a hit; on a miss, starts the request */
+class CacheLookup: public XmlRpcThreadPool::Job {
+    RunRequest* req_;
+    XmlRpcDeferred* deferred_;
+    bool hit_;
+public:
+    XmlRpcValue result;
+
+    CacheLookup(RunRequest* req, XmlRpcDeferred* deferred):
+        req_(req), deferred_(deferred), hit_(false) {}
+
+    bool hit() const { return hit_; }
+
+    /* on a worker */
+    void run() {
+        CachedRun& c=*req_->cached;
+        RunCache::Result r;
+        if(!c.compute_key() || !cache.lookup(c.key, r))
+            return;
+        for(size_t i=0; i<r.outputs.size(); ++i)
+            if(!write_file(c.path(r.outputs[i].first), r.outputs[i].second))
+                return;
+        result["exitcode"]=r.code;
+        if(req_->binary) {
+            result["stdout"]=XmlRpcValue((void*)r.out.data(), (int)r.out.size());
+            result["stderr"]=XmlRpcValue((void*)r.err.data(), (int)r.err.size());
+        } else {
+            result["stdout"]=r.out;
+            result["stderr"]=r.err;
+        }
+        result["truncated"]=false;
+        result["cache"]="hit";
+        hit_=true;
+    }
+
+    void complete() {
+        if(hit_) {
+            delete req_;
+            deferred_->succeed(result);
+        } else {
+            try {
+                req_->start(deferred_);
+            } catch(const XmlRpcException& e) {
+                deferred_->fail(e.getMessage(), e.getCode());
+            }
+        }
+        delete this;
+    }
+};
+
+/* starts an asynchronous child whose stdout and stderr, unless redirected
+   to files, are kept for process.read with the pipe option, and whose
+   stdin is fed by process.write with the stdin_pipe option; returns its pid */
+static int spawn_piped(SpawnRequest& req, XmlRpcServer* server) {
+    int pin[2]={ -1, -1 }, pout[2]={ -1, -1 }, perr[2]={ -1, -1 };
+    Child* c=new Child(0, server->getDispatch());
+    int pid=-1;
+    try {
+        int fdin=req.stdin_pipe? pipe_child_end(pin, false): -1;
+        int fdout=req.pipe && req.fout.empty()? pipe_child_end(pout, true): -1;
+        int fderr=req.pipe && req.ferr.empty()? pipe_child_end(perr, true): -1;
+        if(pout[0]>=0)
+            c->output[0]=new OutputStream(pout[0], c, req.buffer_size);
+        if(perr[0]>=0)
+            c->output[1]=new OutputStream(perr[0], c, req.buffer_size);
+        if(pin[1]>=0)
+            c->input=new InputStream(pin[1], c, server->getDispatch(), req.buffer_size);
+        pid=req.spawn(fdin, fdout, fderr, c);
+    } catch(...) {
+        for(int i=0; i<2; ++i) {
+            if(pin[i]>=0) close(pin[i]);
+            if(pout[i]>=0) close(pout[i]);
+            if(perr[i]>=0) close(perr[i]);
+        }
+        delete c;
+        throw;
+    }
+    if(pin[0]>=0)
+        close(pin[0]);
+    if(pout[1]>=0)
+        close(pout[1]);
+    if(perr[1]>=0)
+        close(perr[1]);
+    server->post(c);
+    return pid;
+}
+
+class M_process_spawn: public XmlRpcServerMethod {
+public:
+    M_process_spawn(XmlRpcServer * server = 0): 
+        XmlRpcServerMethod("process.spawn", server) {}
+    std::string help() {
+        return "process.spawn(args, timeout, options): spawn a subprocess, in a process group of its own\n"
+               "Arguments:\n"
+               "    args:    list of parameters (first is the program name)\n"
+               "    timeout: if zero, the process is started asynchronously, otherwise, it's a maximum execution time\n"
+               "             in seconds (integer or double, millisecond resolution)\n"
+               "    options: an optional struct with the following keys:\n"
+               "        cwd:     the process will chdir there before execution\n"
+               "        stdin:   name of a file to be fed to the subprocess's stdin\n"
+               "        stdout:  name of a file where the suprocess's stdout will be written\n"
+               "        stderr:  name of a file where the suprocess's stderr will be written\n"
+               "        env:     dict of environment variables to set\n"
+               "        pipe:    if TRUE, an asynchronous process's stdout and stderr (unless redirected\n"
+               "                 to files) are kept in memory, to be read by process.read\n"
+               "        stdin_pipe: if TRUE, an asynchronous process's stdin is a pipe, fed by process.write\n"
+               "                 until process.close_stdin\n"
+               "        buffer_size: bytes of each stream kept by the pipe option, and of stdin buffered\n"
+               "                 by process.write (default 1M)\n"
+               "        rusage:  if TRUE, a synchronous request returns the struct of process.status\n"
+               "        limits:  struct of resource limits, set in the child:\n"
+               "                 as, fsize (bytes of address space and of a file written),\n"
+               "                 cpu (seconds of CPU time), nofile (open files), nproc (processes\n"
+               "                 of the user); and where the server has cgroup_dir configured,\n"
+               "                 memory_max (bytes) and cpu_max (CPUs) of a cgroup for the child.\n"
+               "                 The limit hit by the child (\"cpu\", \"fsize\" or \"memory\"; running\n"
+               "                 out of the others shows as failing calls) is the limit member of\n"
+               "                 the struct of process.status\n"
+               "Return value:\n"
+               "    for asynchronous requests:\n"
+               "        pid (integer)\n"
+               "    for synchronous requests:\n"
+               "        return value (integer), or the struct of process.status with the rusage option\n"
+               "    on timeout:\n"
+               "        kill process and its process group, and raise Fault";
+    }
+
+    /* synchronous requests wait for the child on the event loop */
+    Execution execution() const { return Deferred; }
+
+    bool executeDeferred(XmlRpcValue& params, XmlRpcValue& result, XmlRpcDeferred* deferred) {
+        SpawnRequest req;
+        req.parse(params);
+        if(req.timeout<=0) {
+            result=req.piped()? spawn_piped(req, _server): req.spawn();
+            return true;
+        }
+        int pid=req.spawn();
+        new SpawnWaiter(pid, req.timeout, deferred->dispatch(),
+                        new SpawnAnswer(deferred, pid, req.rusage));
+        return false;
+    }
+
+    void execute(XmlRpcValue& params, XmlRpcValue& result) {
+        SyncDeferred deferred(result);
+        if(!executeDeferred(params, result, &deferred))
+            deferred.wait();
+    }
+};
+
+/* A process.spawn_many call: spawns its entries, at most max_parallel
+   of them at a time when waiting for them, and answers with the outcome
+   of each entry in order */
+class BatchRequest: public XmlRpcCancellable {
+    XmlRpcDeferred* deferred_;
+    XmlRpcDispatch* disp_;
+    vector<SpawnRequest> entries_;
+    vector<bool> valid_;
+    XmlRpcValue results_;
+    size_t next_; /* the entry to start next */
+    int running_;
+
+    static void set_error(XmlRpcValue& result, const XmlRpcException& e) {
+        result["error"]=e.getMessage();
+        result["code"]=e.getCode();
+    }
+
+    /* start the entries there is room for; returns true when all have
+       finished */
+    bool start_more() {
+        while(next_<entries_.size() && (max_parallel<=0 || running_<max_parallel)) {
+            size_t i=next_++;
+            if(!valid_[i])
+                continue;
+            int pid;
+            try {
+                pid=entries_[i].spawn();
+            } catch(const XmlRpcException& e) {
+                set_error(results_[(int)i], e);
+                continue;
+            }
+            results_[(int)i]["pid"]=pid;
+            if(timeout>0) {
+                ++running_;
+                new SpawnWaiter(pid, timeout, disp_, new Listener(this, (int)i));
+            }
+        }
+        return running_==0 && next_==entries_.size();
+    }
+
+    /* an entry has finished */
+    void finished() {
+        --running_;
+        if(start_more()) {
+            deferred_->succeed(results_);
+            delete this;
+        }
+    }
+
+    class Listener: public SpawnListener {
+        BatchRequest* batch_;
+        int entry_;
+    public:
+        Listener(BatchRequest* batch, int entry): batch_(batch), entry_(entry) {}
+
+        void exited(int res) {
+            XmlRpcValue& result=batch_->results_[entry_];
+            result["exitcode"]=res;
+            if(batch_->entries_[entry_].rusage)
+                children.status(int(result["pid"]), result["status"]);
+            batch_->finished();
+            delete this;
+        }
+
+        void timed_out(int pid) {
+            terminate(pid);
+            set_error(batch_->results_[entry_], XmlRpcException("Process killed on timeout"));
+            batch_->finished();
+            delete this;
+        }
+
+        void lost() {
+            set_error(batch_->results_[entry_],
+                      XmlRpcException("wait: the process has been waited for already"));
+            batch_->finished();
+            delete this;
+        }
+    };
+
+public:
+    double timeout;
+    int max_parallel;
+
+    BatchRequest(): deferred_(NULL), disp_(NULL), next_(0), running_(0),
+            timeout(0), max_parallel(0) {}
+
+    /* parse (entries, [timeout], [max_parallel]); an entry which cannot
+       be parsed gets an error, rather than failing the call */
+    void parse(XmlRpcValue& params) {
+        try {
+            XmlRpcValue& ventries=params[0];
+            if(ventries.getType()!=XmlRpcValue::TypeArray)
+                throw XmlRpcException("parameters error");
+            if(params.size()>1)
+                timeout=seconds(params[1]);
+            if(params.size()>2)
+                max_parallel=params[2];
+            entries_.resize(ventries.size());
+            valid_.resize(ventries.size(), false);
+            results_.setSize(ventries.size());
+            for(int i=0; i<ventries.size(); ++i) {
+                XmlRpcValue& result=results_[i];
+                result["index"]=i;
+                try {
+                    XmlRpcValue& ventry=ventries[i];
+                    XmlRpcValue spawn;
+                    if(ventry.getType()==XmlRpcValue::TypeStruct) {
+                        spawn[0]=ventry["args"];
+                        spawn[1]=timeout;
+                        if(ventry.hasMember("options"))
+                            spawn[2]=ventry["options"];
+                    } else {
+                        spawn[0]=ventry;
+                        spawn[1]=timeout;
+                    }
+                    entries_[i].parse(spawn);
+                    valid_[i]=true;
+                } catch(const XmlRpcException& e) {
+                    set_error(result, e);
+                } catch(...) {
+                    set_error(result, XmlRpcException("parameters error"));
+                }
+            }
+        } catch(...) {
+            throw XmlRpcException("parameters error");
+        }
+    }
+
+    /* start the entries; returns true if the results are complete (they
+       are not waited for, or none could be started), otherwise the
+       request deletes itself once answered */
+    bool start(XmlRpcDeferred* deferred, XmlRpcValue& result) {
+        deferred_=deferred;
+        disp_=deferred->dispatch();
+        if(!start_more()) {
+            deferred_->setCancellable(this);
+            return false;
+        }
+        result=results_;
+        delete this;
+        return true;
+    }
+
+    /* the client has gone: no more entries are started, and the running
+       ones are killed */
+    void cancel() {
+        next_=entries_.size();
+        for(size_t i=0; i<entries_.size(); ++i) {
+            XmlRpcValue& result=results_[(int)i];
+            if(result.hasMember("pid") && !result.hasMember("exitcode") &&
+                    !result.hasMember("error"))
+                terminate(int(result["pid"]));
+        }
+    }
+};
+
+class M_process_spawn_many: public XmlRpcServerMethod {
+public:
+    M_process_spawn_many(XmlRpcServer * server = 0):
+        XmlRpcServerMethod("process.spawn_many", server) {}
+    std::string help() {
+        return "process.spawn_many(entries, timeout, max_parallel): spawn several subprocesses\n"
+               "Arguments:\n"
+               "    entries:      list of struct {args, options}, with the args and options of\n"
+               "                  process.spawn (options are optional), or of args alone\n"
+               "    timeout:      as for process.spawn: if zero, the processes are started\n"
+               "                  asynchronously, otherwise it is the maximum execution time of each\n"
+               "    max_parallel: for synchronous requests, the maximum number of processes running\n"
+               "                  at once (default 0: no limit); the others start as they finish\n"
+               "Return value:\n"
+               "    list of struct {index, pid}, one per entry in order; for synchronous requests\n"
+               "    also exitcode (and status with the rusage option). An entry which could not be\n"
+               "    started, or was killed on timeout, has error and code instead, and does not\n"
+               "    fail the others";
+    }
+
+    Execution execution() const { return Deferred; }
+
+    bool executeDeferred(XmlRpcValue& params, XmlRpcValue& result, XmlRpcDeferred* deferred) {
+        BatchRequest* req=new BatchRequest;
+        try {
+            req->parse(params);
+        } catch(...) {
+            delete req;
+            throw;
+        }
+        return req->start(deferred, result);
+    }
+
+    void execute(XmlRpcValue& params, XmlRpcValue& result) {
+        SyncDeferred deferred(result);
+        if(!executeDeferred(params, result, &deferred))
+            deferred.wait();
+    }
+};
+
+class M_process_run: public XmlRpcServerMethod {
+public:
+    M_process_run(XmlRpcServer * server = 0):
+        XmlRpcServerMethod("process.run", server) {}
+    std::string help() {
+        return "process.run(args, timeout, options): run a subprocess and return its output\n"
+               "Arguments:\n"
+               "    args:    list of parameters (first is the program name)\n"
+               "    timeout: maximum execution time in seconds (integer or double), zero for none\n"
+               "    options: the options of process.spawn, and:\n"
+               "        input:        string (or base64) to be fed to the subprocess's stdin\n"
+               "        binary:       if TRUE, stdout and stderr are returned as base64\n"
+               "        stdout_limit: maximum number of bytes of stdout to return (default 1M)\n"
+               "        stderr_limit: maximum number of bytes of stderr to return (default 1M)\n"
+               "        cache:        TRUE, or struct {env, inputs, outputs} of lists of names:\n"
+               "                      memoize the result by the directory, the args, the env option\n"
+               "                      and the named environment variables, the input or stdin file, the other\n"
+               "                      options above, and the contents of the input files; the\n"
+               "                      output files are stored with it and restored on a hit;\n"
+               "                      not allowed with stdout or stderr redirected to files\n"
+               "    stdout and stderr are captured unless redirected to files by the options\n"
+               "Return value:\n"
+               "    struct {exitcode, stdout, stderr, truncated}, and status with the rusage option\n"
+               "    and limit if a stage has hit one of its limits (see process.spawn)\n"
+               "    truncated is TRUE if some output was dropped because of the limits\n"
+               "    with the cache option, cache is \"hit\" or \"miss\"; a hit has no status\n"
+               "    on timeout:\n"
+               "        kill process and its process group, and raise Fault";
+    }
+
+    Execution execution() const { return Deferred; }
+
+    bool executeDeferred(XmlRpcValue& params, XmlRpcValue& result, XmlRpcDeferred* deferred) {
+        RunRequest* req=new RunRequest;
+        try {
+            req->parse(params);
+        } catch(...) {
+            delete req;
+            throw;
+        }
+        if(req->cached) {
+            CacheLookup* lookup=new CacheLookup(req, deferred);
+            if(cache.offload(deferred->dispatch())) {
+                cache.run(lookup, deferred->dispatch());
+                return false;
+            }
+            lookup->run();
+            if(lookup->hit()) {
+                result=lookup->result;
+                delete lookup;
+                delete req;
+                return true;
+            }
+            delete lookup;
+        }
+        req->start(deferred);
+        return false;
+    }
+
+    void execute(XmlRpcValue& params, XmlRpcValue& result) {
+        SyncDeferred deferred(result);
+        if(!executeDeferred(params, result, &deferred))
+            deferred.wait();
+    }
+};
+
+class M_process_pipeline: public XmlRpcServerMethod {
+public:
+    M_process_pipeline(XmlRpcServer * server = 0):
+        XmlRpcServerMethod("process.pipeline", server) {}
+    std::string help() {
+        return "process.pipeline(stages, timeout, options): run subprocesses connected by pipes\n"
+               "Arguments:\n"
+               "    stages:  list of the args of each subprocess (lists of parameters, first is\n"
+               "             the program name); the stdout of each is the stdin of the next one\n"
+               "    timeout: maximum execution time in seconds (integer or double), zero for none\n"
+               "    options: the options of process.run; stdin and input go to the first stage,\n"
+               "             stdout is the last stage's, stderr is shared by all of them, and\n"
+               "             cwd and env apply to all of them\n"
+               "    all stages are started at once; the data between them does not go through\n"
+               "    the server\n"
+               "Return value:\n"
+               "    struct {exitcodes, exitcode, stdout, stderr, truncated}: exitcodes lists the\n"
+               "    exit code of each stage, exitcode is the last one; with the rusage option,\n"
+               "    status lists the struct of process.status of each stage\n"
+               "    on timeout:\n"
+               "        kill all stages and their process groups, and raise Fault";
+    }
+
+    Execution execution() const { return Deferred; }
+
+    bool executeDeferred(XmlRpcValue& params, XmlRpcValue& /*result*/, XmlRpcDeferred* deferred) {
+        RunRequest* req=new RunRequest;
+        try {
+            req->parsePipeline(params);
+        } catch(...) {
+            delete req;
+            throw;
+        }
+        req->start(deferred);
+        return false;
+    }
+
+    void execute(XmlRpcValue& params, XmlRpcValue& result) {
+        SyncDeferred deferred(result);
+        if(!executeDeferred(params, result, &deferred))
+            deferred.wait();
+    }
+};
+
+class M_process_zygote: public XmlRpcServerMethod {
+public:
+    M_process_zygote(XmlRpcServer* server = 0):
+        XmlRpcServerMethod("process.zygote", server) {}
+
+    std::string help() {
+        return "process.zygote(args_prefix, options): spawn children through a zygote\n"
+               "Arguments:\n"
+               "    args_prefix: list of parameters (first is the program name); later requests\n"
+               "                 of process.spawn, process.run and process.submit whose args start\n"
+               "                 with them are spawned by a small helper process (the zygote),\n"
+               "                 forked at startup, rather than by the server\n"
+               "    options:     an optional struct with the following keys:\n"
+               "        env:     dict of environment variables to set for those children\n"
+               "                 (the env option of a request overrides them)\n"
+               "Return value:\n"
+               "    the pid of the zygote (integer)\n"
+               "    calling it again for the same prefix returns the same zygote, with the env\n"
+               "    replaced if the option is given";
+    }
+
+    void execute(XmlRpcValue& params, XmlRpcValue& result) {
+        vector<string> prefix, envs;
+        bool set_env=false;
+        try {
+            XmlRpcValue& vargs=params[0];
+            if(vargs.getType()==XmlRpcValue::TypeArray) {
+                for(int i=0; i<vargs.size(); ++i)
+                    prefix.push_back(string(vargs[i]));
+            } else {
+                prefix.push_back(string(vargs));
+            }
+            if(params.size()>1 && params[1].hasMember("env")) {
+                XmlRpcValue& venv=params[1]["env"];
+                set_env=true;
+                vector<string> keys=venv.keys();
+                for(vector<string>::const_iterator p=keys.begin(); p!=keys.end(); ++p)
+                    envs.push_back(*p+string("=")+string(venv[*p]));
+            }
+        } catch(...) {
+            throw XmlRpcException("parameters error");
+        }
+        if(prefix.empty())
+            throw XmlRpcException("parameters error");
+        result=zygotes.start(prefix, envs, set_env)->pid;
+    }
+};
+
+class M_process_read: public XmlRpcServerMethod {
+public:
+    M_process_read(XmlRpcServer* server = 0):
+        XmlRpcServerMethod("process.read", server) {}
+
+    std::string help() {
+        return "process.read(pid, stream, offset, [wait_ms=0], [binary=False]): read the output of a process\n"
+               "    spawned asynchronously with the pipe option\n"
+               "Arguments:\n"
+               "    stream:  \"stdout\" or \"stderr\"\n"
+               "    offset:  position in the stream to read from, the offset returned by the previous call\n"
+               "    wait_ms: if there is no output after <offset> yet, wait for it up to <wait_ms> milliseconds\n"
+               "             (not in system.multicall)\n"
+               "    binary:  if TRUE, the data is returned as base64\n"
+               "Return value:\n"
+               "    struct {data, offset, lost, eof}\n"
+               "    offset: the position after the data\n"
+               "    lost:   bytes after the requested offset which have dropped out of the buffer\n"
+               "    eof:    TRUE if the stream is closed and everything has been read";
+    }
+
+    Execution execution() const { return Deferred; }
+
+    struct Args {
+        int pid;
+        int stream;
+        unsigned long offset;
+        int wait_ms;
+        bool binary;
+
+        Args(XmlRpcValue& params): wait_ms(0), binary(false) {
+            string name;
+            try {
+                pid=params[0];
+                name=string(params[1]);
+                offset=(unsigned long)int(params[2]);
+                if(params.size()>3)
+                    wait_ms=params[3];
+                if(params.size()>4)
+                    binary=bool(params[4]);
+            } catch(...) {
+                throw XmlRpcException("parameters error");
+            }
+            if(name=="stdout")
+                stream=0;
+            else if(name=="stderr")
+                stream=1;
+            else
+                throw XmlRpcException("parameters error");
+        }
+    };
+
+    /* called with the table lock held */
+    static OutputStream* find(const Args& a) {
+        Child* c=children.find(a.pid);
+        if(!c || !c->output[a.stream])
+            throw XmlRpcException("no output kept for this process and stream");
+        return c->output[a.stream];
+    }
+
+    bool executeDeferred(XmlRpcValue& params, XmlRpcValue& result, XmlRpcDeferred* deferred) {
+        Args a(params);
+        OutputStream* stream;
+        {
+            XmlRpcMutex::Lock l(children.lock());
+            stream=find(a);
+            if(a.wait_ms<=0 || !stream->pending(a.offset)) {
+                stream->result(a.offset, a.binary, result);
+                return true;
+            }
+        }
+        new OutputWaiter(stream, a.offset, a.binary, a.wait_ms/1000.0, deferred);
+        return false;
+    }
+
+    void execute(XmlRpcValue& params, XmlRpcValue& result) {
+        Args a(params);
+        XmlRpcMutex::Lock l(children.lock());
+        find(a)->result(a.offset, a.binary, result);
+    }
+};
+
+/* Answers process.wait: the exit code, or -1 on timeout */
+class WaitAnswer: public SpawnListener {
+    XmlRpcDeferred* deferred_;
+public:
+    WaitAnswer(XmlRpcDeferred* deferred): deferred_(deferred) {}
+
+    void exited(int res) {
+        XmlRpcValue result(res);
+        deferred_->succeed(result);
+        delete this;
+    }
+
+    void timed_out(int /*pid*/) {
+        exited(-1);
+    }
+
+    void lost() {
+        errno=ECHILD;
+        try {
+            throw_on_os_error("wait");
+        } catch(XmlRpcException& e) {
+            deferred_->fail(e.getMessage(), e.getCode());
+        }
+        delete this;
+    }
+};
+
+static void throw_no_child(int pid, const char* what="wait") {
+    stringstream ss;
+    ss << what << ": no child process " << pid;
+    throw XmlRpcException(ss.str(), ECHILD);
+}
+
+/* called with the table lock held */
+static InputStream* find_input(int pid) {
+    Child* c=children.find(pid);
+    if(!c || !c->input)
+        throw XmlRpcException("no stdin pipe for this process");
+    return c->input;
+}
+
+class M_process_write: public XmlRpcServerMethod {
+public:
+    M_process_write(XmlRpcServer* server = 0):
+        XmlRpcServerMethod("process.write", server) {}
+
+    std::string help() {
+        return "process.write(pid, data): write to the stdin of a process spawned asynchronously\n"
+               "    with the stdin_pipe option\n"
+               "Arguments:\n"
+               "    data: string or base64\n"
+               "    the call does not block: what the pipe does not take at once is buffered, up\n"
+               "    to buffer_size bytes (see process.spawn), and the rest is refused\n"
+               "Return value:\n"
+               "    struct {written, buffered, room}\n"
+               "    written:  bytes of data accepted; the caller should send the rest again later\n"
+               "    buffered: bytes accepted but not taken by the pipe yet\n"
+               "    room:     bytes the next call may write";
+    }
+
+    /* the writes of a parallel multicall reach the pipe in order */
+    bool parallelSafe() const { return false; }
+
+    void execute(XmlRpcValue& params, XmlRpcValue& result) {
+        int pid;
+        string data;
+        try {
+            pid=params[0];
+            XmlRpcValue& vdata=params[1];
+            if(vdata.getType()==XmlRpcValue::TypeBase64) {
+                XmlRpcValue::BinaryData& b(vdata);
+                data.assign(b.begin(), b.end());
+            } else {
+                data=string(vdata);
+            }
+        } catch(...) {
+            throw XmlRpcException("parameters error");
+        }
+
+        bool arm=false;
+        {
+            XmlRpcMutex::Lock l(children.lock());
+            InputStream* in=find_input(pid);
+            if(!in->writable()) {
+                errno=EPIPE;
+                throw_on_os_error("write");
+            }
+            int written=in->write(data.data(), data.size(), &arm);
+            if(written<0) {
+                errno=EPIPE;
+                throw_on_os_error("write");
+            }
+            result["written"]=written;
+            result["buffered"]=(int)in->buffered();
+            result["room"]=(int)in->room();
+        }
+        if(arm)
+            children.post(new InputArm(pid));
+    }
+};
+
+class M_process_close_stdin: public XmlRpcServerMethod {
+public:
+    M_process_close_stdin(XmlRpcServer* server = 0):
+        XmlRpcServerMethod("process.close_stdin", server) {}
+
+    std::string help() {
+        return "process.close_stdin(pid): close the stdin of a process spawned asynchronously\n"
+               "    with the stdin_pipe option, once the data buffered by process.write is written\n"
+               "Return value: TRUE";
+    }
+
+    bool parallelSafe() const { return false; }
+
+    void execute(XmlRpcValue& params, XmlRpcValue& result) {
+        int pid;
+        try {
+            pid=params[0];
+        } catch(...) {
+            throw XmlRpcException("parameters error");
+        }
+
+        Child* c=NULL;
+        {
+            XmlRpcMutex::Lock l(children.lock());
+            if(find_input(pid)->close_stdin())
+                c=children.find(pid);
+        }
+        if(c)
+            children.stream_closed(c);
+        result=true;
+    }
+};
+
+class M_process_wait: public XmlRpcServerMethod {
+public:
+    M_process_wait(XmlRpcServer* server = 0): 
+        XmlRpcServerMethod("process.wait", server) {}
+
+    std::string help() {
+        return "process.wait(pid, timeout): wait for completion of <pid> or for <timeout> seconds\n"
+               "    <timeout> may be a double, it has millisecond resolution\n"
+               "Return value: the exit code, or -1 if the process is still running";
+    }
+
+    Execution execution() const { return Deferred; }
+
+    bool executeDeferred(XmlRpcValue& params, XmlRpcValue& result, XmlRpcDeferred* deferred) {
+        int pid;
+        double timeout=0;
+        try {
+            pid=params[0];
+            timeout=seconds(params[1]);
+        } catch(...) {
+            throw XmlRpcException("parameters error");
+        }
+
+        int code;
+        switch(children.collect(pid, &code)) {
+        case 1:
+            result=code;
+            return true;
+        case 0:
+            if(timeout<=0) {
+                result=-1;
+                return true;
+            }
+            new SpawnWaiter(pid, timeout, deferred->dispatch(), new WaitAnswer(deferred));
+            return false;
+        default:
+            throw_no_child(pid);
+            return true;
+        }
+    }
+
+    void execute(XmlRpcValue& params, XmlRpcValue& result) {
+        SyncDeferred deferred(result);
+        if(!executeDeferred(params, result, &deferred))
+            deferred.wait();
+    }
+};
+
+/* Waits on the event loop for any or all of several children to exit,
+   for process.wait_any and process.wait_all */
+class MultiWaiter: public XmlRpcSource, public ExitWatcher {
+    XmlRpcDeferred* deferred_;
+    XmlRpcDispatch* disp_;
+    vector<int> pids_; /* without duplicates */
+    bool all_;
+    double deadline_;
+    bool watching_;
+    XmlRpcValue result_;
+
+    static const double POLL_INTERVAL;
+
+public:
+    MultiWaiter(const vector<int>& pids, bool all):
+            deferred_(NULL), disp_(NULL), pids_(pids), all_(all), deadline_(0),
+            watching_(false) {
+        result_.setSize(0);
+    }
+
+    ~MultiWaiter() {
+        if(disp_)
+            disp_->cancelTimer(this);
+        if(watching_)
+            for(size_t i=0; i<pids_.size(); ++i)
+                children.unwatch(pids_[i], this);
+    }
+
+    /* collect the exit codes once the wait is over, or at once if <now>;
+       returns true if it is over. Throws if a pid is not a child, or has
+       been waited for, in which case none is collected */
+    bool collect(bool now) {
+        vector< pair<int, int> > exits;
+        int bad;
+        if(children.collect(pids_, all_, now, exits, &bad)<0)
+            throw_no_child(bad);
+        if(exits.empty() && !now)
+            return false;
+        for(size_t i=0; i<exits.size(); ++i) {
+            XmlRpcValue& exit=result_[result_.size()];
+            exit["pid"]=exits[i].first;
+            exit["exitcode"]=exits[i].second;
+        }
+        return true;
+    }
+
+    XmlRpcValue& result() { return result_; }
+
+    /* wait on the event loop; the waiter deletes itself when answered */
+    void start(double timeout, XmlRpcDeferred* deferred) {
+        deferred_=deferred;
+        disp_=deferred->dispatch();
+        deadline_=disp_->getTime()+timeout;
+        if(disp_==children.dispatch()) {
+            watching_=true;
+            bool exited=false;
+            for(size_t i=0; i<pids_.size(); ++i)
+                if(!children.watch(pids_[i], this))
+                    exited=true; /* before, or meanwhile */
+            disp_->scheduleTimer(this, exited? 0: timeout);
+        } else {
+            disp_->scheduleTimer(this, POLL_INTERVAL);
+        }
+    }
+
+    void check() {
+        bool done;
+        if(!watching_)
+            children.poll();
+        try {
+            done=collect(disp_->getTime()>=deadline_);
+        } catch(XmlRpcException& e) {
+            deferred_->fail(e.getMessage(), e.getCode());
+            delete this;
+            return;
+        }
+        if(done) {
+            deferred_->succeed(result_);
+            delete this;
+        } else if(!watching_) {
+            disp_->scheduleTimer(this, POLL_INTERVAL);
+        } else {
+            disp_->scheduleTimer(this, deadline_-disp_->getTime());
+        }
+    }
+
+    void child_exited(int /*pid*/) {
+        check();
+    }
+
+    unsigned handleEvent(unsigned /*eventType*/) {
+        check();
+        return 0;
+    }
+};
+
+const double MultiWaiter::POLL_INTERVAL=0.01;
+
+class M_process_wait_many: public XmlRpcServerMethod {
+    bool all_;
+public:
+    M_process_wait_many(XmlRpcServer* server, bool all):
+        XmlRpcServerMethod(all? "process.wait_all": "process.wait_any", server), all_(all) {}
+
+    std::string help() {
+        if(all_)
+            return "process.wait_all(pids, timeout): wait for completion of all of <pids> or for <timeout> seconds\n"
+                   "Return value: list of {pid, exitcode} for the processes which have completed";
+        return "process.wait_any(pids, timeout): wait for completion of any of <pids> or for <timeout> seconds\n"
+               "Return value: list of {pid, exitcode} for the processes which have completed\n"
+               "    (empty if none has completed in time)";
+    }
+
+    Execution execution() const { return Deferred; }
+
+    bool executeDeferred(XmlRpcValue& params, XmlRpcValue& result, XmlRpcDeferred* deferred) {
+        vector<int> pids;
+        double timeout=0;
+        try {
+            XmlRpcValue& vpids=params[0];
+            for(int i=0; i<vpids.size(); ++i) {
+                int pid=int(vpids[i]);
+                if(find(pids.begin(), pids.end(), pid)==pids.end())
+                    pids.push_back(pid);
+            }
+            if(params.size()>1)
+                timeout=seconds(params[1]);
+        } catch(...) {
+            throw XmlRpcException("parameters error");
+        }
+
+        MultiWaiter* w=new MultiWaiter(pids, all_);
+        try {
+            if(w->collect(timeout<=0)) {
+                result=w->result();
+                delete w;
+                return true;
+            }
+        } catch(...) {
+            delete w;
+            throw;
+        }
+        w->start(timeout, deferred);
+        return false;
+    }
+
+    void execute(XmlRpcValue& params, XmlRpcValue& result) {
+        SyncDeferred deferred(result);
+        if(!executeDeferred(params, result, &deferred))
+            deferred.wait();
+    }
+};
+
+class M_process_status: public XmlRpcServerMethod {
+public:
+    M_process_status(XmlRpcServer* server = 0):
+        XmlRpcServerMethod("process.status", server) {}
+
+    std::string help() {
+        return "process.status(pid): state and resource usage of a child\n"
+               "Arguments:\n"
+               "    pid: a child started by process.spawn (running, or among the last ones to finish)\n"
+               "Return value:\n"
+               "    struct {pid, running, start, wall}: start is the wall-clock time of the spawn\n"
+               "    (seconds since the epoch), wall the seconds it has been running; once the\n"
+               "    child has exited, also:\n"
+               "        exitcode, end: its exit code and wall-clock time of exit\n"
+               "        rusage: struct {utime, stime, maxrss, majflt, nvcsw, nivcsw}: user and\n"
+               "                system CPU seconds, peak resident set in kilobytes, major page\n"
+               "                faults, voluntary and involuntary context switches\n"
+               "    this does not wait for the child, nor collect its exit code";
+    }
+
+    void execute(XmlRpcValue& params, XmlRpcValue& result) {
+        int pid;
+        try {
+            pid=params[0];
+        } catch(...) {
+            throw XmlRpcException("parameters error");
+        }
+        if(!children.status(pid, result))
+            throw_no_child(pid, "status");
+    }
+};
+
+class M_process_list: public XmlRpcServerMethod {
+public:
+    M_process_list(XmlRpcServer* server = 0):
+        XmlRpcServerMethod("process.list", server) {}
+
+    std::string help() {
+        return "process.list([all=False]): the running children, or with all, every child in\n"
+               "the table (including the last ones to finish)\n"
+               "Return value:\n"
+               "    list of struct {pid, running, start, args}, with exitcode once a child has\n"
+               "    exited, or while it runs the latest struct of process.sample as sample";
+    }
+
+    void execute(XmlRpcValue& params, XmlRpcValue& result) {
+        bool all=false;
+        try {
+            if(params.getType()!=XmlRpcValue::TypeInvalid && params.size()>0)
+                all=bool(params[0]);
+        } catch(...) {
+            throw XmlRpcException("parameters error");
+        }
+        children.listing(all, result);
+    }
+};
+
+class M_process_sample: public XmlRpcServerMethod {
+public:
+    M_process_sample(XmlRpcServer* server = 0):
+        XmlRpcServerMethod("process.sample", server) {}
+
+    std::string help() {
+        return "process.sample(pid): the resources a child has been using, sampled while it runs\n"
+               "every sample_interval_ms of ExecServer.conf (where /proc can be read)\n"
+               "Return value:\n"
+               "    struct {pid, running, interval, samples}: interval is the seconds between samples,\n"
+               "    samples the latest ones, oldest first: struct {time, cpu, rss, threads,\n"
+               "    read_bytes, write_bytes}, where time is wall-clock, cpu the percent of a CPU used\n"
+               "    since the previous sample, rss the resident set in kilobytes, and read_bytes and\n"
+               "    write_bytes the storage IO so far (-1 if unknown)";
+    }
+
+    void execute(XmlRpcValue& params, XmlRpcValue& result) {
+        int pid;
+        try {
+            pid=params[0];
+        } catch(...) {
+            throw XmlRpcException("parameters error");
+        }
+        if(!children.samples(pid, result))
+            throw_no_child(pid, "sample");
+        result["interval"]=sampler.interval();
+    }
+};
+
+class M_process_kill: public XmlRpcServerMethod {
+public:
+    M_process_kill(XmlRpcServer* server = 0): 
+        XmlRpcServerMethod("process.kill", server) {}
+
+    std::string help() {
+        return "process.kill(pid, grace_ms): kill the process <pid> and its process group\n"
+               "    SIGTERM is sent at once, SIGKILL after <grace_ms> milliseconds (default:\n"
+               "    kill_grace_ms of ExecServer.conf, 1000), or at once if it is zero, or\n"
+               "    when the process exits if that is sooner; the call does not wait for\n"
+               "    the processes to exit. <pid> must be a running child of the server.";
+    }
+
+    void execute(XmlRpcValue& params, XmlRpcValue& result) {
+        int pid;
+        int grace_ms=-1;
+        try {
+            pid=params[0];
+            if(params.size()>1)
+                grace_ms=params[1];
+        } catch(...) {
+            throw XmlRpcException("parameters error");
+        }
+
+        clear_error();
+        int res=terminate(pid, grace_ms);
+        throw_on_os_error("kill");
+        result=res;
+    }
+};
+
+/* Job queue: process.submit runs children at most max_jobs at a time,
+   highest priority first, in order of submission within a priority */
+
+/* A histogram of durations, for process.queue_stats */
+class Histogram {
+    vector<int> counts_; /* the last one counts what is beyond the bounds */
+    int count_;
+    double sum_, max_;
+
+    static const double BOUNDS[];
+    static const int NBOUNDS;
+public:
+    Histogram(): counts_(NBOUNDS+1, 0), count_(0), sum_(0), max_(0) {}
+
+    void add(double t) {
+        int i=0;
+        while(i<NBOUNDS && t>BOUNDS[i])
+            ++i;
+        ++counts_[i];
+        ++count_;
+        sum_+=t;
+        if(t>max_)
+            max_=t;
+    }
+
+    void get(XmlRpcValue& result) const {
+        XmlRpcValue& bounds=result["bounds"];
+        XmlRpcValue& counts=result["counts"];
+        bounds.setSize(NBOUNDS);
+        counts.setSize(NBOUNDS+1);
+        for(int i=0; i<NBOUNDS; ++i)
+            bounds[i]=BOUNDS[i];
+        for(int i=0; i<=NBOUNDS; ++i)
+            counts[i]=counts_[i];
+        result["count"]=count_;
+        result["sum"]=sum_;
+        result["max"]=max_;
+    }
+};
+
+const double Histogram::BOUNDS[]={
+    0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5,
+    1, 2, 5, 10, 20, 50, 100, 200, 500, 1000
+};
+const int Histogram::NBOUNDS=sizeof(BOUNDS)/sizeof(BOUNDS[0]);
+
+class JobWaiter;
+
+/* A job of process.submit */
+class QueuedJob {
+public:
+    enum State { Queued, Running, Done, Failed, Cancelled };
+
+    int id, priority;
+    SpawnRequest req;
+    State state;
+    bool cancel; /* killed by process.job_cancel */
+    int pid, code;
+    string error;
+    double submitted, started, ended;
+    list<JobWaiter*> waiters;
+
+    QueuedJob(int id_, int priority_, const SpawnRequest& req_):
+            id(id_), priority(priority_), req(req_), state(Queued), cancel(false),
+            pid(0), code(0), submitted(wall_clock()), started(0), ended(0) {}
+
+    bool finished() const {
+        return state!=Queued && state!=Running;
+    }
+
+    /* the answer to process.job_wait */
+    void status(XmlRpcValue& result) const {
+        static const char* names[]={ "queued", "running", "done", "failed", "cancelled" };
+        double now=wall_clock();
+        result["id"]=id;
+        result["state"]=string(names[state]);
+        result["priority"]=priority;
+        result["submitted"]=submitted;
+        result["wait"]=(started>0? started: ended>0? ended: now)-submitted;
+        if(started>0) {
+            result["run"]=(ended>0? ended: now)-started;
+            if(pid>0)
+                result["pid"]=pid;
+        }
+        if(state==Failed)
+            result["error"]=error;
+        else if(finished() && pid>0)
+            result["exitcode"]=code;
+    }
+};
+
+class JobQueue: public ExitWatcher {
+    typedef map<pair<int, int>, QueuedJob*> PendingMap; /* by (-priority, id) */
+    typedef map<int, QueuedJob*> JobMap;
+    PendingMap pending_;
+    JobMap jobs_;    /* by id */
+    JobMap running_; /* by pid */
+    list<QueuedJob*> finished_; /* oldest first */
+    XmlRpcMutex lock_;
+    XmlRpcServer* server_;
+    int limit_;
+    int next_id_;
+    int submitted_, completed_, failed_, cancelled_;
+    Histogram wait_, run_;
+
+    enum { MAX_FINISHED = 1024 };
+
+    /* called with the lock held; the ids of the jobs whose waiters must
+       be told are added to <done> */
+    void finish(QueuedJob* j, QueuedJob::State state, list<int>& done) {
+        j->state=state;
+        j->ended=wall_clock();
+        if(state==QueuedJob::Cancelled)
+            ++cancelled_;
+        else if(state==QueuedJob::Failed)
+            ++failed_;
+        else
+            ++completed_;
+        if(j->started>0)
+            run_.add(j->ended-j->started);
+        if(!j->waiters.empty())
+            done.push_back(j->id);
+        finished_.push_back(j);
+        if(finished_.size()>MAX_FINISHED) {
+            QueuedJob* old=finished_.front();
+            finished_.pop_front();
+            jobs_.erase(old->id);
+            delete old;
+        }
+    }
+
+    /* called with the lock held, once the child of <j> has exited */
+    void collect(QueuedJob* j, list<int>& done) {
+        running_.erase(j->pid);
+        children.collect(j->pid, &j->code);
+        finish(j, j->cancel? QueuedJob::Cancelled: QueuedJob::Done, done);
+    }
+
+    /* called with the lock held: start the jobs there is room for */
+    void schedule(list<int>& done) {
+        while((int)running_.size()<limit_ && !pending_.empty()) {
+            QueuedJob* j=pending_.begin()->second;
+            pending_.erase(pending_.begin());
+            j->started=wall_clock();
+            wait_.add(j->started-j->submitted);
+            try {
+                j->pid=j->req.piped()? spawn_piped(j->req, server_): j->req.spawn();
+            } catch(XmlRpcException& e) {
+                j->error=e.getMessage();
+                finish(j, QueuedJob::Failed, done);
+                continue;
+            }
+            j->state=QueuedJob::Running;
+            running_[j->pid]=j;
+            if(!children.watch(j->pid, this))
+                collect(j, done); /* exited already */
+        }
+    }
+
+    /* tell the waiters of the jobs in <done>, on the dispatcher thread */
+    void post(const list<int>& done);
+
+public:
+    JobQueue(): server_(NULL), limit_(1), next_id_(1),
+            submitted_(0), completed_(0), failed_(0), cancelled_(0) {}
+
+    /* <limit> jobs may run at once */
+    void start(XmlRpcServer* server, int limit) {
+        server_=server;
+        limit_=limit>0? limit: 1;
+    }
+
+    /* queue a job, start it if there is room; returns its id */
+    int submit(const SpawnRequest& req, int priority) {
+        list<int> done;
+        int id;
+        {
+            XmlRpcMutex::Lock l(lock_);
+            id=next_id_++;
+            QueuedJob* j=new QueuedJob(id, priority, req);
+            jobs_[id]=j;
+            pending_[make_pair(-priority, id)]=j;
+            ++submitted_;
+            schedule(done);
+        }
+        post(done);
+        return id;
+    }
+
+    /* cancel a job: a queued one is dropped, a running one is killed.
+       Returns 1 if the job has been cancelled, 0 if it had finished
+       already, -1 if it is unknown */
+    int cancel(int id) {
+        list<int> done;
+        {
+            XmlRpcMutex::Lock l(lock_);
+            JobMap::iterator it=jobs_.find(id);
+            if(it==jobs_.end())
+                return -1;
+            QueuedJob* j=it->second;
+            if(j->state==QueuedJob::Queued) {
+                pending_.erase(make_pair(-j->priority, id));
+                finish(j, QueuedJob::Cancelled, done);
+            } else if(j->state==QueuedJob::Running) {
+                if(!j->cancel)
+                    terminate(j->pid);
+                j->cancel=true;
+            } else {
+                return 0;
+            }
+        }
+        post(done);
+        return 1;
+    }
+
+    /* a child has exited: finish its job and start the next ones */
+    void child_exited(int pid) {
+        list<int> done;
+        {
+            XmlRpcMutex::Lock l(lock_);
+            JobMap::iterator it=running_.find(pid);
+            if(it==running_.end())
+                return;
+            collect(it->second, done);
+            schedule(done);
+        }
+        post(done);
+    }
+
+    /* the answer to process.job_wait; returns false if the job is unknown */
+    bool status(int id, XmlRpcValue& result) {
+        XmlRpcMutex::Lock l(lock_);
+        JobMap::iterator it=jobs_.find(id);
+        if(it==jobs_.end())
+            return false;
+        it->second->status(result);
+        return true;
+    }
+
+    /* returns true if the job has finished, or is unknown */
+    bool finished(int id) {
+        XmlRpcMutex::Lock l(lock_);
+        JobMap::iterator it=jobs_.find(id);
+        return it==jobs_.end() || it->second->finished();
+    }
+
+    /* have <w> told when the job finishes; returns false if it has
+       finished already (or is unknown). Dispatcher thread only. */
+    bool watch(int id, JobWaiter* w) {
+        XmlRpcMutex::Lock l(lock_);
+        JobMap::iterator it=jobs_.find(id);
+        if(it==jobs_.end() || it->second->finished())
+            return false;
+        it->second->waiters.push_back(w);
+        return true;
+    }
+
+    void unwatch(int id, JobWaiter* w) {
+        XmlRpcMutex::Lock l(lock_);
+        JobMap::iterator it=jobs_.find(id);
+        if(it!=jobs_.end())
+            it->second->waiters.remove(w);
+    }
+
+    /* tell the waiters of a finished job; dispatcher thread only */
+    void notify(int id);
+
+    /* the answer to process.queue_stats */
+    void stats(XmlRpcValue& result) {
+        XmlRpcMutex::Lock l(lock_);
+        result["limit"]=limit_;
+        result["queued"]=(int)pending_.size();
+        result["running"]=(int)running_.size();
+        result["submitted"]=submitted_;
+        result["completed"]=completed_;
+        result["failed"]=failed_;
+        result["cancelled"]=cancelled_;
+        wait_.get(result["wait_time"]);
+        run_.get(result["run_time"]);
+    }
+};
+
+static JobQueue jobs;
+
+/* Waits on the event loop for a job to finish, for process.job_wait */
+class JobWaiter: public XmlRpcSource {
+    XmlRpcDeferred* deferred_;
+    XmlRpcDispatch* disp_;
+    int id_;
+    double deadline_;
+    bool watching_;
+
+    static const double POLL_INTERVAL;
+
+public:
+    JobWaiter(int id, double timeout, XmlRpcDispatch* disp, XmlRpcDeferred* deferred):
+            deferred_(deferred), disp_(disp), id_(id) {
+        deadline_=disp_->getTime()+timeout;
+        watching_=disp_==children.dispatch() && jobs.watch(id_, this);
+        if(!watching_)
+            disp_->scheduleTimer(this, 0); /* check at once, or start polling */
+        else
+            disp_->scheduleTimer(this, timeout);
+    }
+
+    ~JobWaiter() {
+        disp_->cancelTimer(this);
+        if(watching_)
+            jobs.unwatch(id_, this);
+    }
+
+    /* answer with the state of the job, and delete the waiter */
+    void answer() {
+        XmlRpcValue result;
+        if(jobs.status(id_, result))
+            deferred_->succeed(result);
+        else
+            deferred_->fail("job_wait: the job has been dropped");
+        delete this;
+    }
+
+    void job_done() {
+        watching_=false;
+        answer();
+    }
+
+    unsigned handleEvent(unsigned /*eventType*/) {
+        if(!watching_) {
+            children.poll();
+            if(!jobs.finished(id_) && disp_->getTime()<deadline_) {
+                disp_->scheduleTimer(this, POLL_INTERVAL);
+                return 0;
+            }
+        }
+        answer();
+        return 0;
+    }
+};
+
+const double JobWaiter::POLL_INTERVAL=0.01;
+
+/* Hands the waiters of a finished job to the dispatcher thread */
+class JobNotice: public XmlRpcThreadPool::Job {
+    int id_;
+public:
+    JobNotice(int id): id_(id) {}
+
+    void run() {}
+
+    void complete() {
+        jobs.notify(id_);
+        delete this;
+    }
+};
+
+void JobQueue::post(const list<int>& done) {
+    for(list<int>::const_iterator it=done.begin(); it!=done.end(); ++it)
+        server_->post(new JobNotice(*it));
+}
+
+void JobQueue::notify(int id) {
+    list<JobWaiter*> waiters;
+    {
+        XmlRpcMutex::Lock l(lock_);
+        JobMap::iterator it=jobs_.find(id);
+        if(it==jobs_.end())
+            return;
+        waiters.swap(it->second->waiters);
+    }
+    for(list<JobWaiter*>::iterator it=waiters.begin(); it!=waiters.end(); ++it)
+        (*it)->job_done();
+}
+
+static void throw_no_job(int id, const char* what) {
+    stringstream ss;
+    ss << what << ": no job " << id;
+    throw XmlRpcException(ss.str());
+}
+
+class M_process_submit: public XmlRpcServerMethod {
+public:
+    M_process_submit(XmlRpcServer* server = 0):
+        XmlRpcServerMethod("process.submit", server) {}
+
+    std::string help() {
+        return "process.submit(args, options, priority): queue a subprocess\n"
+               "Arguments:\n"
+               "    args:     list of parameters (first is the program name)\n"
+               "    options:  the options of process.spawn\n"
+               "    priority: integer, jobs of higher priority start first (default 0)\n"
+               "    at most max_jobs (ExecServer.conf, default: the number of processors)\n"
+               "    submitted jobs run at once; the others wait in order of priority, then\n"
+               "    of submission\n"
+               "Return value:\n"
+               "    the job id (integer), for process.job_wait and process.job_cancel";
+    }
+
+    void execute(XmlRpcValue& params, XmlRpcValue& result) {
+        SpawnRequest req;
+        int priority=0;
+        try {
+            XmlRpcValue spawn;
+            spawn[0]=params[0];
+            spawn[1]=0;
+            if(params.size()>1)
+                spawn[2]=params[1];
+            req.parse(spawn);
+            if(params.size()>2)
+                priority=params[2];
+        } catch(...) {
+            throw XmlRpcException("parameters error");
+        }
+        result=jobs.submit(req, priority);
+    }
+};
+
+class M_process_job_wait: public XmlRpcServerMethod {
+public:
+    M_process_job_wait(XmlRpcServer* server = 0):
+        XmlRpcServerMethod("process.job_wait", server) {}
+
+    std::string help() {
+        return "process.job_wait(id, timeout): wait for a job of process.submit to finish,\n"
+               "or for <timeout> seconds (zero returns at once)\n"
+               "Return value:\n"
+               "    struct {id, state, priority, submitted, wait}: state is one of queued, running,\n"
+               "    done, failed or cancelled, submitted the wall-clock time of submission, wait\n"
+               "    the seconds the job has spent in the queue;\n"
+               "    once started, also run (seconds) and pid; once finished, exitcode, or\n"
+               "    error if the process could not be started";
+    }
+
+    Execution execution() const { return Deferred; }
+
+    bool executeDeferred(XmlRpcValue& params, XmlRpcValue& result, XmlRpcDeferred* deferred) {
+        int id;
+        double timeout=0;
+        try {
+            id=params[0];
+            if(params.size()>1)
+                timeout=seconds(params[1]);
+        } catch(...) {
+            throw XmlRpcException("parameters error");
+        }
+
+        if(!jobs.status(id, result))
+            throw_no_job(id, "job_wait");
+        if(timeout<=0 || jobs.finished(id))
+            return true;
+        result.clear();
+        new JobWaiter(id, timeout, deferred->dispatch(), deferred);
+        return false;
+    }
+
+    void execute(XmlRpcValue& params, XmlRpcValue& result) {
+        SyncDeferred deferred(result);
+        if(!executeDeferred(params, result, &deferred))
+            deferred.wait();
+    }
+};
+
+class M_process_job_cancel: public XmlRpcServerMethod {
+public:
+    M_process_job_cancel(XmlRpcServer* server = 0):
+        XmlRpcServerMethod("process.job_cancel", server) {}
+
+    std::string help() {
+        return "process.job_cancel(id): cancel a job of process.submit\n"
+               "    a queued job is dropped, a running one is killed\n"
+               "Return value: TRUE if the job has been cancelled, FALSE if it had finished";
+    }
+
+    void execute(XmlRpcValue& params, XmlRpcValue& result) {
+        int id;
+        try {
+            id=params[0];
+        } catch(...) {
+            throw XmlRpcException("parameters error");
+        }
+        int r=jobs.cancel(id);
+        if(r<0)
+            throw_no_job(id, "job_cancel");
+        result=(r>0);
+    }
+};
+
+class M_process_queue_stats: public XmlRpcServerMethod {
+public:
+    M_process_queue_stats(XmlRpcServer* server = 0):
+        XmlRpcServerMethod("process.queue_stats", server) {}
+
+    std::string help() {
+        return "process.queue_stats(): state of the queue of process.submit\n"
+               "Return value:\n"
+               "    struct {limit, queued, running, submitted, completed, failed, cancelled,\n"
+               "            wait_time, run_time}\n"
+               "    wait_time and run_time are histograms of the seconds jobs have spent in the\n"
+               "    queue and running: struct {bounds, counts, count, sum, max}, where counts[i]\n"
+               "    is the number of jobs up to bounds[i], and the last count those beyond";
+    }
+
+    void execute(XmlRpcValue& /*params*/, XmlRpcValue& result) {
+        jobs.stats(result);
+    }
+};
+
+class M_system_version: public XmlRpcServerMethod {
+public:
+    M_system_version(XmlRpcServer* server = 0): XmlRpcServerMethod("system.version", server) {}
+
+    std::string help() {
+        return "system.version(): return ExecServer version";
+    }
+
+    void execute(XmlRpcValue& /*params*/, XmlRpcValue& result) {
+    	result = _VERSION_;
+    }
+};
+
+class M_system_uname: public XmlRpcServerMethod {
+public:
+    M_system_uname(XmlRpcServer* server = 0): XmlRpcServerMethod("system.uname", server) {}
+
+    std::string help() {
+        return "system.uname(): return machine info";
+    }
+
+    void execute(XmlRpcValue& /*params*/, XmlRpcValue& result) {
+    	struct utsname un;
+    	uname(&un);
+    	result["sysname"]=un.sysname;
+    	result["nodename"]=un.nodename;
+    	result["release"]=un.release;
+    	result["version"]=un.version;
+    	result["machine"]=un.machine;    	
+    }
+};
+
+class M_system_getenv: public XmlRpcServerMethod {
+public:
     M_system_getenv(XmlRpcServer* server = 0): XmlRpcServerMethod("system.getenv", server) {}
 
     std::string help() {
@@ -632,12 +4734,41 @@ public:
     }
 };
 
+class M_system_stats: public XmlRpcServerMethod {
+public:
+    M_system_stats(XmlRpcServer* server = 0): XmlRpcServerMethod("system.stats", server) {}
+
+    std::string help() {
+        return "system.stats(): counts of the server's connections and requests\n"
+               "Return value:\n"
+               "    struct {connections, requests, cancelled, reactors, workers}: the open\n"
+               "    connections, the requests started, and those cancelled because the client\n"
+               "    disconnected before the answer (which kills the processes of a synchronous\n"
+               "    process.spawn, process.spawn_many, process.run or process.pipeline, and stops a\n"
+               "    file.get or file.sha1), summed over the event loops serving the port (reactors\n"
+               "    of ExecServer.conf); the worker threads of each event loop";
+    }
+
+    void execute(XmlRpcValue& /*params*/, XmlRpcValue& result) {
+        const XmlRpcServer::Stats& stats=_server->getStats();
+        result["connections"]=stats.connections;
+        result["requests"]=(int)stats.requests;
+        result["cancelled"]=(int)stats.cancelled;
+        result["reactors"]=_server->getReactors();
+        result["workers"]=_server->getWorkerThreads();
+    }
+};
+
 
 class ExecServer: public XmlRpcServer {
     int port_;
+    int threads_;
+    int max_jobs_;
     volatile bool stop_flag_;
 public:
-    ExecServer(int port): XmlRpcServer(), port_(port), stop_flag_(false) {
+    ExecServer(int port, int threads, int max_jobs):
+        XmlRpcServer(), port_(port), threads_(threads), max_jobs_(max_jobs),
+        stop_flag_(false) {
 	addMethod(new M_dir_tmpname(this));
         addMethod(new M_dir_chdir(this));
 	addMethod(new M_dir_mkdir(this));
@@ -647,15 +4778,39 @@ public:
 	addMethod(new M_file_sha1(this));
         addMethod(new M_file_remove(this));
         addMethod(new M_process_spawn(this));
+        addMethod(new M_process_spawn_many(this));
+        addMethod(new M_process_run(this));
+        addMethod(new M_process_pipeline(this));
+        addMethod(new M_process_zygote(this));
+        addMethod(new M_process_read(this));
+        addMethod(new M_process_write(this));
+        addMethod(new M_process_close_stdin(this));
         addMethod(new M_process_wait(this));
+        addMethod(new M_process_wait_many(this, false));
+        addMethod(new M_process_wait_many(this, true));
+        addMethod(new M_process_status(this));
+        addMethod(new M_process_list(this));
+        addMethod(new M_process_sample(this));
         addMethod(new M_process_kill(this));
+        addMethod(new M_process_submit(this));
+        addMethod(new M_process_job_wait(this));
+        addMethod(new M_process_job_cancel(this));
+        addMethod(new M_process_queue_stats(this));
         addMethod(new M_system_getenv(this));
         addMethod(new M_system_version(this));
         addMethod(new M_system_uname(this));
+        addMethod(new M_system_stats(this));
     }
 
     bool start() {
-        if(!bindAndListen(port_)) return false;
+        setReactors(cfg()->reactors, cfg()->pin_reactors!=0);
+        if(!bindAndListen(port_, LISTEN_BACKLOG)) return false;
+        bool threaded=threads_>0 && setWorkerThreads(threads_);
+        /* the additional reactors run methods off the dispatcher thread too */
+        children.start(this, threaded || getReactors()>1);
+        sampler.start(getDispatch(), cfg()->sample_interval_ms);
+        jobs.start(this, max_jobs_);
+        cache.start(this, threaded, cfg()->cache_dir, cfg()->cache_size_mb);
         enableIntrospection();
         while(!stop_flag_) work(0.5);
         shutdown();
@@ -675,8 +4830,12 @@ int main0(void) {
         return 2;
     }
     srand((unsigned)time(NULL));
+    raise_fd_limit();
     chdir(cfg()->start_dir);
-    srv=new ExecServer(cfg()->listen_port);
+    pcgroup_init();
+    pzygote_prefork(cfg()->zygotes);
+    srv=new ExecServer(cfg()->listen_port, cfg()->worker_threads,
+                       cfg()->max_jobs);
     srv->start();
     delete srv;
     srv=NULL;
@@ -725,6 +4884,7 @@ int main(int argc, char** argv) {
         }
     }
     if(detach) daemon(0,0);
+    signal(SIGPIPE, SIG_IGN); /* a peer may close its end at any time */
     return main0();
 }
 #endif
@@ -0,0 +1,182 @@
+"""Microbenchmarks for ExecServer
+
+Usage: bench.py <benchmark> [arguments]
+
+Benchmarks:
+    calls [N] [P]  system.version calls per second, N calls (default: 20000)
+                   from P parallel client processes (default: 1 4 16); set
+                   reactors in ExecServer.conf to spread them over event loops
+    idle [N...]    latency of system.version with N idle connections open
+                   (default: 100 1000 10000)
+    spawn [N]      spawn-to-result latency of t/show_args, N runs (default: 200)
+                   through a synchronous process.spawn and through
+                   an asynchronous process.spawn followed by process.wait
+    throughput [N] [P]
+                   spawns per second of t/show_args, N runs (default: 2000)
+                   from P parallel clients (default: 1 4 16); start the
+                   server with "spawn_method fork" in ExecServer.conf
+                   to measure the legacy fork() path
+    zygote [N]     spawn-to-result latency of t/show_args, N runs (default: 500)
+                   spawned by the server and through process.zygote
+"""
+from xmlrpclib import *
+
+import os, sys
+import time
+import socket
+import threading
+
+SERVER_URL=os.environ.get("EXECSERVER_URL", "http://localhost:5840")
+CALLS=2000
+REMOTE_PROJECT_PATH=os.environ.get("REMOTE_PROJECT_PATH")
+LOCAL_TEST_PATH=os.path.dirname(os.path.realpath(__file__))
+if REMOTE_PROJECT_PATH:
+    REMOTE_TEST_PATH=REMOTE_PROJECT_PATH+"/t"
+else:
+    REMOTE_TEST_PATH=LOCAL_TEST_PATH
+
+def t(s):
+    return REMOTE_TEST_PATH+"/"+s
+
+def server_address():
+    hostport=SERVER_URL.split("://",1)[-1].split("/",1)[0]
+    if ":" in hostport:
+        host,port=hostport.split(":")
+        return host,int(port)
+    return hostport,80
+
+def raise_fd_limit(n):
+    try:
+        import resource
+        soft,hard=resource.getrlimit(resource.RLIMIT_NOFILE)
+        if soft<n:
+            resource.setrlimit(resource.RLIMIT_NOFILE, (min(n,hard), hard))
+    except (ImportError, ValueError):
+        pass
+
+def time_calls(s, calls):
+    """returns the mean time of a system.version call in seconds"""
+    s.system.version() # warm up the connection
+    t0=time.time()
+    for i in xrange(calls):
+        s.system.version()
+    return (time.time()-t0)/calls
+
+def bench_idle(counts):
+    addr=server_address()
+    raise_fd_limit(max(counts)+100)
+    print "%8s %12s %12s" % ("idle", "usec/call", "calls/sec")
+    for n in counts:
+        idle=[]
+        try:
+            for i in xrange(n):
+                c=socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+                c.connect(addr)
+                idle.append(c)
+            dt=time_calls(ServerProxy(SERVER_URL), CALLS)
+            print "%8d %12.1f %12.0f" % (n, dt*1e6, 1.0/dt)
+        finally:
+            for c in idle:
+                c.close()
+        time.sleep(0.5) # let the server drop the idle connections
+
+def percentile(samples, p):
+    s=sorted(samples)
+    return s[min(len(s)-1, int(len(s)*p))]
+
+def report(name, samples):
+    print "%-16s %10.2f %10.2f %10.2f" % (name,
+        1e3*sum(samples)/len(samples), 1e3*percentile(samples, 0.5),
+        1e3*percentile(samples, 0.95))
+
+def bench_spawn(args):
+    runs=args[0]
+    s=ServerProxy(SERVER_URL)
+    argv=[t("show_args"), "hello"]
+    sync=[]
+    for i in xrange(runs):
+        t0=time.time()
+        s.process.spawn(argv, 10)
+        sync.append(time.time()-t0)
+    async=[]
+    for i in xrange(runs):
+        t0=time.time()
+        pid=s.process.spawn(argv, 0)
+        s.process.wait(pid, 10)
+        async.append(time.time()-t0)
+    print "%-16s %10s %10s %10s" % ("ms", "mean", "median", "p95")
+    report("spawn", sync)
+    report("spawn+wait", async)
+
+def bench_calls(args):
+    calls=args[0]
+    clients=args[1:] or [1, 4, 16]
+    print "%8s %12s %12s" % ("clients", "calls/sec", "usec/call")
+    for p in clients:
+        n=calls//p
+        pids=[]
+        t0=time.time()
+        for i in xrange(p):
+            pid=os.fork()
+            if pid==0:
+                s=ServerProxy(SERVER_URL)
+                for j in xrange(n):
+                    s.system.version()
+                os._exit(0)
+            pids.append(pid)
+        for pid in pids:
+            os.waitpid(pid, 0)
+        dt=time.time()-t0
+        print "%8d %12.0f %12.1f" % (p, n*p/dt, 1e6*dt/(n*p))
+
+def bench_throughput(args):
+    runs=args[0]
+    clients=args[1:] or [1, 4, 16]
+    argv=[t("show_args"), "hello"]
+    print "%8s %12s %12s" % ("clients", "spawns/sec", "ms/spawn")
+    for p in clients:
+        def client(n):
+            s=ServerProxy(SERVER_URL)
+            for i in xrange(n):
+                s.process.spawn(argv, 10)
+        threads=[threading.Thread(target=client, args=(runs//p,))
+                 for i in xrange(p)]
+        t0=time.time()
+        for th in threads:
+            th.start()
+        for th in threads:
+            th.join()
+        dt=time.time()-t0
+        n=runs//p*p
+        print "%8d %12.0f %12.2f" % (p, n/dt, 1e3*dt*p/n)
+
+def bench_zygote(args):
+    runs=args[0]
+    s=ServerProxy(SERVER_URL)
+    prefix=[t("show_args"), "zygote"]
+    s.process.zygote(prefix)
+    print "%-16s %10s %10s %10s" % ("ms", "mean", "median", "p95")
+    for name,argv in (("pspawn", [t("show_args"), "hello"]),
+                      ("zygote", prefix+["hello"])):
+        samples=[]
+        for i in xrange(runs):
+            t0=time.time()
+            s.process.spawn(argv, 10)
+            samples.append(time.time()-t0)
+        report(name, samples)
+
+BENCHMARKS={
+    "calls": (bench_calls, [20000]),
+    "idle": (bench_idle, [100, 1000, 10000]),
+    "spawn": (bench_spawn, [200]),
+    "throughput": (bench_throughput, [2000]),
+    "zygote": (bench_zygote, [500]),
+}
+
+if __name__=="__main__":
+    if len(sys.argv)<2 or sys.argv[1] not in BENCHMARKS:
+        print __doc__
+        sys.exit(1)
+    func,defaults=BENCHMARKS[sys.argv[1]]
+    args=[int(a) for a in sys.argv[2:]] or defaults
+    func(args)
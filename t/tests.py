@@ -48,6 +48,22 @@ class dir_tests(unittest.TestCase):
         self.assertRaises(Fault, self.s.dir.rmdir, self.workdir)
         self.assertEqual(self.s.dir.rmdir(self.workdir, True), "")
         
+    def test_session(self):
+        self.workdir=self.s.dir.tmpname()
+        self.s.dir.mkdir(self.workdir)
+        other=ServerProxy(SERVER_URL)
+        start=other.dir.chdir("")
+        self.assertEqualFilename(self.s.dir.chdir(self.workdir), self.workdir)
+        self.assertEqualFilename(other.dir.chdir("."), start)
+        self.s.file.put("f", "here")
+        self.assertEqual(other.file.get(self.workdir+"/f"), "here")
+        self.assertRaises(Fault, other.file.get, "f")
+        v=self.s.system.uname()
+        if v["sysname"][:3] != "Win":
+            self.assertEqual(self.s.process.spawn(["/bin/sh", "-c", "pwd"], 5,
+                                                  {"stdout": "out"}), 0)
+            self.assertEqualFilename(self.s.file.get("out").strip(), self.workdir)
+
     def test_tmpfile(self):
         self.workdir=self.s.dir.tmpname()
         self.assert_(self.workdir)
@@ -91,6 +107,83 @@ class file_tests(unittest.TestCase):
         self.s.file.remove(wf)
         self.assertRaises(Fault, self.s.file.remove, wf)
     
+    def test_large(self):
+        # from 1 MB on the file is streamed, binary with its length, text in chunks
+        import random, socket, urlparse
+        wf=self.s.dir.tmpname()
+        data="".join(chr(random.randrange(256)) for i in xrange(3*1024*1024+7))
+        self.assertEqual(self.s.file.put(wf, Binary(data)), len(data))
+        self.assertEqual(self.s.file.get(wf, True).data, data)
+        self.assertEqual(self.s.file.get(wf, True, 5, 2*1024*1024).data,
+                         data[5:5+2*1024*1024])
+        m=MultiCall(self.s)
+        m.file.get(wf, True)
+        self.assertEqual(tuple(m())[0].data, data)
+        text=200000*"<a&b>\n"
+        self.s.file.put(wf, text)
+        self.assertEqual(self.s.file.get(wf), text)
+        # an HTTP/1.0 client reads the response up to the end of the connection
+        body=dumps((wf,), "file.get")
+        host, port=urlparse.urlparse(SERVER_URL)[1].split(":")
+        c=socket.create_connection((host, int(port)))
+        c.sendall("POST /RPC2 HTTP/1.0\r\nContent-length: %d\r\n\r\n%s" % (len(body), body))
+        response=c.makefile("rb").read()
+        c.close()
+        self.assertEqual(loads(response.split("\r\n\r\n", 1)[1])[0][0], text)
+        self.s.file.remove(wf)
+
+    def test_large_put(self):
+        # from 1 MB on the data goes to a file beside the target as it is
+        # read, which then replaces the target, keeping its permissions
+        import tempfile, shutil
+        wd=tempfile.mkdtemp()
+        try:
+            self.s.dir.chdir(wd)
+            data=os.urandom(2*1024*1024+1)
+            self.assertEqual(self.s.file.put("f", Binary("hello")), 5)
+            if os.name=="posix":
+                os.chmod(os.path.join(wd, "f"), 0640)
+            self.assertEqual(self.s.file.put("f", Binary(data)), len(data))
+            if os.name=="posix":
+                self.assertEqual(os.stat(os.path.join(wd, "f")).st_mode&0777, 0640)
+            self.assertEqual(self.s.file.put("f", Binary(data), True), len(data))
+            self.assertEqual(self.s.file.get("f", True).data, data+data)
+            if os.name=="posix":
+                os.symlink("f", os.path.join(wd, "l"))
+                self.assertEqual(self.s.file.put("l", Binary(data)), len(data))
+                self.assertTrue(os.path.islink(os.path.join(wd, "l")))
+                self.assertEqual(self.s.file.get("f", True).data, data)
+                os.remove(os.path.join(wd, "l"))
+            text=200000*"<a&b>\n"
+            self.assertEqual(self.s.file.put("t", text, True), len(text))
+            self.assertEqual(self.s.file.get("t"), text)
+            self.assertRaises(Fault, self.s.file.put, "no/such/file", text)
+            self.assertEqual(sorted(os.listdir(wd)), ["f", "t"])
+        finally:
+            self.s.dir.chdir("")
+            shutil.rmtree(wd)
+
+    def test_large_put_dropped(self):
+        # a client which drops in the middle of a large put leaves the target as it was
+        import tempfile, shutil, socket, urlparse
+        wd=tempfile.mkdtemp()
+        try:
+            self.s.dir.chdir(wd)
+            self.assertEqual(self.s.file.put("f", "hello"), 5)
+            body=dumps(("f", Binary(os.urandom(4*1024*1024))), "file.put")
+            host, port=urlparse.urlparse(SERVER_URL)[1].split(":")
+            c=socket.create_connection((host, int(port)))
+            c.sendall("POST /RPC2 HTTP/1.1\r\nContent-Type: text/xml\r\n"
+                      "Content-length: %d\r\n\r\n%s" % (len(body), body[:len(body)/2]))
+            time.sleep(0.5)
+            c.close()
+            time.sleep(0.5)
+            self.assertEqual(self.s.file.get("f"), "hello")
+            self.assertEqual(os.listdir(wd), ["f"])
+        finally:
+            self.s.dir.chdir("")
+            shutil.rmtree(wd)
+
     def test_append(self):
         wf=self.s.dir.tmpname()
         self.assertEqual(self.s.file.put(wf, Binary("the")), 3)
@@ -178,8 +271,32 @@ class process_tests(unittest.TestCase):
         data=self.s.file.get(wf).split('\n')
         self.assertEqual(data[0], "foo=aaa")
         self.assertEqual(data[1], "baz not set")
+
+    def test_path_lookup(self):
+        self.assertRaises(Fault, self.s.process.spawn,
+                          [t("no_such_program")], 1)
+        v=self.s.system.uname()
+        if v["sysname"][:3] != "Win":
+            self.assertEqual(self.s.process.spawn(["show_args"], 1,
+                             { "env": {"PATH": REMOTE_TEST_PATH} }), 0)
                 
         
+    def test_zygote(self):
+        v=self.s.system.uname()
+        if v["sysname"][:3] == "Win":
+            return
+        prefix=[t("show_env"), "zygote"]
+        pid=self.s.process.zygote(prefix, {"env": {"zygote": "yes"}})
+        self.assertEqual(self.s.process.zygote(prefix), pid)
+        r=self.s.process.run(prefix+["foo"], 5, {"env": {"foo": "bar"}})
+        self.assertEqual(r["stdout"], "zygote=yes\nfoo=bar\n")
+        r=self.s.process.run([t("show_env"), "zygote"], 5)
+        self.assertEqual(r["stdout"], "zygote=yes\n")
+        r=self.s.process.run([t("show_env"), "foo", "zygote"], 5)
+        self.assertEqual(r["stdout"], "foo not set\nzygote not set\n")
+        self.s.process.zygote([t("no_such_program")])
+        self.assertRaises(Fault, self.s.process.spawn, [t("no_such_program")], 1)
+
     def test_time(self):
         wf=self.s.dir.tmpname()
         self.assertEqual(self.s.process.spawn([t("countdown")], 1), 1)
@@ -199,11 +316,321 @@ class process_tests(unittest.TestCase):
         self.assert_(len(lines)==1 or len(lines)==2)
         self.s.file.remove(wf)
 
+    def test_run(self):
+        r=self.s.process.run([t("cat_err")], 5, {"input": "hello\n"})
+        self.assertEqual(r, {"exitcode": 0, "stdout": "hello\n",
+                             "stderr": "hello\n", "truncated": False})
+        self.assertEqual(self.s.process.run([t("countdown")], 5)["exitcode"], 1)
+        self.assertRaises(Fault, self.s.process.run, [t("countdown"), "3"], 1)
+        m=MultiCall(self.s)
+        m.process.run([t("show_args"), "foo"], 5)
+        self.assertEqual(tuple(m())[0]["stdout"].split("\n")[1], "foo")
+
+    def test_run_cache(self):
+        v=self.s.system.uname()
+        if v["sysname"][:3] == "Win":
+            return
+        wd=self.s.dir.tmpname()
+        self.s.dir.mkdir(wd)
+        self.s.dir.chdir(wd)
+        try:
+            self.s.file.put("in", "data")
+            cmd=["/bin/sh", "-c", "cat in > out; echo $$"]
+            opts={"cache": {"inputs": ["in"], "outputs": ["out"], "env": ["TOKEN"]},
+                  "env": {"TOKEN": str(time.time())}}
+            r=self.s.process.run(cmd, 5, opts)
+            self.assertEqual(r["cache"], "miss")
+            time.sleep(0.5) # stored after the answer
+            self.s.file.remove("out")
+            t0=time.time()
+            hit=self.s.process.run(cmd, 5, opts)
+            self.assert_(time.time()-t0 < 0.5)
+            self.assertEqual(hit["cache"], "hit")
+            self.assertEqual(hit["stdout"], r["stdout"])
+            self.assertEqual(self.s.file.get("out"), "data")
+            self.s.file.put("in", "changed")
+            r=self.s.process.run(cmd, 5, opts)
+            self.assertEqual(r["cache"], "miss")
+            self.assertNotEqual(r["stdout"], hit["stdout"])
+            # the output of a cached run cannot go to files
+            self.assertRaises(Fault, self.s.process.run, ["/bin/echo", "x"], 5,
+                              {"stdout": "f", "cache": True})
+            self.assertRaises(Fault, self.s.process.run, ["/bin/echo", "x"], 5,
+                              {"stderr": "f", "cache": True})
+            # the env option is part of the key, named in cache.env or not
+            cmd=["/bin/sh", "-c", "echo $FOO"]
+            token=str(time.time())
+            r=self.s.process.run(cmd, 5, {"env": {"FOO": token+"a"}, "cache": True})
+            self.assertEqual(r["stdout"], token+"a\n")
+            time.sleep(0.5)
+            r=self.s.process.run(cmd, 5, {"env": {"FOO": token+"b"}, "cache": True})
+            self.assertEqual(r["cache"], "miss")
+            self.assertEqual(r["stdout"], token+"b\n")
+            # and so is the directory, of the session or the cwd option
+            self.s.dir.mkdir("a")
+            self.s.dir.mkdir("b")
+            cmd=["/bin/sh", "-c", "pwd; echo %s" % token]
+            r=self.s.process.run(cmd, 5, {"cwd": "a", "cache": True})
+            self.assertEqual(r["cache"], "miss")
+            time.sleep(0.5)
+            r=self.s.process.run(cmd, 5, {"cwd": "b", "cache": True})
+            self.assertEqual(r["cache"], "miss")
+            self.assertEqual(simplify_filename(r["stdout"].split()[0]),
+                             simplify_filename(wd+"/b"))
+            time.sleep(0.5)
+            self.s.dir.chdir("b")
+            r=self.s.process.run(cmd, 5, {"cache": True})
+            self.assertEqual(r["cache"], "hit")
+            self.s.dir.chdir("../a")
+            r=self.s.process.run(cmd, 5, {"cache": True})
+            self.assertEqual(r["cache"], "hit")
+            self.assertEqual(simplify_filename(r["stdout"].split()[0]),
+                             simplify_filename(wd+"/a"))
+        finally:
+            self.s.dir.chdir("")
+            self.s.dir.rmdir(wd, True)
+
+    def test_run_binary(self):
+        data="".join([chr(i%256) for i in xrange(300000)])
+        r=self.s.process.run([t("cat_err")], 5,
+                             {"input": Binary(data), "binary": True,
+                              "stderr_limit": 1000})
+        self.assertEqual(r["stdout"].data, data)
+        self.assertEqual(r["stderr"].data, data[:1000])
+        self.assert_(r["truncated"])
+
+    def test_spawn_many(self):
+        r=self.s.process.spawn_many([
+            {"args": [t("countdown")]},
+            [t("no_such_program")],
+            {"args": [t("show_args")], "options": {"rusage": True}},
+            {"options": {}},
+            {"args": [t("countdown"), "3"]}], 1)
+        self.assertEqual([e["index"] for e in r], range(5))
+        self.assertEqual(r[0]["exitcode"], 1)
+        self.assert_("error" in r[1] and "exitcode" not in r[1])
+        self.assertEqual(r[2]["status"]["exitcode"], 0)
+        self.assert_("error" in r[3])
+        self.assert_("pid" in r[4] and "killed" in r[4]["error"])
+        t0=time.time()
+        r=self.s.process.spawn_many([[t("countdown"), "1"]]*4, 5, 2)
+        self.assertEqual([e["exitcode"] for e in r], [0]*4)
+        self.assert_(1.5 < time.time()-t0 < 3)
+        r=self.s.process.spawn_many([[t("countdown"), "1"], [t("no_such_program")]], 0)
+        self.assert_("error" in r[1])
+        self.assertEqual(self.s.process.wait(r[0]["pid"], 5), 0)
+
+    def test_pipeline(self):
+        r=self.s.process.pipeline([[t("cat_err")], [t("cat_err")]], 5,
+                                  {"input": "hello\n"})
+        self.assertEqual(r["exitcodes"], [0, 0])
+        self.assertEqual(r["stdout"], "hello\n")
+        self.assertEqual(r["stderr"], "hello\nhello\n")
+        r=self.s.process.pipeline([[t("show_args"), "a"], [t("cat_err")],
+                                   [t("countdown")]], 5)
+        # countdown does not read, so cat_err may get SIGPIPE
+        self.assertEqual((r["exitcodes"][2], r["exitcode"]), (1, 1))
+        self.assert_(r["exitcodes"][1] in (0, 0x100+13))
+        data="".join([chr(i%256) for i in xrange(1000000)])
+        r=self.s.process.pipeline([[t("cat_err")]]*3, 10,
+                                  {"input": Binary(data), "binary": True,
+                                   "stderr": self.s.dir.tmpname()})
+        self.assertEqual(r["stdout"].data, data)
+        t0=time.time()
+        self.assertRaises(Fault, self.s.process.pipeline,
+                          [[t("countdown"), "3"], [t("cat_err")]], 1)
+        self.assert_(time.time()-t0 < 2)
+        self.assertRaises(Fault, self.s.process.pipeline,
+                          [[t("cat_err")], [t("no_such_program")]], 1)
+
+    def test_read(self):
+        pid=self.s.process.spawn([t("countdown"), "2"], 0, {"pipe": True})
+        r=self.s.process.read(pid, "stdout", 0, 3000)
+        self.assertEqual(r["data"], "2\n")
+        self.assertEqual(r["offset"], 2)
+        t0=time.time()
+        r=self.s.process.read(pid, "stdout", r["offset"], 3000)
+        self.assert_(0.5 < time.time()-t0 < 2.5) # woken up by the output
+        self.assertEqual(r["data"], "1\n")
+        out=r["data"]
+        while not r["eof"]:
+            r=self.s.process.read(pid, "stdout", r["offset"], 3000)
+            out+=r["data"]
+        self.assertEqual(out, "1\nstart!\n")
+        r=self.s.process.read(pid, "stderr", 0)
+        self.assertEqual((r["data"], r["eof"]), ("", True))
+        self.assertEquals(self.s.process.wait(pid, 3), 0)
+
+    def test_read_ring_buffer(self):
+        data="x"*100000
+        wf=self.s.dir.tmpname()
+        self.s.file.put(wf, data)
+        pid=self.s.process.spawn([t("cat_err")], 0,
+                                 {"pipe": True, "buffer_size": 1000,
+                                  "stdin": wf})
+        r=self.s.process.read(pid, "stderr", 0, 3000)
+        while not r["eof"]:
+            r=self.s.process.read(pid, "stderr", r["offset"], 3000)
+        self.assertEquals(self.s.process.wait(pid, 3), 0)
+        r=self.s.process.read(pid, "stderr", 0)
+        self.assertEqual((r["offset"], r["lost"], r["data"]),
+                         (len(data), len(data)-1000, data[-1000:]))
+        self.s.file.remove(wf)
+
     def test_wait(self):
         pid=self.s.process.spawn([t("countdown"),"5"], 0)
         self.assertEquals(self.s.process.wait(pid,3), -1)
         self.assertEquals(self.s.process.wait(pid,3), 0)
         
+    def test_write(self):
+        v=self.s.system.uname()
+        if v["sysname"][:3] == "Win":
+            return
+        pid=self.s.process.spawn(["/bin/sh", "-c", "while read l; do echo $l; done"], 0,
+                                 {"pipe": True, "stdin_pipe": True})
+        r=self.s.process.write(pid, "hello\n")
+        self.assertEqual(r["written"], 6)
+        r=self.s.process.read(pid, "stdout", 0, 3000)
+        self.assertEqual(r["data"], "hello\n")
+        self.s.process.write(pid, Binary("again\n"))
+        self.assertEqual(self.s.process.read(pid, "stdout", 6, 3000)["data"], "again\n")
+        self.assert_(self.s.process.close_stdin(pid))
+        self.assertEqual(self.s.process.wait(pid, 5), 0)
+        self.assertRaises(Fault, self.s.process.write, pid, "late")
+
+    def test_write_backpressure(self):
+        pid=self.s.process.spawn([t("countdown"), "5"], 0,
+                                 {"stdin_pipe": True, "buffer_size": 1000})
+        data="x"*200000
+        r=self.s.process.write(pid, data)
+        self.assert_(1000 < r["written"] < len(data))
+        self.assertEqual((r["buffered"], r["room"]), (1000, 0))
+        self.assertEqual(self.s.process.write(pid, data)["written"], 0)
+        self.s.process.close_stdin(pid)
+        self.s.process.kill(pid, 0)
+        self.assert_(self.s.process.wait(pid, 5) > 0)
+
+    def test_wait_many(self):
+        pids=[self.s.process.spawn([t("countdown")]+a, 0)
+              for a in ([], ["1"], ["2"])]
+        t0=time.time()
+        r=self.s.process.wait_any(pids[1:], 5)
+        self.assert_(0.5 < time.time()-t0 < 1.8)
+        self.assertEqual(r, [{"pid": pids[1], "exitcode": 0}])
+        self.assertEqual(self.s.process.wait_all(pids[2:], 0), [])
+        r=self.s.process.wait_all([pids[0], pids[2]], 5)
+        self.assertEqual(sorted([(e["pid"], e["exitcode"]) for e in r]),
+                         sorted([(pids[0], 1), (pids[2], 0)]))
+        self.assertRaises(Fault, self.s.process.wait_any, pids, 1)
+
+    def test_wait_many_invalid(self):
+        # an unknown pid fails the call without collecting the others
+        pid=self.s.process.spawn([t("countdown")], 0)
+        time.sleep(0.5)
+        self.assertRaises(Fault, self.s.process.wait_all, [pid, 999999], 1)
+        self.assertRaises(Fault, self.s.process.wait_any, [999999, pid], 1)
+        self.assertEqual(self.s.process.wait(pid, 1), 1)
+
+    def test_wait_many_duplicates(self):
+        pid=self.s.process.spawn([t("countdown")], 0)
+        time.sleep(0.5)
+        self.assertEqual(self.s.process.wait_any([pid, pid], 1),
+                         [{"pid": pid, "exitcode": 1}])
+        pids=[self.s.process.spawn([t("countdown"), "1"], 0) for i in range(2)]
+        r=self.s.process.wait_all(pids+pids, 5)
+        self.assertEqual(sorted([e["pid"] for e in r]), sorted(pids))
+
+    def test_status(self):
+        pid=self.s.process.spawn([t("countdown"), "1"], 0)
+        r=self.s.process.status(pid)
+        self.assert_(r["running"])
+        self.assertFalse("exitcode" in r)
+        self.assertEqual(self.s.process.wait(pid, 5), 0)
+        r=self.s.process.status(pid)
+        self.assertFalse(r["running"])
+        self.assertEqual(r["exitcode"], 0)
+        self.assert_(0.5 < r["wall"] < 3)
+        self.assertAlmostEqual(r["end"]-r["start"], r["wall"], 3)
+        self.assert_(r["rusage"]["maxrss"] > 0)
+        r=self.s.process.spawn([t("countdown")], 5, {"rusage": True})
+        self.assertEqual(r["exitcode"], 1)
+        self.assert_("utime" in r["rusage"])
+        r=self.s.process.run([t("show_args")], 5, {"rusage": True})
+        self.assertEqual(r["status"]["exitcode"], 0)
+        self.assertRaises(Fault, self.s.process.status, 999999)
+
+    def test_sample(self):
+        v=self.s.system.uname()
+        if v["sysname"][:3] == "Win":
+            return
+        pid=self.s.process.spawn(["/bin/sh", "-c", "while :; do :; done"], 0)
+        try:
+            self.assert_(pid in [p["pid"] for p in self.s.process.list()])
+            time.sleep(2.5)
+            r=self.s.process.sample(pid)
+            self.assert_(r["running"])
+            self.assertEqual(r["interval"], 1.0)
+            self.assert_(len(r["samples"]) >= 2)
+            last=r["samples"][-1]
+            self.assert_(last["cpu"] > 30)
+            self.assertEqual(last["threads"], 1)
+            self.assert_(last["rss"] > 0)
+            self.assert_(last["read_bytes"] >= 0)
+            entry=[p for p in self.s.process.list() if p["pid"]==pid][0]
+            self.assertEqual(entry["args"][0], "/bin/sh")
+            self.assertEqual(entry["sample"]["time"], last["time"])
+        finally:
+            self.s.process.kill(pid)
+        self.s.process.wait(pid, 5)
+        self.assertFalse(pid in [p["pid"] for p in self.s.process.list()])
+        self.assert_(pid in [p["pid"] for p in self.s.process.list(True)])
+        self.assertRaises(Fault, self.s.process.sample, 999999)
+
+    def test_submit(self):
+        limit=self.s.process.queue_stats()["limit"]
+        blockers=[self.s.process.submit([t("countdown"), "1"])
+                  for i in xrange(limit)]
+        low=self.s.process.submit([t("show_args")], {}, 0)
+        high=self.s.process.submit([t("show_args")], {}, 5)
+        dropped=self.s.process.submit([t("show_args")], {}, -5)
+        r=self.s.process.queue_stats()
+        self.assertEqual((r["running"], r["queued"]), (limit, 3))
+        self.assertEqual(self.s.process.job_wait(low, 0)["state"], "queued")
+        self.assert_(self.s.process.job_cancel(dropped))
+        r=self.s.process.job_wait(low, 5)
+        self.assertEqual((r["state"], r["exitcode"]), ("done", 0))
+        self.assert_(0.5 < r["wait"] < 3)
+        h=self.s.process.job_wait(high, 5)
+        self.assert_(h["submitted"]+h["wait"] <= r["submitted"]+r["wait"])
+        self.assertEqual(self.s.process.job_wait(dropped, 0)["state"], "cancelled")
+        self.assertFalse(self.s.process.job_cancel(low))
+        for b in blockers:
+            self.assertEqual(self.s.process.job_wait(b, 5)["state"], "done")
+        r=self.s.process.submit(["/nonexistent/program"])
+        self.assertEqual(self.s.process.job_wait(r, 5)["state"], "failed")
+        r=self.s.process.queue_stats()
+        self.assertEqual((r["running"], r["queued"]), (0, 0))
+        self.assertEqual(len(r["wait_time"]["counts"]),
+                         len(r["wait_time"]["bounds"])+1)
+        self.assert_(r["run_time"]["count"] >= limit+2)
+
+    def test_limits(self):
+        v=self.s.system.uname()
+        if v["sysname"][:3] == "Win":
+            return
+        r=self.s.process.run(["/bin/sh", "-c", "ulimit -n; ulimit -v"], 5,
+                             {"limits": {"nofile": 64, "as": 512*1024*1024.0}})
+        self.assertEqual(r["stdout"].split(), ["64", str(512*1024)])
+        r=self.s.process.run(["/bin/sh", "-c", "while :; do :; done"], 10,
+                             {"limits": {"cpu": 1}})
+        self.assertEqual(r["limit"], "cpu")
+        wf=self.s.dir.tmpname()
+        r=self.s.process.spawn(["/bin/sh", "-c", "exec yes"], 5,
+                               {"stdout": wf, "limits": {"fsize": 1000}, "rusage": True})
+        self.assertEqual(r["limit"], "fsize")
+        self.assertEqual(len(self.s.file.get(wf)), 1000)
+        self.s.file.remove(wf)
+
     def test_kill(self):
         pid=self.s.process.spawn([t("countdown"),"5"], 0)
         time.sleep(2)
@@ -211,6 +638,67 @@ class process_tests(unittest.TestCase):
         time.sleep(1)
         self.assert_(self.s.process.wait(pid,0) > 0)
 
+    def test_kill_group(self):
+        v=self.s.system.uname()
+        if v["sysname"][:3] == "Win":
+            return
+        pid=self.s.process.spawn(["/bin/sh", "-c", "sleep 30 & echo $!; wait"],
+                                 0, {"pipe": True})
+        r=self.s.process.read(pid, "stdout", 0, 3000)
+        grandchild=int(r["data"])
+        t0=time.time()
+        self.s.process.kill(pid)
+        self.assertEqual(self.s.process.wait(pid, 5), 0x100+15)
+        self.assert_(time.time()-t0 < 0.5)
+        r=self.s.process.run(["/bin/sh", "-c",
+                              "sleep 0.2; cut -d' ' -f3 /proc/%d/stat 2>/dev/null" % grandchild], 5)
+        self.assert_(r["stdout"].strip() in ("", "Z"))
+
+    def test_kill_escalation(self):
+        v=self.s.system.uname()
+        if v["sysname"][:3] == "Win":
+            return
+        pid=self.s.process.spawn(["/bin/sh", "-c",
+                                  "trap '' TERM; while :; do sleep 0.1; done"], 0)
+        time.sleep(0.2)
+        self.s.process.kill(pid, 500)
+        self.assertEqual(self.s.process.wait(pid, 0.3), -1)
+        self.assertEqual(self.s.process.wait(pid, 2), 0x100+9)
+
+    def test_kill_early(self):
+        # the group is killed as soon as the child exits, not after the grace
+        v=self.s.system.uname()
+        if v["sysname"][:3] == "Win":
+            return
+        pid=self.s.process.spawn(["/bin/sh", "-c",
+                                  "(trap '' TERM; while :; do sleep 0.1; done) & echo $!; wait"],
+                                 0, {"pipe": True})
+        r=self.s.process.read(pid, "stdout", 0, 3000)
+        grandchild=int(r["data"])
+        self.s.process.kill(pid, 10000)
+        self.assertEqual(self.s.process.wait(pid, 5), 0x100+15)
+        time.sleep(0.3)
+        r=self.s.process.run(["/bin/sh", "-c",
+                              "cut -d' ' -f3 /proc/%d/stat 2>/dev/null" % grandchild], 5)
+        self.assert_(r["stdout"].strip() in ("", "Z"))
+
+    def test_kill_others(self):
+        # only the server's own running children can be killed
+        import subprocess
+        other=subprocess.Popen(["sleep", "30"])
+        try:
+            for pid in (0, 1, -1, other.pid, -other.pid):
+                self.assertRaises(Fault, self.s.process.kill, pid, 0)
+            pid=self.s.process.spawn(["sleep", "0"], 0)
+            self.assertEqual(self.s.process.wait(pid, 5), 0)
+            self.assertRaises(Fault, self.s.process.kill, pid, 0)
+            time.sleep(0.2)
+            self.assertEqual(other.poll(), None)
+            self.s.system.version()    # the server has not signalled itself
+        finally:
+            other.kill()
+            other.wait()
+
     def test_transfer(self):
         curdir=self.s.dir.chdir()
         v=self.s.system.uname()
@@ -221,6 +709,161 @@ class process_tests(unittest.TestCase):
         fn_there = self.transfer_executable("countdown"+exe)
         self.assertEquals(self.s.process.spawn([fn_there, "2"],5), 0)
         
+class concurrency_tests(unittest.TestCase):
+    def setUp(self):
+        self.s=ServerProxy(SERVER_URL)
+
+    def test_blocking_call_does_not_stall(self):
+        import threading
+        slow=threading.Thread(target=lambda:
+            ServerProxy(SERVER_URL).process.spawn([t("countdown"), "2"], 5))
+        slow.start()
+        time.sleep(0.5)
+        t0=time.time()
+        self.s.system.version()
+        self.assert_(time.time()-t0 < 1.0)
+        slow.join()
+
+    def test_many_synchronous_spawns(self):
+        import threading
+        results=[]
+        def spawn():
+            results.append(ServerProxy(SERVER_URL).process.spawn([t("countdown"), "1"], 5))
+        threads=[threading.Thread(target=spawn) for i in range(20)]
+        t0=time.time()
+        for th in threads: th.start()
+        time.sleep(0.3)
+        self.assertEqual(type(self.s.system.version()), type(""))
+        for th in threads: th.join()
+        self.assertEqual(results, 20*[0])
+        self.assert_(time.time()-t0 < 3.0)
+
+    def test_client_hangup(self, version="1.1"):
+        import socket, urlparse
+        v=self.s.system.uname()
+        if v["sysname"][:3] == "Win":
+            return
+        wf=self.s.dir.tmpname()
+        before=self.s.system.stats()
+        body=dumps(([ "/bin/sh", "-c", "echo $$; exec %s 30" % t("countdown")],
+                    60, {"stdout": wf}), "process.spawn")
+        host, port=urlparse.urlparse(SERVER_URL)[1].split(":")
+        c=socket.create_connection((host, int(port)))
+        c.sendall("POST /RPC2 HTTP/%s\r\nContent-Type: text/xml\r\n"
+                  "Content-length: %d\r\n\r\n%s" % (version, len(body), body))
+        time.sleep(0.5)
+        pid=int(self.s.file.get(wf).split()[0])
+        c.close()
+        time.sleep(0.5)
+        after=self.s.system.stats()
+        self.assertEqual(after["cancelled"], before["cancelled"]+1)
+        self.assert_(after["requests"] >= before["requests"]+3)
+        r=self.s.process.run(["/bin/sh", "-c", "kill -0 %d 2>/dev/null" % pid], 5)
+        self.assertNotEqual(r["exitcode"], 0)
+        self.s.file.remove(wf)
+
+    def test_client_hangup_http10(self):
+        self.test_client_hangup("1.0")
+
+    def test_client_half_close(self):
+        # a client which shuts down its side after the request still gets the answer
+        import socket, urlparse, httplib
+        v=self.s.system.uname()
+        if v["sysname"][:3] == "Win":
+            return
+        before=self.s.system.stats()
+        body=dumps((["/bin/sh", "-c", "sleep 0.5; echo done"], 5), "process.run")
+        host, port=urlparse.urlparse(SERVER_URL)[1].split(":")
+        c=socket.create_connection((host, int(port)))
+        c.sendall("POST /RPC2 HTTP/1.1\r\nContent-Type: text/xml\r\n"
+                  "Content-length: %d\r\n\r\n%s" % (len(body), body))
+        c.shutdown(socket.SHUT_WR)
+        r=httplib.HTTPResponse(c)
+        r.begin()
+        self.assertEqual(r.status, 200)
+        self.assertEqual(loads(r.read())[0][0]["stdout"], "done\n")
+        c.close()
+        self.assertEqual(self.s.system.stats()["cancelled"], before["cancelled"])
+
+    def test_many_connections(self):
+        # with several reactors the connections are spread over them, and
+        # the process.spawn calls are handed to the main event loop
+        import threading
+        errors=[]
+        def client():
+            try:
+                s=ServerProxy(SERVER_URL)
+                for i in range(10):
+                    s.system.version()
+                    if s.process.spawn([t("countdown"), "0"], 5)!=0:
+                        errors.append("exit code")
+            except Exception, e:
+                errors.append(e)
+        threads=[threading.Thread(target=client) for i in range(16)]
+        for th in threads: th.start()
+        for th in threads: th.join()
+        self.assertEqual(errors, [])
+        self.assert_(self.s.system.stats()["reactors"] >= 1)
+
+    def test_parallel_multicall(self):
+        d=self.s.dir.tmpname()
+        self.s.dir.mkdir(d)
+        calls=[{"methodName": "dir.chdir", "params": [d]}]
+        calls+=[{"methodName": "process.spawn",
+                 "params": [[t("countdown"), "1"], 5]} for i in range(4)]
+        calls+=[{"methodName": "file.put", "params": ["here", "data"]},
+                {"methodName": "no.such.method", "params": []},
+                {"methodName": "dir.chdir", "params": []}]
+        r=self.s.system.multicall_parallel(calls, {"timings": True})
+        self.assertEqual(r["results"][0], [d])
+        self.assertEqual(r["results"][1:5], 4*[[0]])
+        self.assertEqual(r["results"][6]["faultCode"], -1)
+        self.assertEqual(self.s.file.get(d+"/here"), "data")
+        diag=r["diagnostics"]
+        self.assertEqual(diag["batches"], 3)
+        self.assertEqual(len(diag["timings"]), len(calls))
+        self.assert_(min(diag["timings"][1:5]) >= 0.9)
+        if self.s.system.stats()["workers"] >= 4:
+            self.assert_(diag["elapsed"] < 3.0)
+        self.assertEqual(self.s.system.multicall_parallel(calls[1:3]), 2*[[0]])
+        self.s.dir.rmdir(d, True)
+
+    def test_pipelining(self):
+        import socket, urlparse
+        def request(method, params):
+            body=dumps(params, method)
+            return ("POST /RPC2 HTTP/1.1\r\nContent-Type: text/xml\r\n"
+                    "Content-length: %d\r\n\r\n%s" % (len(body), body))
+        def read_response(f):
+            length=None
+            while True:
+                line=f.readline()
+                self.assert_(line, "connection closed")
+                if line.lower().startswith("content-length:"):
+                    length=int(line.split(":")[1])
+                if line in ("\r\n", "\n"):
+                    break
+            return loads(f.read(length))[0][0]
+        host, port=urlparse.urlparse(SERVER_URL)[1].split(":")
+        c=socket.create_connection((host, int(port)))
+        c.settimeout(10)
+        f=c.makefile("rb")
+        # the answers come in order, whatever runs on which thread
+        reqs=[request("process.spawn", ([t("countdown"), "1"], 5)),
+              request("system.version", ()),
+              request("process.spawn", ([t("countdown"), "0"], 5))]
+        last=request("dir.chdir", ("",))
+        c.sendall("".join(reqs)+last[:20])
+        time.sleep(0.2)
+        c.sendall(last[20:60])
+        time.sleep(0.2)
+        c.sendall(last[60:])
+        self.assertEqual(read_response(f), 0)
+        self.assertEqual(read_response(f), self.s.system.version())
+        self.assertEqual(read_response(f), 0)
+        self.assert_(read_response(f))
+        c.close()
+
 class system_tests(unittest.TestCase):
     def setUp(self):
         self.s=ServerProxy(SERVER_URL)
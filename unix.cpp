@@ -11,8 +11,20 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
 #include <errno.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sched.h>
+
+#include <vector>
+#include <string>
+
+extern char** environ;
 
 static const char* tmpdir() {
     const char* r=getenv("TMP");
@@ -32,6 +44,17 @@ const struct configuration *cfg(void) {
     _cfg=new struct configuration;
     _cfg->start_dir=tmpdir();
     _cfg->listen_port=DEFAULT_PORT;
+    _cfg->worker_threads=DEFAULT_WORKER_THREADS;
+    _cfg->spawn_fork=0;
+    _cfg->max_jobs=ncpus();
+    _cfg->zygotes=DEFAULT_ZYGOTES;
+    _cfg->kill_grace_ms=DEFAULT_KILL_GRACE_MS;
+    _cfg->cache_dir=NULL;
+    _cfg->cache_size_mb=DEFAULT_CACHE_SIZE_MB;
+    _cfg->cgroup_dir=NULL;
+    _cfg->sample_interval_ms=DEFAULT_SAMPLE_INTERVAL_MS;
+    _cfg->reactors=1;
+    _cfg->pin_reactors=0;
     /* read file /etc/ExecServer.conf */
     FILE* cfgfile=fopen("/etc/ExecServer.conf","r");
     if(cfgfile) {
@@ -46,10 +69,41 @@ const struct configuration *cfg(void) {
 		    int port=atoi(value);
 		    if(port) _cfg->listen_port=port;
 		}
+		if(strcmp(name,"worker_threads")==0)
+		    _cfg->worker_threads=atoi(value);
+		if(strcmp(name,"spawn_method")==0)
+		    _cfg->spawn_fork=(strcmp(value,"fork")==0);
+		if(strcmp(name,"max_jobs")==0) {
+		    int jobs=atoi(value);
+		    if(jobs>0) _cfg->max_jobs=jobs;
+		}
+		if(strcmp(name,"zygotes")==0)
+		    _cfg->zygotes=atoi(value);
+		if(strcmp(name,"kill_grace_ms")==0)
+		    _cfg->kill_grace_ms=atoi(value);
+		if(strcmp(name,"cache_dir")==0)
+		    _cfg->cache_dir=strdup(value);
+		if(strcmp(name,"cache_size_mb")==0)
+		    _cfg->cache_size_mb=atoi(value);
+		if(strcmp(name,"cgroup_dir")==0)
+		    _cfg->cgroup_dir=strdup(value);
+		if(strcmp(name,"sample_interval_ms")==0)
+		    _cfg->sample_interval_ms=atoi(value);
+		if(strcmp(name,"reactors")==0) {
+		    int n=atoi(value);
+		    if(n>0) _cfg->reactors=n;
+		}
+		if(strcmp(name,"pin_reactors")==0)
+		    _cfg->pin_reactors=atoi(value);
 	    }
 	}
 	fclose(cfgfile);
     }
+    if(!_cfg->cache_dir) {
+	char dir[PATH_MAX];
+	snprintf(dir, sizeof(dir), "%s/ExecServer.cache", tmpdir());
+	_cfg->cache_dir=strdup(dir);
+    }
     return _cfg;
 }
 
@@ -66,64 +120,312 @@ int get_os_error(const char** pdesc) {
     return e;
 }
 
-static int rmfile(char const* fname) {
-    struct stat st;
-    if(stat(fname, &st)<0) return -1;
-    if(S_ISDIR(st.st_mode)) {
-	return rmdir_recursive(fname);
-    } else {
-	return unlink(fname);
+int rmdir_recursive(char const* dirname) {
+    return prmdir(PDIR_CWD, dirname, 1);
+}
+
+static int at(int dirfd) {
+    return dirfd==PDIR_CWD? AT_FDCWD: dirfd;
+}
+
+int pdiropen(const char* path) {
+    return open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+}
+
+int pdirclose(int dirfd) {
+    return close(dirfd);
+}
+
+FILE* pfopen(int dirfd, const char* fname, const char* mode) {
+    int flags;
+    switch(mode[0]) {
+    case 'r': flags=O_RDONLY; break;
+    case 'w': flags=O_WRONLY|O_CREAT|O_TRUNC; break;
+    case 'a': flags=O_WRONLY|O_CREAT|O_APPEND; break;
+    default:
+        errno=EINVAL;
+        return NULL;
     }
+    if(strchr(mode, '+'))
+        flags=(flags&~(O_RDONLY|O_WRONLY))|O_RDWR;
+    int fd=openat(at(dirfd), fname, flags|O_CLOEXEC, 0666);
+    if(fd<0)
+        return NULL;
+    FILE* f=fdopen(fd, mode);
+    if(!f)
+        close(fd);
+    return f;
 }
 
-int rmdir_recursive(char const* dirname) {
-    DIR* d=opendir(dirname);
-    if(!d) return -1;
+int paccess(int dirfd, const char* path, int mode) {
+    return faccessat(at(dirfd), path, mode, 0);
+}
+
+int pmkdir(int dirfd, const char* path) {
+    return mkdirat(at(dirfd), path, 0777);
+}
+
+/* removes the directory <name> and its contents; symbolic links
+   are removed, not followed */
+static int rmtree(int dirfd, const char* name) {
+    int fd=openat(dirfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    if(fd<0) return -1;
+    DIR* d=fdopendir(fd);
+    if(!d) {
+        close(fd);
+        return -1;
+    }
     while(1) {
-	struct dirent* dent=readdir(d);
-	if(!dent) {
-	    if(errno==0) break; // it was the last one
-	    closedir(d);
-	    return -1;
-	}
-	if(strcmp(dent->d_name,".")==0 || strcmp(dent->d_name,"..")==0) 
-	    continue;
-	char fname[PATH_MAX];
-	snprintf(fname,sizeof(fname),"%s/%s",dirname, dent->d_name);
-	if(rmfile(fname)<0) {
-	    closedir(d);
-	    return -1;
-	}
+        errno=0;
+        struct dirent* dent=readdir(d);
+        if(!dent) {
+            if(errno==0) break; // it was the last one
+            closedir(d);
+            return -1;
+        }
+        if(strcmp(dent->d_name,".")==0 || strcmp(dent->d_name,"..")==0)
+            continue;
+        struct stat st;
+        if(fstatat(fd, dent->d_name, &st, AT_SYMLINK_NOFOLLOW)<0 ||
+           (S_ISDIR(st.st_mode)? rmtree(fd, dent->d_name): unlinkat(fd, dent->d_name, 0))<0) {
+            closedir(d);
+            return -1;
+        }
     }
     closedir(d);
     clear_error();
-    return rmdir(dirname);
+    return unlinkat(dirfd, name, AT_REMOVEDIR);
+}
+
+int prmdir(int dirfd, const char* path, int recursive) {
+    if(recursive)
+        return rmtree(at(dirfd), path);
+    return unlinkat(at(dirfd), path, AT_REMOVEDIR);
+}
+
+int punlink(int dirfd, const char* path) {
+    return unlinkat(at(dirfd), path, 0);
 }
 
-int pkill(int pid) {
-    if(kill(pid, SIGTERM)<0) {
-        sleep(1);
-        kill(pid, SIGKILL);
+int presolve(int dirfd, const char* path, char* buf, size_t size) {
+    std::string cur=path;
+    for(int i=0; i<40; ++i) {
+        char link[4096];
+        ssize_t n=readlinkat(at(dirfd), cur.c_str(), link, sizeof(link)-1);
+        if(n<0) {
+            if(errno!=EINVAL && errno!=ENOENT)
+                return -1;
+            clear_error();
+            break;  /* not a link */
+        }
+        link[n]=0;
+        size_t slash=cur.rfind('/');
+        if(link[0]=='/' || slash==std::string::npos)
+            cur=link;
+        else
+            cur=cur.substr(0, slash+1)+link;
     }
+    if(cur.size()>=size) {
+        errno=ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(buf, cur.c_str());
     return 0;
 }
 
-int pwait(int pid, unsigned seconds) {
-    int status;
-    for(;;) {
-        if(waitpid(pid, &status, WNOHANG)!=0) {
-            if(WIFEXITED(status))
-                return WEXITSTATUS(status);
-            else if(WIFSIGNALED(status))
-                return 0x100+WTERMSIG(status);
-            else
-                return 0x200;
-        }
-        if(seconds==0)
+int preplace(int dirfd, const char* from, const char* to) {
+    struct stat st;
+    if(fstatat(at(dirfd), to, &st, 0)==0) {
+        if(fchmodat(at(dirfd), from, st.st_mode&07777, 0)<0)
             return -1;
-        sleep(1);
-        --seconds;
+        /* only root may give the file away */
+        if(fchownat(at(dirfd), from, st.st_uid, st.st_gid, 0)<0)
+            clear_error();
+    }
+    return renameat(at(dirfd), from, at(dirfd), to);
+}
+
+int pfsync(FILE* f) {
+    if(fflush(f)!=0)
+        return -1;
+    return fsync(fileno(f));
+}
+
+int plistdir(const char* dir,
+             void (*fn)(void* arg, const char* name, double size, double mtime),
+             void* arg) {
+    DIR* d=opendir(dir);
+    if(!d) return -1;
+    while(1) {
+        errno=0;
+        struct dirent* dent=readdir(d);
+        if(!dent) break;
+        if(strcmp(dent->d_name,".")==0 || strcmp(dent->d_name,"..")==0)
+            continue;
+        struct stat st;
+        if(fstatat(dirfd(d), dent->d_name, &st, AT_SYMLINK_NOFOLLOW)==0)
+            fn(arg, dent->d_name, (double)st.st_size, (double)st.st_mtime);
+    }
+    int e=errno;
+    closedir(d);
+    errno=e;
+    return e? -1: 0;
+}
+
+int raise_fd_limit(void) {
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl)<0)
+        return -1;
+    if(rl.rlim_cur!=rl.rlim_max) {
+        rl.rlim_cur=rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    return rl.rlim_cur==RLIM_INFINITY? -1: (int)rl.rlim_cur;
+}
+
+int pkill(int pid, int force) {
+    if(pid<=1) {
+        errno=ESRCH;
+        return -1;
+    }
+    int sig=force? SIGKILL: SIGTERM;
+    /* children lead their own process group */
+    if(kill(-pid, sig)==0)
+        return 0;
+    return kill(pid, sig);
+}
+
+int ncpus(void) {
+    long n=sysconf(_SC_NPROCESSORS_ONLN);
+    return n>0? (int)n: 1;
+}
+
+/* SIGCHLD is turned into a readable pipe for the event loop */
+static int sigchld_pipe[2]={-1, -1};
+static pthread_once_t sigchld_once=PTHREAD_ONCE_INIT;
+
+static void on_sigchld(int) {
+    int e=errno;
+    char c=0;
+    if(write(sigchld_pipe[1], &c, 1)<0) {
+        /* the pipe is full, so a wakeup is pending anyway */
+    }
+    errno=e;
+}
+
+static void install_sigchld() {
+    if(pipe(sigchld_pipe)<0)
+        return;
+    for(int i=0; i<2; ++i) {
+        fcntl(sigchld_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler=on_sigchld;
+    sa.sa_flags=SA_RESTART|SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+}
+
+static int exit_code(int status) {
+    if(WIFEXITED(status))
+        return WEXITSTATUS(status);
+    else if(WIFSIGNALED(status))
+        return 0x100+WTERMSIG(status);
+    else
+        return 0x200;
+}
+
+int pchild_fd(void) {
+    pthread_once(&sigchld_once, install_sigchld);
+    return sigchld_pipe[0];
+}
+
+int pexited(void) {
+    siginfo_t info;
+    info.si_pid=0;
+    if(waitid(P_ALL, 0, &info, WEXITED|WNOHANG|WNOWAIT)<0)
+        return 0;
+    return info.si_pid;
+}
+
+int preap(int pid, int* code, struct pusage* usage) {
+    int status;
+    struct rusage ru;
+    pid=wait4(pid, &status, WNOHANG, &ru);
+    if(pid<=0)
+        return 0;
+    *code=exit_code(status);
+    usage->utime=ru.ru_utime.tv_sec+ru.ru_utime.tv_usec/1e6;
+    usage->stime=ru.ru_stime.tv_sec+ru.ru_stime.tv_usec/1e6;
+    usage->maxrss=ru.ru_maxrss;
+    usage->majflt=ru.ru_majflt;
+    usage->nvcsw=ru.ru_nvcsw;
+    usage->nivcsw=ru.ru_nivcsw;
+    return pid;
+}
+
+double wall_clock(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+/* reads /proc/<pid>/<name> into <buf>, NUL-terminated */
+static int read_proc(int pid, const char* name, char* buf, size_t size) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
+    int fd=open(path, O_RDONLY|O_CLOEXEC);
+    if(fd<0)
+        return -1;
+    ssize_t n=read(fd, buf, size-1);
+    close(fd);
+    if(n<0)
+        return -1;
+    buf[n]='\0';
+    return 0;
+}
+
+/* the value of the "<key> <value>" line of a /proc file, or -1 */
+static double proc_field(const char* text, const char* key) {
+    size_t len=strlen(key);
+    for(const char* p=text; p; p=strchr(p, '\n')) {
+        if(*p=='\n')
+            ++p;
+        if(strncmp(p, key, len)==0)
+            return strtod(p+len, NULL);
+    }
+    return -1;
+}
+
+int psample(int pid, struct psample* s) {
+    char buf[4096];
+    static long ticks=sysconf(_SC_CLK_TCK);
+    /* the fields after the command name, which may hold anything */
+    if(read_proc(pid, "stat", buf, sizeof(buf))<0)
+        return -1;
+    const char* p=strrchr(buf, ')');
+    unsigned long utime, stime;
+    if(!p || sscanf(p+2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                    &utime, &stime)!=2) {
+        errno=EINVAL;
+        return -1;
     }
+    s->cpu=(double)(utime+stime)/(ticks>0? ticks: 100);
+    if(read_proc(pid, "status", buf, sizeof(buf))<0)
+        return -1;
+    s->rss=(long)proc_field(buf, "VmRSS:");
+    s->threads=(int)proc_field(buf, "Threads:");
+    /* not readable for processes of other users */
+    if(read_proc(pid, "io", buf, sizeof(buf))==0) {
+        s->read_bytes=proc_field(buf, "read_bytes:");
+        s->write_bytes=proc_field(buf, "write_bytes:");
+    } else {
+        s->read_bytes=s->write_bytes=-1;
+    }
+    return 0;
 }
 
 #define READ  O_RDONLY
@@ -132,7 +434,7 @@ int pwait(int pid, unsigned seconds) {
 static int openfd(const char* fn, int mode) {
     if(!fn)
         fn="/dev/null";
-    int fd=open(fn, mode, 0666);
+    int fd=open(fn, mode|O_CLOEXEC, 0666);
     return fd;
 }
 
@@ -149,45 +451,596 @@ static int test_chdir(const char* cwd) {
     return 0;
 }
 
+/* posix_spawn needs the chdir and closefrom file actions (glibc 2.34) */
+#if defined(__GLIBC__) && (__GLIBC__>2 || (__GLIBC__==2 && __GLIBC_MINOR__>=34))
+  #define HAVE_SPAWN_ACTIONS_NP 1
+#endif
+
+/* our environment with the KEY=VALUE overrides applied, as putenv would;
+   an override without '=' removes the variable */
+static void build_env(const char* const* envp, std::vector<const char*>& env) {
+    for(char** e=environ; *e; ++e)
+        env.push_back(*e);
+    for(; envp && *envp; ++envp) {
+        const char* eq=strchr(*envp, '=');
+        size_t klen=eq? eq-*envp: strlen(*envp);
+        size_t i;
+        for(i=0; i<env.size(); ++i)
+            if(strncmp(env[i], *envp, klen)==0 && env[i][klen]=='=')
+                break;
+        if(i<env.size()) {
+            if(eq)
+                env[i]=*envp;
+            else
+                env.erase(env.begin()+i);
+        } else if(eq) {
+            env.push_back(*envp);
+        }
+    }
+    env.push_back(NULL);
+}
+
+/* execvp and posix_spawnp search our own PATH; when the child gets
+   a different one, look the program up in that instead.
+   returns the file to execute, or NULL to let the exec function search */
+static const char* find_program(const char* name, const char* const* env,
+                                char* buf, size_t bufsize) {
+    if(strchr(name, '/'))
+        return NULL;
+    const char* path=NULL;
+    for(; *env; ++env)
+        if(strncmp(*env, "PATH=", 5)==0)
+            path=*env+5;
+    const char* ourpath=getenv("PATH");
+    if(!path || (ourpath && strcmp(path, ourpath)==0))
+        return NULL;
+    while(*path) {
+        const char* end=strchr(path, ':');
+        size_t len=end? end-path: strlen(path);
+        if(len==0)
+            snprintf(buf, bufsize, "%s", name);
+        else
+            snprintf(buf, bufsize, "%.*s/%s", (int)len, path, name);
+        if(access(buf, X_OK)==0)
+            return buf;
+        path+=len;
+        if(*path==':')
+            ++path;
+    }
+    return name; /* not found: exec reports ENOENT */
+}
+
+static void close_from(int lowfd) {
+#if defined(SYS_close_range)
+    if(syscall(SYS_close_range, lowfd, ~0U, 0)==0)
+        return;
+#endif
+    int maxfd=(int)sysconf(_SC_OPEN_MAX);
+    if(maxfd<0 || maxfd>65536)
+        maxfd=65536;
+    for(int i=lowfd; i<maxfd; ++i)
+        close(i);
+}
+
+#if defined(__linux__) && defined(CLONE_PARENT)
+  #define HAVE_CLONE_PARENT 1
+#endif
+
+static int set_limit(int resource, double value, double slack) {
+    if(value<0)
+        return 0;
+    struct rlimit rl;
+    rl.rlim_cur=(rlim_t)value;
+    rl.rlim_max=(rlim_t)(value+slack);
+    return setrlimit(resource, &rl);
+}
+
+/* called in the child: joins the cgroup and sets the limits */
+static int apply_limits(const struct plimits* l) {
+    if(l->cgroup) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/cgroup.procs", l->cgroup);
+        int fd=open(path, O_WRONLY|O_CLOEXEC);
+        if(fd<0)
+            return -1;
+        int nw=write(fd, "0", 1);
+        close(fd);
+        if(nw<0)
+            return -1;
+    }
+    /* the hard limit of CPU time is a second later, so that the child
+       gets SIGXCPU rather than SIGKILL */
+    if(set_limit(RLIMIT_AS, l->as, 0)<0 ||
+       set_limit(RLIMIT_CPU, l->cpu, 1)<0 ||
+       set_limit(RLIMIT_NOFILE, l->nofile, 0)<0 ||
+       set_limit(RLIMIT_NPROC, l->nproc, 0)<0 ||
+       set_limit(RLIMIT_FSIZE, l->fsize, 0)<0)
+        return -1;
+    return 0;
+}
+
+/* the legacy path: fork the whole server and exec in the child;
+   an exec failure is passed back through a close-on-exec pipe.
+   A zygote passes <sibling> to make the child one of its parent's */
+static int pspawn_fork(const char* const* argv, char* const* env, const char* file,
+                       const char* cwd, int fdstdin, int fdstdout, int fdstderr,
+                       const struct plimits* limits, bool sibling=false) {
+    int errpipe[2];
+    if(pipe(errpipe)<0)
+        return -1;
+    fcntl(errpipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(errpipe[1], F_SETFD, FD_CLOEXEC);
+#if defined(HAVE_CLONE_PARENT)
+    int child=sibling? (int)syscall(SYS_clone, CLONE_PARENT|SIGCHLD, 0, 0, 0, 0): fork();
+#else
+    int child=fork();
+#endif
+    if(child==0) {
+        /* Now we are in the child process */
+        dup2(fdstdin, 0);
+        dup2(fdstdout,1);
+        dup2(fdstderr,2);
+        if(errpipe[1]!=3) {
+            dup2(errpipe[1], 3);
+            fcntl(3, F_SETFD, FD_CLOEXEC);
+        }
+        close_from(4);
+        setpgid(0, 0);
+        signal(SIGPIPE, SIG_DFL);
+        int err=0;
+        if(limits && apply_limits(limits)<0)
+            err=errno;
+        if(!err && cwd && chdir(cwd)<0)
+            err=errno;
+        if(!err) {
+            environ=const_cast<char**>(env);
+            if(file)
+                execv(file, (char* const*)argv);
+            else
+                execvp(argv[0], (char* const*)argv);
+            err=errno;
+        }
+        if(write(3, &err, sizeof(err))<0) {
+            /* nothing to do */
+        }
+        _exit(254);
+    }
+    close(errpipe[1]);
+    if(child>0) {
+        int err=0;
+        ssize_t n;
+        while((n=read(errpipe[0], &err, sizeof(err)))<0 && errno==EINTR)
+            ;
+        if(n==sizeof(err)) {
+            if(!sibling)
+                waitpid(child, NULL, 0);
+            errno=err;
+            child=-1;
+        }
+    }
+    close(errpipe[0]);
+    return child;
+}
+
+#if defined(HAVE_SPAWN_ACTIONS_NP)
+/* posix_spawn uses vfork semantics, so the server's memory is not
+   copied, and reports an exec failure back as an error */
+static int pspawn_posix(const char* const* argv, char* const* env, const char* file,
+                        const char* cwd, int fdstdin, int fdstdout, int fdstderr) {
+    posix_spawn_file_actions_t fa;
+    int err=posix_spawn_file_actions_init(&fa);
+    if(err) {
+        errno=err;
+        return -1;
+    }
+    posix_spawn_file_actions_adddup2(&fa, fdstdin, 0);
+    posix_spawn_file_actions_adddup2(&fa, fdstdout, 1);
+    posix_spawn_file_actions_adddup2(&fa, fdstderr, 2);
+    posix_spawn_file_actions_addclosefrom_np(&fa, 3);
+    if(cwd)
+        posix_spawn_file_actions_addchdir_np(&fa, cwd);
+    /* the server ignores SIGPIPE, the child should not */
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t sigdef;
+    sigemptyset(&sigdef);
+    sigaddset(&sigdef, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &sigdef);
+    posix_spawnattr_setpgroup(&attr, 0); /* a process group of its own */
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF|POSIX_SPAWN_SETPGROUP);
+    pid_t child=-1;
+    if(file)
+        err=posix_spawn(&child, file, &fa, &attr, (char* const*)argv, env);
+    else
+        err=posix_spawnp(&child, argv[0], &fa, &attr, (char* const*)argv, env);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fa);
+    if(err) {
+        errno=err;
+        return -1;
+    }
+    return child;
+}
+#endif
+
+int pstdfd(const char* fname, int output) {
+    return openfd(fname, output? WRITE: READ);
+}
+
+int ppipe(int fds[2]) {
+    return pipe2(fds, O_CLOEXEC);
+}
+
+int pspawn_fd(const char* const* argv, const char* const* envp, const char* cwd,
+              int fdstdin, int fdstdout, int fdstderr,
+              const struct plimits* limits) {
+    if(cwd && test_chdir(cwd)<0)
+        return -1;
+    std::vector<const char*> env;
+    build_env(envp, env);
+    char filebuf[PATH_MAX];
+    const char* file=find_program(argv[0], &env[0], filebuf, sizeof(filebuf));
+#if defined(HAVE_SPAWN_ACTIONS_NP)
+    /* posix_spawn cannot set limits in the child */
+    if(!cfg()->spawn_fork && !limits)
+        return pspawn_posix(argv, (char* const*)&env[0], file, cwd,
+                            fdstdin, fdstdout, fdstderr);
+#endif
+    return pspawn_fork(argv, (char* const*)&env[0], file, cwd,
+                       fdstdin, fdstdout, fdstderr, limits);
+}
+
 int pspawn(const char* const* argv, const char* const* envp, const char* cwd,
            const char* fstdin, const char* fstdout, const char* fstderr) {
-    int fdstdin=-1, fdstdout=-1, fdstderr=-1, child=-1, ret=-1;
+    int fdstdin=-1, fdstdout=-1, fdstderr=-1, ret=-1;
     if((fdstdin=openfd(fstdin, READ))<0)
         goto cleanup;
     if((fdstdout=openfd(fstdout, WRITE))<0)
         goto cleanup;
     if((fdstderr=openfd(fstderr, WRITE))<0)
         goto cleanup;
-    if(cwd && test_chdir(cwd)<0)
-        goto cleanup;
-    if((child=fork())<0)
-        goto cleanup;
-    if(child>0) {
-        ret=child;
-        goto cleanup;
-    }
-    /* Now we are in the child process */
-    dup2(fdstdin, 0);
-    dup2(fdstdout,1);
-    dup2(fdstderr,2);
-    /* close the rest fd's */
-    for(int i=3; i<1024; ++i) close(i);
-    if(cwd)
-        chdir(cwd);
-    if(envp) {
-        while(*envp) {
-            putenv(const_cast<char*>(*envp));
-            ++envp;
-        }
-    }
-    execvp(argv[0], (char* const*)argv);
-    exit(254); // if exec... failed
+    ret=pspawn_fd(argv, envp, cwd, fdstdin, fdstdout, fdstderr, NULL);
 cleanup:
+    int e=errno;
     if(fdstdin>=0)
         close(fdstdin);
     if(fdstdout>=0)
         close(fdstdout);
     if(fdstderr>=0)
         close(fdstderr);
+    errno=e;
     return ret;
 }
+
+/* Zygotes: small helpers which spawn children on request. They clone
+   themselves with CLONE_PARENT, so the children are the server's as if
+   it had spawned them, without copying or locking anything of the server.
+   Spares are forked at startup, while the server is small and has
+   no threads. */
+
+struct zygote_request {
+    int len;      /* bytes of strings which follow */
+    int argc, envc;
+    int limited;  /* limits are given; their cgroup is the last string */
+    struct plimits limits;
+};
+
+struct zygote_reply {
+    int pid;
+    int err;
+};
+
+static int write_all(int fd, const void* buf, size_t len) {
+    const char* p=(const char*)buf;
+    while(len>0) {
+        ssize_t n=write(fd, p, len);
+        if(n<0 && errno==EINTR)
+            continue;
+        if(n<=0)
+            return -1;
+        p+=n;
+        len-=n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void* buf, size_t len) {
+    char* p=(char*)buf;
+    while(len>0) {
+        ssize_t n=read(fd, p, len);
+        if(n<0 && errno==EINTR)
+            continue;
+        if(n<=0)
+            return -1;
+        p+=n;
+        len-=n;
+    }
+    return 0;
+}
+
+/* the request header comes with the descriptors of the standard streams */
+static int recv_request(int sock, struct zygote_request* req, int fds[3]) {
+    char cbuf[CMSG_SPACE(3*sizeof(int))];
+    struct iovec iov;
+    iov.iov_base=req;
+    iov.iov_len=sizeof(*req);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov=&iov;
+    msg.msg_iovlen=1;
+    msg.msg_control=cbuf;
+    msg.msg_controllen=sizeof(cbuf);
+    ssize_t n;
+    while((n=recvmsg(sock, &msg, MSG_CMSG_CLOEXEC))<0 && errno==EINTR)
+        ;
+    if(n!=(ssize_t)sizeof(*req))
+        return -1;
+    struct cmsghdr* cm=CMSG_FIRSTHDR(&msg);
+    if(!cm || cm->cmsg_type!=SCM_RIGHTS || cm->cmsg_len!=CMSG_LEN(3*sizeof(int)))
+        return -1;
+    memcpy(fds, CMSG_DATA(cm), 3*sizeof(int));
+    return 0;
+}
+
+static int send_request(int sock, const struct zygote_request* req, const int fds[3]) {
+    char cbuf[CMSG_SPACE(3*sizeof(int))];
+    memset(cbuf, 0, sizeof(cbuf));
+    struct iovec iov;
+    iov.iov_base=(void*)req;
+    iov.iov_len=sizeof(*req);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov=&iov;
+    msg.msg_iovlen=1;
+    msg.msg_control=cbuf;
+    msg.msg_controllen=sizeof(cbuf);
+    struct cmsghdr* cm=CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level=SOL_SOCKET;
+    cm->cmsg_type=SCM_RIGHTS;
+    cm->cmsg_len=CMSG_LEN(3*sizeof(int));
+    memcpy(CMSG_DATA(cm), fds, 3*sizeof(int));
+    ssize_t n;
+    while((n=sendmsg(sock, &msg, MSG_NOSIGNAL))<0 && errno==EINTR)
+        ;
+    return n==(ssize_t)sizeof(*req)? 0: -1;
+}
+
+/* the zygote serves requests until the server closes the socket */
+static void zygote_main(int sock) {
+    signal(SIGCHLD, SIG_DFL);
+    std::vector<char> buf;
+    for(;;) {
+        struct zygote_request req;
+        int fds[3];
+        if(recv_request(sock, &req, fds)<0)
+            _exit(0);
+        buf.resize(req.len+2);
+        if(read_all(sock, &buf[0], req.len)<0)
+            _exit(0);
+        buf[req.len]=buf[req.len+1]='\0';
+        std::vector<const char*> argv, envp;
+        const char* p=&buf[0];
+        for(int i=0; i<req.argc; ++i, p+=strlen(p)+1)
+            argv.push_back(p);
+        argv.push_back(NULL);
+        for(int i=0; i<req.envc; ++i, p+=strlen(p)+1)
+            envp.push_back(p);
+        envp.push_back(NULL);
+        const char* cwd=p;
+        p+=strlen(p)+1;
+        if(req.limited)
+            req.limits.cgroup=*p? p: NULL;
+
+        struct zygote_reply rep;
+        rep.pid=-1;
+        if(test_chdir(cwd)==0) {
+            std::vector<const char*> env;
+            build_env(&envp[0], env);
+            char filebuf[PATH_MAX];
+            const char* file=find_program(argv[0], &env[0], filebuf, sizeof(filebuf));
+            rep.pid=pspawn_fork(&argv[0], (char* const*)&env[0], file, cwd,
+                                fds[0], fds[1], fds[2],
+                                req.limited? &req.limits: NULL, true);
+        }
+        rep.err=rep.pid<0? errno: 0;
+        for(int i=0; i<3; ++i)
+            close(fds[i]);
+        if(write_all(sock, &rep, sizeof(rep))<0)
+            _exit(0);
+    }
+}
+
+#if defined(HAVE_CLONE_PARENT)
+/* the CPUs of the server at startup; a zygote forked later by a reactor
+   pinned to one CPU must not pass the pin on to its children */
+static cpu_set_t startup_cpus;
+static int have_startup_cpus=0;
+#endif
+
+static int fork_zygote(int* pid) {
+#if defined(HAVE_CLONE_PARENT)
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv)<0)
+        return -1;
+    int child=fork();
+    if(child==0) {
+        if(have_startup_cpus)
+            sched_setaffinity(0, sizeof(startup_cpus), &startup_cpus);
+        dup2(sv[1], 3);
+        close_from(4);
+        zygote_main(3);
+    }
+    close(sv[1]);
+    if(child<0) {
+        close(sv[0]);
+        return -1;
+    }
+    *pid=child;
+    return sv[0];
+#else
+    (void)pid;
+    errno=ENOSYS;
+    return -1;
+#endif
+}
+
+static std::vector<std::pair<int, int> > spare_zygotes; /* (fd, pid) */
+
+void pzygote_prefork(int n) {
+#if defined(HAVE_CLONE_PARENT)
+    have_startup_cpus=sched_getaffinity(0, sizeof(startup_cpus), &startup_cpus)==0;
+#endif
+    for(int i=0; i<n; ++i) {
+        int pid;
+        int fd=fork_zygote(&pid);
+        if(fd<0)
+            break;
+        spare_zygotes.push_back(std::make_pair(fd, pid));
+    }
+}
+
+int pzygote(int* pid) {
+    static pthread_mutex_t lock=PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&lock);
+    int fd=-1;
+    if(!spare_zygotes.empty()) {
+        fd=spare_zygotes.back().first;
+        *pid=spare_zygotes.back().second;
+        spare_zygotes.pop_back();
+    }
+    pthread_mutex_unlock(&lock);
+    if(fd<0)
+        fd=fork_zygote(pid);
+    return fd;
+}
+
+int pzygote_spawn(int zfd, const char* const* argv, const char* const* envp, const char* cwd,
+                  int fdstdin, int fdstdout, int fdstderr,
+                  const struct plimits* limits) {
+    char cwdbuf[PATH_MAX];
+    if(!cwd) {
+        /* the zygote's directory is where the server was when it was forked */
+        if(!getcwd(cwdbuf, sizeof(cwdbuf)))
+            return -1;
+        cwd=cwdbuf;
+    }
+    std::string data;
+    struct zygote_request req;
+    req.argc=req.envc=0;
+    for(; argv && argv[req.argc]; ++req.argc)
+        data.append(argv[req.argc], strlen(argv[req.argc])+1);
+    for(; envp && envp[req.envc]; ++req.envc)
+        data.append(envp[req.envc], strlen(envp[req.envc])+1);
+    data.append(cwd, strlen(cwd)+1);
+    memset(&req.limits, 0, sizeof(req.limits));
+    req.limited=limits!=NULL;
+    if(limits) {
+        req.limits=*limits;
+        req.limits.cgroup=NULL;
+        if(limits->cgroup)
+            data.append(limits->cgroup);
+    }
+    req.len=(int)data.size();
+    int fds[3]={ fdstdin, fdstdout, fdstderr };
+    struct zygote_reply rep;
+    if(send_request(zfd, &req, fds)<0 || write_all(zfd, data.data(), data.size())<0
+            || read_all(zfd, &rep, sizeof(rep))<0) {
+        errno=EPIPE;
+        return -1;
+    }
+    if(rep.pid<0)
+        errno=rep.err;
+    return rep.pid;
+}
+
+/* cgroups v2: each child with a memory or CPU cap gets a cgroup of its
+   own below the configured cgroup_dir, which it joins before exec */
+
+static std::string cgroup_base; /* empty if cgroups cannot be used */
+static bool cgroup_memory, cgroup_cpu; /* the controllers enabled */
+
+static int write_text(const std::string& path, const char* text) {
+    int fd=open(path.c_str(), O_WRONLY|O_CLOEXEC);
+    if(fd<0)
+        return -1;
+    int r=write_all(fd, text, strlen(text));
+    int e=errno;
+    close(fd);
+    errno=e;
+    return r;
+}
+
+int pcgroup_init(void) {
+    const char* base=cfg()->cgroup_dir;
+    if(!base || !*base) {
+        errno=ENOSYS;
+        return -1;
+    }
+    std::string control=std::string(base)+"/cgroup.subtree_control";
+    if(write_text(control, "+memory")<0 && errno==EBUSY) {
+        /* a cgroup which passes controllers on cannot hold processes */
+        std::string leaf=std::string(base)+"/server";
+        mkdir(leaf.c_str(), 0755);
+        if(write_text(leaf+"/cgroup.procs", "0")==0)
+            write_text(control, "+memory");
+    }
+    cgroup_memory=write_text(control, "+memory")==0;
+    cgroup_cpu=write_text(control, "+cpu")==0;
+    if(!cgroup_memory && !cgroup_cpu)
+        return -1;
+    cgroup_base=base;
+    return 0;
+}
+
+int pcgroup_create(double memory_max, double cpu_max, char* buf, size_t size) {
+    if(cgroup_base.empty() || (memory_max>0 && !cgroup_memory) || (cpu_max>0 && !cgroup_cpu)) {
+        errno=ENOSYS;
+        return -1;
+    }
+    static unsigned seq=0;
+    snprintf(buf, size, "%s/job.%d.%u", cgroup_base.c_str(), (int)getpid(),
+             __sync_add_and_fetch(&seq, 1));
+    if(mkdir(buf, 0755)<0)
+        return -1;
+    char value[64];
+    int r=0;
+    if(memory_max>0) {
+        snprintf(value, sizeof(value), "%.0f", memory_max);
+        r=write_text(std::string(buf)+"/memory.max", value);
+    }
+    if(r==0 && cpu_max>0) {
+        snprintf(value, sizeof(value), "%.0f 100000", cpu_max*100000);
+        r=write_text(std::string(buf)+"/cpu.max", value);
+    }
+    if(r<0) {
+        int e=errno;
+        rmdir(buf);
+        errno=e;
+    }
+    return r;
+}
+
+int pcgroup_oom(const char* path) {
+    int oom=0;
+    FILE* f=fopen((std::string(path)+"/memory.events").c_str(), "r");
+    if(f) {
+        char name[64];
+        long value;
+        while(fscanf(f, "%63s %ld", name, &value)==2)
+            if(strcmp(name, "oom_kill")==0 && value>0)
+                oom=1;
+        fclose(f);
+    }
+    return oom;
+}
+
+int pcgroup_remove(const char* path) {
+    if(rmdir(path)==0 || errno==ENOENT)
+        return 0;
+    if(errno!=EBUSY)
+        return -1;
+    /* what the child has left behind */
+    write_text(std::string(path)+"/cgroup.kill", "1");
+    errno=EBUSY;
+    return -1;
+}
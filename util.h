@@ -3,6 +3,8 @@
 
 /* Interface to OS-dependant things */
 
+#include <stdio.h>
+
 #if defined(_WINDOWS)
   #include "win_utsname.h"
 #else
@@ -10,10 +12,29 @@
 #endif
 
 #define DEFAULT_PORT 5840
+#define LISTEN_BACKLOG 128
+#define DEFAULT_WORKER_THREADS 4
+#define DEFAULT_ZYGOTES 1
+#define DEFAULT_KILL_GRACE_MS 1000
+#define DEFAULT_CACHE_SIZE_MB 1024
+#define DEFAULT_SAMPLE_INTERVAL_MS 1000
 
 struct configuration {
     const char* start_dir;
     int listen_port;
+    int worker_threads;  /* threads for blocking methods, 0 = run them inline */
+    int spawn_fork;      /* spawn children with the legacy fork() path */
+    int max_jobs;        /* jobs of process.submit run at once */
+    int zygotes;         /* spare zygotes forked at startup */
+    int kill_grace_ms;   /* from SIGTERM to SIGKILL when killing children */
+    const char* cache_dir; /* store of the results memoized by process.run */
+    int cache_size_mb;   /* the store is kept below this size */
+    const char* cgroup_dir; /* a delegated cgroup v2 for the cgroups of
+                               children, or NULL */
+    int sample_interval_ms; /* how often the resources used by running
+                               children are sampled, 0 = never */
+    int reactors;        /* event loops accepting connections on the port */
+    int pin_reactors;    /* pin the additional event loops to CPUs 1, 2, ... */
 };
 
 const struct configuration *cfg(void);
@@ -23,10 +44,151 @@ int get_os_error(const char** pdesc);
 
 int rmdir_recursive(const char* dirname);
 
-int pkill(int pid);
-int pwait(int pid, unsigned seconds);
+/* Directories held open to resolve relative paths against, so clients
+   can have working directories of their own without chdir(). A path
+   which is absolute, or given with PDIR_CWD, is used as it is */
+#define PDIR_CWD (-100)
+
+/* opens the directory <path>; returns its descriptor */
+int pdiropen(const char* path);
+int pdirclose(int dirfd);
+
+FILE* pfopen(int dirfd, const char* fname, const char* mode);
+int paccess(int dirfd, const char* path, int mode);
+int pmkdir(int dirfd, const char* path);
+int prmdir(int dirfd, const char* path, int recursive);
+int punlink(int dirfd, const char* path);
+
+/* follows the symbolic links <path> leads through to the file at the end,
+   which need not exist, and stores its path in <buf>: relative to <dirfd>
+   if relative, like <path> */
+int presolve(int dirfd, const char* path, char* buf, size_t size);
+
+/* renames <from> to <to>, replacing any file <to>, whose permissions
+   and owner the renamed file takes on (where it can) */
+int preplace(int dirfd, const char* from, const char* to);
+
+/* writes what is buffered for <f> through to storage */
+int pfsync(FILE* f);
+
+/* calls <fn> for each entry of the directory <dir> other than . and ..,
+   with its size in bytes and its modification time in seconds since
+   the epoch; returns -1 if the directory cannot be read */
+int plistdir(const char* dir,
+             void (*fn)(void* arg, const char* name, double size, double mtime),
+             void* arg);
+
+/* raise the limit on open files as far as allowed;
+   returns the new limit, or -1 if unlimited or unknown */
+int raise_fd_limit(void);
+
+/* terminates the child <pid> and its process group: with SIGTERM,
+   or SIGKILL if <force> (both terminate the process on Windows).
+   <pid> must be a child which leads its group and has not been reaped,
+   so that neither can have been reused; pids up to 1 are refused */
+int pkill(int pid, int force);
+
+/* number of processors online, at least 1 */
+int ncpus(void);
+
+/* returns a descriptor which becomes readable when a child may have
+   exited (drain it before calling preap), or -1 if children must be
+   polled for */
+int pchild_fd(void);
+
+/* resources used by a child, as far as the OS reports them */
+struct pusage {
+    double utime, stime;  /* CPU seconds in user and kernel mode */
+    long maxrss;          /* peak resident set size, kilobytes */
+    long majflt;          /* page faults which needed IO */
+    long nvcsw, nivcsw;   /* voluntary and involuntary context switches */
+};
+
+/* returns the pid of a child which has exited but is not reaped yet
+   (so the pid cannot be reused meanwhile), or 0 if there is none */
+int pexited(void);
+
+/* reaps the child <pid> if it has exited, without waiting: returns its pid
+   and stores its exit code in *code and its resource usage in *usage,
+   or returns 0 if it has not */
+int preap(int pid, int* code, struct pusage* usage);
+
+/* wall-clock time in seconds since the epoch */
+double wall_clock(void);
+
+/* resources a running process is using */
+struct psample {
+    double cpu;           /* CPU seconds used so far, user and kernel */
+    long rss;             /* resident set size, kilobytes */
+    int threads;
+    double read_bytes, write_bytes; /* storage IO so far, -1 if unknown */
+};
+
+/* samples the process <pid> (from /proc on Linux); returns -1 if it
+   cannot be read, e.g. when the process has gone */
+int psample(int pid, struct psample* s);
 
 int pspawn(const char* const* argv, const char* const* envp, const char* cwd,
            const char* fstdin, const char* fstdout, const char* fstderr);
 
+/* resource limits of a child, set in the child before exec;
+   a negative value leaves the limit as it is */
+struct plimits {
+    double as;          /* bytes of address space */
+    double cpu;         /* CPU seconds, then the child gets SIGXCPU */
+    double nofile;      /* open files */
+    double nproc;       /* processes of the user */
+    double fsize;       /* bytes of a file written, then SIGXFSZ */
+    const char* cgroup; /* a cgroup for the child to join (see
+                           pcgroup_create), or NULL */
+};
+
+/* like pspawn, with open descriptors for the standard streams;
+   the descriptors stay open in the caller. The child is given
+   <limits> unless it is NULL */
+int pspawn_fd(const char* const* argv, const char* const* envp, const char* cwd,
+              int fdstdin, int fdstdout, int fdstderr,
+              const struct plimits* limits);
+
+/* prepares the cgroup_dir of the configuration to hold a cgroup per
+   child, with the memory and cpu controllers; the server moves to a leaf
+   cgroup of its own if it is in the cgroup_dir. Called at startup, before
+   the zygotes are forked. Returns -1 if cgroups cannot be used */
+int pcgroup_init(void);
+
+/* creates a cgroup for a child, with memory.max of <memory_max> bytes and
+   cpu.max of <cpu_max> CPUs (not limited if <=0); stores its path in <buf> */
+int pcgroup_create(double memory_max, double cpu_max, char* buf, size_t size);
+
+/* whether a process of the cgroup <path> has been killed for lack of memory */
+int pcgroup_oom(const char* path);
+
+/* removes the cgroup of a child which has exited, killing any process left
+   in it. Does not wait: returns -1 with errno EBUSY while processes are
+   left, and is to be called again later */
+int pcgroup_remove(const char* path);
+
+/* opens the file <fname> (NULL = the null device) as a standard stream
+   of a child, for reading or writing (truncated); returns the descriptor */
+int pstdfd(const char* fname, int output);
+
+/* creates a pipe whose ends are not inherited by children;
+   fds[0] is the read end, fds[1] the write end */
+int ppipe(int fds[2]);
+
+/* forks <n> spare zygotes: helpers which spawn children on request,
+   as children of the server. Called at startup, before the server grows */
+void pzygote_prefork(int n);
+
+/* returns a connection to a zygote, a spare one if any is left, and
+   stores the zygote's pid in *pid; -1 if zygotes are not supported */
+int pzygote(int* pid);
+
+/* like pspawn_fd, through the zygote connected to <zfd>; a NULL cwd
+   means the current directory of the server. Not thread-safe for one
+   zygote. If the zygote has gone, returns -1 with errno set to EPIPE */
+int pzygote_spawn(int zfd, const char* const* argv, const char* const* envp, const char* cwd,
+                  int fdstdin, int fdstdout, int fdstderr,
+                  const struct plimits* limits);
+
 #endif
@@ -3,6 +3,7 @@
 #include <windows.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <io.h>
@@ -10,6 +11,7 @@
 #include <errno.h>
 
 #include <string>
+#include <vector>
 #include <map>
 #pragma warning (disable:4996)
 
@@ -32,6 +34,16 @@ const struct configuration *cfg(void) {
     _cfg=new struct configuration;
     _cfg->start_dir=tmpdir();
     _cfg->listen_port=DEFAULT_PORT;
+    _cfg->worker_threads=0; /* worker threads are not supported on Windows */
+    _cfg->spawn_fork=0;
+    _cfg->max_jobs=ncpus();
+    _cfg->zygotes=0;
+    _cfg->kill_grace_ms=DEFAULT_KILL_GRACE_MS;
+    _cfg->cache_size_mb=DEFAULT_CACHE_SIZE_MB;
+    _cfg->cgroup_dir=NULL;
+    _cfg->sample_interval_ms=0; /* there is no /proc to sample */
+    _cfg->reactors=1;
+    _cfg->pin_reactors=0;
     /* read registry */
     HKEY hkey;
     if(RegOpenKey(HKEY_LOCAL_MACHINE, REGISTRY_KEY, &hkey) == ERROR_SUCCESS) {
@@ -49,6 +61,9 @@ const struct configuration *cfg(void) {
 	}
 	RegCloseKey(hkey);
     }
+    char cache_dir[_MAX_PATH];
+    _snprintf(cache_dir, sizeof(cache_dir), "%s\\ExecServer.cache", tmpdir());
+    _cfg->cache_dir=strdup(cache_dir);
     return _cfg;
 }
 
@@ -121,6 +136,110 @@ done:
     return rmdir(dirname);
 }
 
+/* there is no openat: a directory descriptor is an index into a table
+   of the paths of open directories, which relative paths are joined to */
+static vector<string> open_dirs; /* "" = free */
+
+static string dir_path(int dirfd, const char* path) {
+    bool absolute=path[0]=='\\' || path[0]=='/' || (path[0] && path[1]==':');
+    if(dirfd==PDIR_CWD || absolute || dirfd<0 || dirfd>=(int)open_dirs.size())
+        return path;
+    return open_dirs[dirfd]+"\\"+path;
+}
+
+int pdiropen(const char* path) {
+    struct stat st;
+    if(::stat(path, &st)<0)
+        return -1;
+    if(!(st.st_mode & _S_IFDIR)) {
+        errno=ENOTDIR;
+        return -1;
+    }
+    size_t i;
+    for(i=0; i<open_dirs.size() && !open_dirs[i].empty(); ++i)
+        ;
+    if(i==open_dirs.size())
+        open_dirs.push_back(path);
+    else
+        open_dirs[i]=path;
+    return (int)i;
+}
+
+int pdirclose(int dirfd) {
+    if(dirfd<0 || dirfd>=(int)open_dirs.size()) {
+        errno=EBADF;
+        return -1;
+    }
+    open_dirs[dirfd].clear();
+    return 0;
+}
+
+FILE* pfopen(int dirfd, const char* fname, const char* mode) {
+    return fopen(dir_path(dirfd, fname).c_str(), mode);
+}
+
+int paccess(int dirfd, const char* path, int mode) {
+    return _access(dir_path(dirfd, path).c_str(), mode);
+}
+
+int pmkdir(int dirfd, const char* path) {
+    return _mkdir(dir_path(dirfd, path).c_str());
+}
+
+int prmdir(int dirfd, const char* path, int recursive) {
+    string p=dir_path(dirfd, path);
+    return recursive? rmdir_recursive(p.c_str()): _rmdir(p.c_str());
+}
+
+int punlink(int dirfd, const char* path) {
+    return _unlink(dir_path(dirfd, path).c_str());
+}
+
+int presolve(int dirfd, const char* path, char* buf, size_t size) {
+    (void)dirfd;
+    if(strlen(path)>=size) {
+        errno=ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(buf, path);
+    return 0;
+}
+
+int preplace(int dirfd, const char* from, const char* to) {
+    if(!::MoveFileEx(dir_path(dirfd, from).c_str(), dir_path(dirfd, to).c_str(),
+                     MOVEFILE_REPLACE_EXISTING))
+        return -1;
+    return 0;
+}
+
+int pfsync(FILE* f) {
+    if(fflush(f)!=0)
+        return -1;
+    return _commit(_fileno(f));
+}
+
+int plistdir(const char* dir,
+             void (*fn)(void* arg, const char* name, double size, double mtime),
+             void* arg) {
+    struct _finddata_t d;
+    string wildcard=string(dir)+"\\*";
+    intptr_t p=_findfirst(wildcard.c_str(), &d);
+    if(p==-1)
+        return errno==ENOENT? 0: -1;
+    do {
+        if(strcmp(d.name,".")==0 || strcmp(d.name,"..")==0) continue;
+        fn(arg, d.name, (double)d.size, (double)d.time_write);
+    } while(_findnext(p, &d)==0);
+    _findclose(p);
+    errno=0;
+    return 0;
+}
+
+int raise_fd_limit(void) {
+    /* sockets are not limited by the C runtime file table */
+    return -1;
+}
+
 map<int, HANDLE> pid_table;
 
 static HANDLE get_process_handle(int pid) {
@@ -135,7 +254,11 @@ static HANDLE get_process_handle(int pid) {
     return h;
 }
 
-int pkill(int pid) {
+int pkill(int pid, int /*force*/) {
+    if(pid<=1) {
+        errno=ESRCH;
+        return -1;
+    }
     HANDLE h=get_process_handle(pid);
     if(!h)
         return -1;
@@ -149,22 +272,64 @@ int pkill(int pid) {
     return (int)rc;
 }
 
-int pwait(int pid, unsigned seconds) {
-    HANDLE h=get_process_handle(pid);
-    if(!h)
-        return -2;
-    DWORD wr=::WaitForSingleObject(h, seconds*1000);
-    if(wr==WAIT_TIMEOUT) {
-        return -1;
-    }
-    DWORD rc;
-    if(::GetExitCodeProcess(h,&rc)) {
-        pid_table.erase(pid);
-        ::CloseHandle(h);
-        return (int)rc;
-    } else {
-        return -1;
+int ncpus(void) {
+    SYSTEM_INFO si;
+    ::GetSystemInfo(&si);
+    return si.dwNumberOfProcessors>0? (int)si.dwNumberOfProcessors: 1;
+}
+
+int pchild_fd(void) {
+    /* process handles cannot be selected on */
+    return -1;
+}
+
+/* FILETIME intervals are in units of 100ns */
+static double filetime_seconds(const FILETIME& ft) {
+    ULARGE_INTEGER u;
+    u.LowPart=ft.dwLowDateTime;
+    u.HighPart=ft.dwHighDateTime;
+    return u.QuadPart/1e7;
+}
+
+/* the handles of pid_table keep the pids of exited children reserved */
+int pexited(void) {
+    for(map<int, HANDLE>::iterator it=pid_table.begin(); it!=pid_table.end(); ++it)
+        if(::WaitForSingleObject(it->second, 0)==WAIT_OBJECT_0)
+            return it->first;
+    return 0;
+}
+
+int preap(int pid, int* code, struct pusage* usage) {
+    map<int, HANDLE>::iterator it=pid_table.find(pid);
+    if(it!=pid_table.end()) {
+        DWORD rc;
+        if(::WaitForSingleObject(it->second, 0)==WAIT_OBJECT_0 &&
+           ::GetExitCodeProcess(it->second, &rc)) {
+            FILETIME created, exited, kernel, user;
+            memset(usage, 0, sizeof(*usage));
+            if(::GetProcessTimes(it->second, &created, &exited, &kernel, &user)) {
+                usage->utime=filetime_seconds(user);
+                usage->stime=filetime_seconds(kernel);
+            }
+            ::CloseHandle(it->second);
+            pid_table.erase(it);
+            *code=(int)rc;
+            return pid;
+        }
     }
+    return 0;
+}
+
+double wall_clock(void) {
+    /* FILETIME counts from 1601, the epoch is 11644473600 seconds later */
+    FILETIME ft;
+    ::GetSystemTimeAsFileTime(&ft);
+    return filetime_seconds(ft)-11644473600.0;
+}
+
+int psample(int /*pid*/, struct psample* /*s*/) {
+    errno=ENOSYS;
+    return -1;
 }
 
 static string quote_arg(const string& arg) {
@@ -314,6 +479,57 @@ cleanup:
     return res;
 }
 
+/* pipes cannot be selected on, so nothing is spawned on descriptors */
+int pspawn_fd(const char* const* /*argv*/, const char* const* /*envp*/, const char* /*cwd*/,
+              int /*fdstdin*/, int /*fdstdout*/, int /*fdstderr*/,
+              const struct plimits* /*limits*/) {
+    errno=ENOSYS;
+    return -1;
+}
+
+int pcgroup_init(void) {
+    errno=ENOSYS;
+    return -1;
+}
+
+int pcgroup_create(double /*memory_max*/, double /*cpu_max*/, char* /*buf*/, size_t /*size*/) {
+    errno=ENOSYS;
+    return -1;
+}
+
+int pcgroup_oom(const char* /*path*/) {
+    return 0;
+}
+
+int pcgroup_remove(const char* /*path*/) {
+    return 0;
+}
+
+int pstdfd(const char* /*fname*/, int /*output*/) {
+    errno=ENOSYS;
+    return -1;
+}
+
+int ppipe(int /*fds*/[2]) {
+    errno=ENOSYS;
+    return -1;
+}
+
+void pzygote_prefork(int /*n*/) {
+}
+
+int pzygote(int* /*pid*/) {
+    errno=ENOSYS;
+    return -1;
+}
+
+int pzygote_spawn(int /*zfd*/, const char* const* /*argv*/, const char* const* /*envp*/,
+                  const char* /*cwd*/, int /*fdstdin*/, int /*fdstdout*/, int /*fdstderr*/,
+                  const struct plimits* /*limits*/) {
+    errno=ENOSYS;
+    return -1;
+}
+
 int uname(struct utsname *name) {
     
     OSVERSIONINFO ovi;
@@ -16,8 +16,15 @@
 # endif
 #else
 # include <sys/time.h>
+# include <time.h>
 #endif  // _WINDOWS
 
+#if defined(XMLRPC_USE_EPOLL)
+# include <sys/epoll.h>
+# include <unistd.h>
+# include <errno.h>
+#endif
+
 
 using namespace XmlRpc;
 
@@ -27,13 +34,252 @@ XmlRpcDispatch::XmlRpcDispatch()
   _endTime = -1.0;
   _doClear = false;
   _inWork = false;
+#if defined(XMLRPC_USE_EPOLL)
+  _nSources = 0;
+  _generation = 0;
+  _epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (_epfd < 0)
+    XmlRpcUtil::error("XmlRpcDispatch: Could not create epoll instance (errno %d).", errno);
+#endif
 }
 
 
 XmlRpcDispatch::~XmlRpcDispatch()
 {
+#if defined(XMLRPC_USE_EPOLL)
+  if (_epfd >= 0)
+    ::close(_epfd);
+#endif
+}
+
+
+#if defined(XMLRPC_USE_EPOLL)
+
+// Number of events fetched from the kernel per epoll_wait call
+static const int MAX_EVENTS = 256;
+
+static unsigned long long
+packEventData(int fd, unsigned gen)
+{
+  return ((unsigned long long) gen << 32) | (unsigned) fd;
 }
 
+// Monitor this source for the specified events and call its event handler
+// when the event occurs
+void
+XmlRpcDispatch::addSource(XmlRpcSource* source, unsigned mask)
+{
+  int fd = source->getfd();
+  if (fd < 0)
+  {
+    XmlRpcUtil::error("XmlRpcDispatch::addSource: invalid fd %d.", fd);
+    return;
+  }
+  if (unsigned(fd) >= _table.size())
+    _table.resize(fd + 1 + fd / 2);
+
+  SourceEntry& entry = _table[fd];
+  if (entry._src)
+    releaseEntry(fd);     // Should not happen: the old source lost its fd
+
+  entry._src = source;
+  entry._mask = mask;
+  entry._gen = ++_generation;
+  entry._polled = false;
+  ++_nSources;
+  updatePoll(fd, entry);
+}
+
+// Stop monitoring this source. Does not close the source.
+// The source must still own its fd, i.e. be removed before it is closed.
+void
+XmlRpcDispatch::removeSource(XmlRpcSource* source)
+{
+  int fd = source->getfd();
+  if (fd >= 0 && unsigned(fd) < _table.size() && _table[fd]._src == source)
+    releaseEntry(fd);
+}
+
+
+// Modify the types of events to watch for on this source
+void 
+XmlRpcDispatch::setSourceEvents(XmlRpcSource* source, unsigned eventMask)
+{
+  int fd = source->getfd();
+  if (fd < 0 || unsigned(fd) >= _table.size() || _table[fd]._src != source)
+    return;
+  _table[fd]._mask = eventMask;
+  updatePoll(fd, _table[fd]);
+}
+
+
+void
+XmlRpcDispatch::updatePoll(int fd, SourceEntry& entry)
+{
+  struct epoll_event ev;
+  ev.events = 0;
+  if (entry._mask & ReadableEvent) ev.events |= EPOLLIN;
+  if (entry._mask & WritableEvent) ev.events |= EPOLLOUT;
+  if (entry._mask & Exception)     ev.events |= EPOLLPRI;
+  if (entry._mask & HangupEvent)   ev.events |= EPOLLRDHUP;
+  if (entry._mask & ErrorEvent)    ev.events |= EPOLLERR | EPOLLHUP;
+  ev.data.u64 = packEventData(fd, entry._gen);
+
+  if (ev.events == 0)
+  {
+    // epoll always reports errors and hangups, so idle sources are left out of the set
+    if (entry._polled)
+      epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, &ev);
+    entry._polled = false;
+    return;
+  }
+
+  if (epoll_ctl(_epfd, entry._polled ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) != 0)
+  {
+    // The fd may have been closed and reopened behind our back
+    if (errno == ENOENT)
+      epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev);
+    else if (errno == EEXIST)
+      epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &ev);
+    else
+      XmlRpcUtil::error("XmlRpcDispatch: epoll_ctl failed for fd %d (errno %d).", fd, errno);
+  }
+  entry._polled = true;
+}
+
+
+void
+XmlRpcDispatch::releaseEntry(int fd)
+{
+  SourceEntry& entry = _table[fd];
+  if (entry._polled)
+  {
+    struct epoll_event ev;    // Ignored, but required by old kernels
+    epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, &ev);   // May fail if fd was closed already
+  }
+  entry = SourceEntry();
+  --_nSources;
+}
+
+
+// Watch current set of sources and process events
+void
+XmlRpcDispatch::work(double timeout)
+{
+  // Compute end time
+  _endTime = (timeout < 0.0) ? -1.0 : (getTime() + timeout);
+  _doClear = false;
+  _inWork = true;
+
+  struct epoll_event events[MAX_EVENTS];
+
+  // Only work while there is something to monitor
+  while (_nSources > 0 || ! _timers.empty()) {
+
+    // Check for events
+    double wait = waitTime(timeout);
+    int msTimeout = (wait < 0.0) ? -1 : (int) ceil(wait * 1000.0);
+    int nEvents = epoll_wait(_epfd, events, MAX_EVENTS, msTimeout);
+
+    if (nEvents < 0)
+    {
+      if (errno != EINTR)
+      {
+        XmlRpcUtil::error("Error in XmlRpcDispatch::work: error in epoll_wait (%d).", errno);
+        _inWork = false;
+        return;
+      }
+      nEvents = 0;
+    }
+
+    // Process events
+    for (int i = 0; i < nEvents; ++i)
+    {
+      int fd = (int) (events[i].data.u64 & 0xffffffffu);
+      unsigned gen = (unsigned) (events[i].data.u64 >> 32);
+      uint32_t ev = events[i].events;
+
+      // Skip events for sources removed earlier in this round
+      if (unsigned(fd) >= _table.size() || _table[fd]._gen != gen || ! _table[fd]._src)
+        continue;
+
+      XmlRpcSource* src = _table[fd]._src;
+      unsigned mask = _table[fd]._mask;
+      unsigned newMask = (unsigned) -1;
+      bool failed = (ev & (EPOLLERR | EPOLLHUP)) != 0;
+
+      // Like select(), report errors as readiness so the handler sees them on its next IO call
+      if ((mask & ReadableEvent) && (ev & EPOLLIN || failed))
+        newMask &= src->handleEvent(ReadableEvent);
+      if ((mask & WritableEvent) && (ev & EPOLLOUT || failed) && _table[fd]._gen == gen)
+        newMask &= src->handleEvent(WritableEvent);
+      if ((mask & Exception) && (ev & EPOLLPRI) && _table[fd]._gen == gen)
+        newMask &= src->handleEvent(Exception);
+      if ((mask & HangupEvent) && (ev & EPOLLRDHUP || failed) && _table[fd]._gen == gen)
+        newMask &= src->handleEvent(HangupEvent);
+      if ((mask & ErrorEvent) && failed && _table[fd]._gen == gen)
+        newMask &= src->handleEvent(ErrorEvent);
+
+      // The handler may have removed the source itself
+      if (_table[fd]._gen != gen)
+        continue;
+
+      if ( ! newMask) {
+        releaseEntry(fd);  // Stop monitoring this one
+        if ( ! src->getKeepOpen())
+          src->close();
+      } else if (newMask != (unsigned) -1 && newMask != _table[fd]._mask) {
+        _table[fd]._mask = newMask;
+        updatePoll(fd, _table[fd]);
+      }
+    }
+
+    fireTimers();
+
+    // Check whether to clear all sources
+    if (_doClear)
+    {
+      _doClear = false;
+      _inWork = false;
+      clear();
+      _inWork = true;
+    }
+
+    // Check whether end time has passed
+    if (0 <= _endTime && getTime() > _endTime)
+      break;
+  }
+
+  _inWork = false;
+}
+
+
+// Clear all sources from the monitored sources list
+void
+XmlRpcDispatch::clear()
+{
+  if (_inWork)
+  {
+    _doClear = true;  // Finish reporting current events before clearing
+    return;
+  }
+
+  _timers.clear();
+  _timerIndex.clear();
+
+  SourceList closeList;
+  for (unsigned fd = 0; fd < _table.size(); ++fd)
+    if (_table[fd]._src)
+    {
+      closeList.push_back(MonitoredSource(_table[fd]._src, _table[fd]._mask));
+      releaseEntry(fd);
+    }
+  for (SourceList::iterator it=closeList.begin(); it!=closeList.end(); ++it)
+    it->getSource()->close();
+}
+
+#else  // ! XMLRPC_USE_EPOLL
+
 // Monitor this source for the specified events and call its event handler
 // when the event occurs
 void
@@ -79,7 +325,7 @@ XmlRpcDispatch::work(double timeout)
   _inWork = true;
 
   // Only work while there is something to monitor
-  while (_sources.size() > 0) {
+  while (_sources.size() > 0 || ! _timers.empty()) {
 
     // Construct the sets of descriptors we are interested in
     fd_set inFd, outFd, excFd;
@@ -99,13 +345,14 @@ XmlRpcDispatch::work(double timeout)
 
     // Check for events
     int nEvents;
-    if (timeout < 0.0)
+    double wait = waitTime(timeout);
+    if (wait < 0.0)
       nEvents = select(maxFd+1, &inFd, &outFd, &excFd, NULL);
     else 
     {
       struct timeval tv;
-      tv.tv_sec = (int)floor(timeout);
-      tv.tv_usec = ((int)floor(1000000.0 * (timeout-floor(timeout)))) % 1000000;
+      tv.tv_sec = (int)floor(wait);
+      tv.tv_usec = ((int)floor(1000000.0 * (wait-floor(wait)))) % 1000000;
       nEvents = select(maxFd+1, &inFd, &outFd, &excFd, &tv);
     }
 
@@ -142,9 +389,14 @@ XmlRpcDispatch::work(double timeout)
       }
     }
 
+    fireTimers();
+
     // Check whether to clear all sources
     if (_doClear)
     {
+      _timers.clear();
+      _timerIndex.clear();
+
       SourceList closeList = _sources;
       _sources.clear();
       for (SourceList::iterator it=closeList.begin(); it!=closeList.end(); ++it) {
@@ -164,14 +416,6 @@ XmlRpcDispatch::work(double timeout)
 }
 
 
-// Exit from work routine. Presumably this will be called from
-// one of the source event handlers.
-void
-XmlRpcDispatch::exit()
-{
-  _endTime = 0.0;   // Return from work asap
-}
-
 // Clear all sources from the monitored sources list
 void
 XmlRpcDispatch::clear()
@@ -180,6 +424,9 @@ XmlRpcDispatch::clear()
     _doClear = true;  // Finish reporting current events before clearing
   else
   {
+    _timers.clear();
+    _timerIndex.clear();
+
     SourceList closeList = _sources;
     _sources.clear();
     for (SourceList::iterator it=closeList.begin(); it!=closeList.end(); ++it)
@@ -187,7 +434,70 @@ XmlRpcDispatch::clear()
   }
 }
 
+#endif  // XMLRPC_USE_EPOLL
+
+
+// Schedule a TimerEvent for the source
+void
+XmlRpcDispatch::scheduleTimer(XmlRpcSource* source, double delay)
+{
+  cancelTimer(source);
+  _timerIndex[source] = _timers.insert(TimerMap::value_type(getTime() + delay, source));
+}
+
+
+void
+XmlRpcDispatch::cancelTimer(XmlRpcSource* source)
+{
+  std::map< XmlRpcSource*, TimerMap::iterator >::iterator it = _timerIndex.find(source);
+  if (it != _timerIndex.end())
+  {
+    _timers.erase(it->second);
+    _timerIndex.erase(it);
+  }
+}
+
+
+// How long to wait for IO: until the work timeout or the next timer expires
+double
+XmlRpcDispatch::waitTime(double timeout)
+{
+  if (_timers.empty())
+    return timeout;
+
+  double untilTimer = _timers.begin()->first - getTime();
+  if (untilTimer < 0.0)
+    untilTimer = 0.0;
+  return (timeout < 0.0 || untilTimer < timeout) ? untilTimer : timeout;
+}
+
+
+// Handlers may schedule and cancel timers, or delete their source
+void
+XmlRpcDispatch::fireTimers()
+{
+  double now = getTime();
+  while ( ! _timers.empty() && _timers.begin()->first <= now)
+  {
+    XmlRpcSource* src = _timers.begin()->second;
+    _timers.erase(_timers.begin());
+    _timerIndex.erase(src);
+    src->handleEvent(TimerEvent);
+  }
+}
+
 
+// Exit from work routine. Presumably this will be called from
+// one of the source event handlers.
+void
+XmlRpcDispatch::exit()
+{
+  _endTime = 0.0;   // Return from work asap
+}
+
+
+// Timers and work timeouts use a monotonic clock where there is one,
+// so they are not affected by changes of the system time.
 double
 XmlRpcDispatch::getTime()
 {
@@ -197,6 +507,11 @@ XmlRpcDispatch::getTime()
   ftime(&tbuff);
   return ((double) tbuff.time + ((double)tbuff.millitm / 1000.0) +
 	  ((double) tbuff.timezone * 60));
+#elif defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec + ts.tv_nsec / 1000000000.0);
 #else
   struct timeval	tv;
   struct timezone	tz;
@@ -8,8 +8,14 @@
 # pragma warning(disable:4786)    // identifier was truncated in debug info
 #endif
 
+#if defined(__linux__) && !defined(XMLRPC_NO_EPOLL)
+# define XMLRPC_USE_EPOLL   // use epoll(7) instead of select()
+#endif
+
 #ifndef MAKEDEPEND
 # include <list>
+# include <map>
+# include <vector>
 #endif
 
 namespace XmlRpc {
@@ -29,7 +35,10 @@ namespace XmlRpc {
     enum EventType {
       ReadableEvent = 1,    //!< data available to read
       WritableEvent = 2,    //!< connected/data can be written without blocking
-      Exception     = 4     //!< uh oh
+      Exception     = 4,    //!< uh oh
+      TimerEvent    = 8,    //!< a timer scheduled for the source expired
+      HangupEvent   = 16,   //!< the peer has shut down its side, or the connection has failed (epoll only)
+      ErrorEvent    = 32    //!< the connection has failed, e.g. the peer has reset it (epoll only)
     };
     
     //! Monitor this source for the event types specified by the event mask
@@ -45,6 +54,16 @@ namespace XmlRpc {
     //! Modify the types of events to watch for on this source
     void setSourceEvents(XmlRpcSource* source, unsigned eventMask);
 
+    //! Call the source's event handler with TimerEvent once, after the
+    //! specified delay (in seconds). The source need not be monitored for IO.
+    //! A source has at most one timer; scheduling again replaces it.
+    //! The handler's return value is ignored for timer events.
+    void scheduleTimer(XmlRpcSource* source, double delay);
+
+    //! Cancel the source's timer, if any. Sources with a pending timer
+    //! must cancel it before they are deleted.
+    void cancelTimer(XmlRpcSource* source);
+
 
     //! Watch current set of sources and process events for the specified
     //! duration (in ms, -1 implies wait forever, or until exit is called)
@@ -54,12 +73,19 @@ namespace XmlRpc {
     void exit();
 
     //! Clear all sources from the monitored sources list. Sources are closed.
+    //! Pending timers are dropped.
     void clear();
 
+    //! Current time in seconds, as used for timers
+    static double getTime();
+
   protected:
 
-    // helper
-    double getTime();
+    // Time to wait for IO, given the work timeout and the pending timers
+    double waitTime(double timeout);
+
+    // Run the handlers of expired timers
+    void fireTimers();
 
     // A source to monitor and what to monitor it for
     struct MonitoredSource {
@@ -73,8 +99,43 @@ namespace XmlRpc {
     // A list of sources to monitor
     typedef std::list< MonitoredSource > SourceList; 
 
+#if defined(XMLRPC_USE_EPOLL)
+    // An entry of the fd-indexed source table. The generation number
+    // distinguishes a source from a later one that reuses the same fd.
+    struct SourceEntry {
+      SourceEntry() : _src(0), _mask(0), _gen(0), _polled(false) {}
+      XmlRpcSource* _src;
+      unsigned _mask;
+      unsigned _gen;
+      bool _polled;     // registered in the epoll set
+    };
+
+    // Update the epoll registration of the fd to match the entry's mask
+    void updatePoll(int fd, SourceEntry& entry);
+
+    // Forget the source registered on the fd
+    void releaseEntry(int fd);
+
+    // Sources being monitored, indexed by file descriptor
+    std::vector< SourceEntry > _table;
+
+    // Number of sources in the table
+    unsigned _nSources;
+
+    // Generation counter for new table entries
+    unsigned _generation;
+
+    // The epoll instance
+    int _epfd;
+#else
     // Sources being monitored
     SourceList _sources;
+#endif
+
+    // Pending timers, ordered by expiry time, and their index by source
+    typedef std::multimap< double, XmlRpcSource* > TimerMap;
+    TimerMap _timers;
+    std::map< XmlRpcSource*, TimerMap::iterator > _timerIndex;
 
     // When work should stop (-1 implies wait forever, or until exit is called)
     double _endTime;
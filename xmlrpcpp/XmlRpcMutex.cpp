@@ -0,0 +1,55 @@
+
+#include "XmlRpcMutex.h"
+
+using namespace XmlRpc;
+
+
+#if defined(_WINDOWS)
+
+XmlRpcMutex::XmlRpcMutex()
+{
+  InitializeCriticalSection(&_cs);
+}
+
+XmlRpcMutex::~XmlRpcMutex()
+{
+  DeleteCriticalSection(&_cs);
+}
+
+void
+XmlRpcMutex::acquire()
+{
+  EnterCriticalSection(&_cs);
+}
+
+void
+XmlRpcMutex::release()
+{
+  LeaveCriticalSection(&_cs);
+}
+
+#else  // _WINDOWS
+
+XmlRpcMutex::XmlRpcMutex()
+{
+  pthread_mutex_init(&_mutex, 0);
+}
+
+XmlRpcMutex::~XmlRpcMutex()
+{
+  pthread_mutex_destroy(&_mutex);
+}
+
+void
+XmlRpcMutex::acquire()
+{
+  pthread_mutex_lock(&_mutex);
+}
+
+void
+XmlRpcMutex::release()
+{
+  pthread_mutex_unlock(&_mutex);
+}
+
+#endif  // _WINDOWS
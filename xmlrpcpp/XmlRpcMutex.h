@@ -0,0 +1,56 @@
+#ifndef _XMLRPCMUTEX_H_
+#define _XMLRPCMUTEX_H_
+//
+// XmlRpc++ Copyright (c) 2002-2003 by Chris Morley
+//
+#if defined(_MSC_VER)
+# pragma warning(disable:4786)    // identifier was truncated in debug info
+#endif
+
+#ifndef MAKEDEPEND
+# if defined(_WINDOWS)
+#  include <windows.h>
+# else
+#  include <pthread.h>
+# endif
+#endif
+
+namespace XmlRpc {
+
+  //! A mutex for state shared between the dispatcher and worker threads.
+  class XmlRpcMutex {
+  public:
+    //! Locks a mutex for the lifetime of the object.
+    class Lock {
+    public:
+      Lock(XmlRpcMutex& m) : _m(m) { _m.acquire(); }
+      ~Lock() { _m.release(); }
+    private:
+      Lock(const Lock&);
+      Lock& operator=(const Lock&);
+      XmlRpcMutex& _m;
+    };
+
+    //! Constructor
+    XmlRpcMutex();
+    //! Destructor
+    ~XmlRpcMutex();
+
+    //! Wait for and take the mutex
+    void acquire();
+    //! Give the mutex up
+    void release();
+
+  private:
+    XmlRpcMutex(const XmlRpcMutex&);
+    XmlRpcMutex& operator=(const XmlRpcMutex&);
+
+#if defined(_WINDOWS)
+    CRITICAL_SECTION _cs;
+#else
+    pthread_mutex_t _mutex;
+#endif
+  };
+} // namespace XmlRpc
+
+#endif // _XMLRPCMUTEX_H_
@@ -6,6 +6,11 @@
 #include "XmlRpcUtil.h"
 #include "XmlRpcException.h"
 
+#if defined(__linux__)
+# include <sched.h>
+# include <unistd.h>
+#endif
+
 
 using namespace XmlRpc;
 
@@ -15,6 +20,27 @@ XmlRpcServer::XmlRpcServer()
   _introspectionEnabled = false;
   _listMethods = 0;
   _methodHelp = 0;
+  _home = this;
+  _nReactors = 1;
+  _pinReactors = false;
+  _reactorsRunning = false;
+  _cpu = -1;
+  _stopping = false;
+}
+
+
+// Additional reactors serve the methods of their home
+XmlRpcServer::XmlRpcServer(XmlRpcServer* home)
+{
+  _introspectionEnabled = false;
+  _listMethods = 0;
+  _methodHelp = 0;
+  _home = home;
+  _nReactors = home->_nReactors;
+  _pinReactors = false;
+  _reactorsRunning = false;
+  _cpu = -1;
+  _stopping = false;
 }
 
 
@@ -31,6 +57,11 @@ XmlRpcServer::~XmlRpcServer()
 void 
 XmlRpcServer::addMethod(XmlRpcServerMethod* method)
 {
+  if (_reactorsRunning)
+  {
+    XmlRpcUtil::error("XmlRpcServer::addMethod: cannot add %s while the reactors run.", method->name().c_str());
+    return;
+  }
   _methods[method->name()] = method;
 }
 
@@ -38,15 +69,18 @@ XmlRpcServer::addMethod(XmlRpcServerMethod* method)
 void 
 XmlRpcServer::removeMethod(XmlRpcServerMethod* method)
 {
-  MethodMap::iterator i = _methods.find(method->name());
-  if (i != _methods.end())
-    _methods.erase(i);
+  removeMethod(method->name());
 }
 
 // Remove a command from the RPC server by name
 void 
 XmlRpcServer::removeMethod(const std::string& methodName)
 {
+  if (_reactorsRunning)
+  {
+    XmlRpcUtil::error("XmlRpcServer::removeMethod: cannot remove %s while the reactors run.", methodName.c_str());
+    return;
+  }
   MethodMap::iterator i = _methods.find(methodName);
   if (i != _methods.end())
     _methods.erase(i);
@@ -57,6 +91,8 @@ XmlRpcServer::removeMethod(const std::string& methodName)
 XmlRpcServerMethod* 
 XmlRpcServer::findMethod(const std::string& name) const
 {
+  if (_home != this)
+    return _home->findMethod(name);
   MethodMap::const_iterator i = _methods.find(name);
   if (i == _methods.end())
     return 0;
@@ -94,6 +130,14 @@ XmlRpcServer::bindAndListen(int port, int backlog /*= 5*/)
     return false;
   }
 
+  // Each reactor listens on a socket of its own, bound to the same port
+  if (_nReactors > 1 && ! XmlRpcSocket::setReusePort(fd))
+  {
+    this->close();
+    XmlRpcUtil::error("XmlRpcServer::bindAndListen: Could not set SO_REUSEPORT socket option (%s).", XmlRpcSocket::getErrorMsg().c_str());
+    return false;
+  }
+
   // Bind to the specified port on the default interface
   if ( ! XmlRpcSocket::bind(fd, port))
   {
@@ -115,19 +159,134 @@ XmlRpcServer::bindAndListen(int port, int backlog /*= 5*/)
   // Notify the dispatcher to listen on this source when we are in work()
   _disp.addSource(this, XmlRpcDispatch::ReadableEvent);
 
+  if (_home != this || _nReactors <= 1)
+    return true;
+
+  // The reactors hand requests to each other through their pools
+  if ( ! _pool.open(&_disp))
+    return true;
+  for (int i = 1; i < _nReactors; ++i)
+  {
+    XmlRpcServer* r = new XmlRpcServer(this);
+    if ( ! r->bindAndListen(port, backlog) || ! r->_pool.open(&r->_disp))
+    {
+      delete r;
+      break;
+    }
+    r->_cpu = _pinReactors ? i : -1;
+#if defined(__linux__)
+    long nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (r->_cpu > 0 && nCpus > 0)
+      r->_cpu %= nCpus;
+#endif
+    _reactors.push_back(r);
+  }
+  XmlRpcUtil::log(2, "XmlRpcServer::bindAndListen: %d reactors", getReactors());
   return true;
 }
 
 
+void
+XmlRpcServer::setReactors(int nReactors, bool pin)
+{
+#if defined(_WINDOWS)
+  if (nReactors > 1)
+    XmlRpcUtil::log(1, "XmlRpcServer::setReactors: reactors are not supported on this platform");
+  nReactors = 1;
+#endif
+  _nReactors = nReactors > 1 ? nReactors : 1;
+  _pinReactors = pin;
+}
+
+
+// Execute blocking methods on worker threads
+bool
+XmlRpcServer::setWorkerThreads(int nThreads)
+{
+  bool started = _pool.start(&_disp, nThreads);
+  for (unsigned i = 0; i < _reactors.size(); ++i)
+    _reactors[i]->_pool.start(&_reactors[i]->_disp, nThreads);
+  return started;
+}
+
+
 // Process client requests for the specified time
 void 
 XmlRpcServer::work(double msTime)
 {
+  if ( ! _reactorsRunning && ! _reactors.empty())
+    startReactors();
   XmlRpcUtil::log(4, "XmlRpcServer::work: waiting for a connection");
   _disp.work(msTime);
 }
 
 
+#if ! defined(_WINDOWS)
+
+// The loop of an additional reactor
+void*
+XmlRpcServer::reactorMain(void* server)
+{
+  XmlRpcServer* r = static_cast<XmlRpcServer*>(server);
+#if defined(__linux__)
+  if (r->_cpu >= 0)
+  {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(r->_cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+      XmlRpcUtil::log(1, "XmlRpcServer::reactorMain: could not pin the reactor to CPU %d", r->_cpu);
+  }
+#endif
+  while ( ! r->_stopping)
+    r->_disp.work(0.5);
+  return 0;
+}
+
+
+void
+XmlRpcServer::startReactors()
+{
+  _reactorsRunning = true;
+  for (unsigned i = 0; i < _reactors.size(); ++i)
+  {
+    pthread_t t;
+    if (pthread_create(&t, 0, reactorMain, _reactors[i]) != 0)
+    {
+      XmlRpcUtil::error("XmlRpcServer::startReactors: Could not create thread.");
+      for (unsigned j = i; j < _reactors.size(); ++j)
+        delete _reactors[j];
+      _reactors.resize(i);
+      break;
+    }
+    _reactorThreads.push_back(t);
+  }
+}
+
+
+void
+XmlRpcServer::stopReactors()
+{
+  for (unsigned i = 0; i < _reactors.size(); ++i)
+    _reactors[i]->_stopping = true;
+  for (unsigned i = 0; i < _reactorThreads.size(); ++i)
+    pthread_join(_reactorThreads[i], 0);
+  _reactorThreads.clear();
+  _reactorsRunning = false;
+
+  for (unsigned i = 0; i < _reactors.size(); ++i)
+    delete _reactors[i];
+  _reactors.clear();
+}
+
+#else  // _WINDOWS
+
+void XmlRpcServer::startReactors() {}
+void XmlRpcServer::stopReactors() {}
+
+#endif  // _WINDOWS
+
+
 
 // Handle input on the server socket by accepting the connection
 // and reading the rpc request.
@@ -159,6 +318,10 @@ XmlRpcServer::acceptConnection()
   else  // Notify the dispatcher to listen for input on this source when we are in work()
   {
     XmlRpcUtil::log(2, "XmlRpcServer::acceptConnection: creating a connection");
+    {
+      XmlRpcMutex::Lock lock(_statsLock);
+      ++_stats.connections;
+    }
     _disp.addSource(this->createConnection(s), XmlRpcDispatch::ReadableEvent);
   }
 }
@@ -176,10 +339,74 @@ XmlRpcServer::createConnection(int s)
 void 
 XmlRpcServer::removeConnection(XmlRpcServerConnection* sc)
 {
+  {
+    XmlRpcMutex::Lock lock(_statsLock);
+    --_stats.connections;
+  }
   _disp.removeSource(sc);
 }
 
 
+// Hand a request whose method may block to a worker thread. The connection
+// must not be monitored until the worker completes it.
+bool
+XmlRpcServer::queueRequest(XmlRpcServerConnection* sc, const std::string& methodName,
+                           XmlRpcValue& params)
+{
+  if (_pool.size() == 0 || ! isBlocking(methodName, params, true))
+    return false;
+
+  XmlRpcUtil::log(3, "XmlRpcServer::queueRequest: queueing '%s'", methodName.c_str());
+  _pool.submit(sc);
+  return true;
+}
+
+
+void
+XmlRpcServer::resumeConnection(XmlRpcServerConnection* sc)
+{
+  // It is still watched for a hangup, unless the client has gone
+  _disp.removeSource(sc);
+  _disp.addSource(sc, XmlRpcDispatch::WritableEvent);
+}
+
+
+void
+XmlRpcServer::recordRequest()
+{
+  XmlRpcMutex::Lock lock(_statsLock);
+  ++_stats.requests;
+}
+
+
+void
+XmlRpcServer::recordCancel()
+{
+  XmlRpcMutex::Lock lock(_statsLock);
+  ++_stats.cancelled;
+}
+
+
+// Sum the counts of the reactors, each read under its lock
+XmlRpcServer::Stats
+XmlRpcServer::getStats() const
+{
+  Stats stats;
+  {
+    XmlRpcMutex::Lock lock(_statsLock);
+    stats = _stats;
+  }
+  for (unsigned i = 0; i < _reactors.size(); ++i)
+  {
+    XmlRpcMutex::Lock lock(_reactors[i]->_statsLock);
+    stats.connections += _reactors[i]->_stats.connections;
+    stats.requests += _reactors[i]->_stats.requests;
+    stats.cancelled += _reactors[i]->_stats.cancelled;
+  }
+  return stats;
+}
+
+
 // Stop processing client requests
 void 
 XmlRpcServer::exit()
@@ -192,6 +419,7 @@ XmlRpcServer::exit()
 void 
 XmlRpcServer::shutdown()
 {
+  stopReactors();
   // This closes and destroys all connections as well as closing this socket
   _disp.clear();
 }
@@ -201,6 +429,7 @@ XmlRpcServer::shutdown()
 static const std::string LIST_METHODS("system.listMethods");
 static const std::string METHOD_HELP("system.methodHelp");
 static const std::string MULTICALL("system.multicall");
+static const std::string MULTICALL_PARALLEL("system.multicall_parallel");
 
 
 // List all methods available on a server
@@ -268,16 +497,52 @@ XmlRpcServer::enableIntrospection(bool enabled)
 }
 
 
+// A multicall blocks if any of its calls does. A parallel multicall waits
+// for the workers running its calls.
+bool
+XmlRpcServer::isBlocking(const std::string& methodName, XmlRpcValue& params, bool topLevel) const
+{
+  if (methodName == MULTICALL_PARALLEL)
+    return true;
+  if (methodName == MULTICALL)
+  {
+    if (params.size() != 1 || params[0].getType() != XmlRpcValue::TypeArray)
+      return false;
+    for (int i = 0; i < params[0].size(); ++i)
+    {
+      XmlRpcValue& call = params[0][i];
+      if (call.getType() == XmlRpcValue::TypeStruct && call.hasMember("methodName") &&
+          call["methodName"].getType() == XmlRpcValue::TypeString &&
+          isBlocking(call["methodName"], call.hasMember("params") ? call["params"] : params, false))
+        return true;
+    }
+    return false;
+  }
+
+  XmlRpcServerMethod* m = findMethod(methodName);
+  if ( ! m)
+    return false;
+  return m->execution() == XmlRpcServerMethod::Blocking ||
+         ( ! topLevel && m->execution() == XmlRpcServerMethod::Deferred);
+}
+
+
 void
 XmlRpcServer::listMethods(XmlRpcValue& result)
 {
+  if (_home != this)
+  {
+    _home->listMethods(result);
+    return;
+  }
   int i = 0;
-  result.setSize(_methods.size()+1);
+  result.setSize(_methods.size()+2);
   for (MethodMap::iterator it=_methods.begin(); it != _methods.end(); ++it)
     result[i++] = it->first;
 
   // Multicall support is built into XmlRpcServerConnection
-  result[i] = MULTICALL;
+  result[i++] = MULTICALL;
+  result[i] = MULTICALL_PARALLEL;
 }
 
 
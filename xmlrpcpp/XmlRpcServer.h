@@ -11,10 +11,13 @@
 #ifndef MAKEDEPEND
 # include <map>
 # include <string>
+# include <vector>
 #endif
 
 #include "XmlRpcDispatch.h"
+#include "XmlRpcMutex.h"
 #include "XmlRpcSource.h"
+#include "XmlRpcThreadPool.h"
 
 namespace XmlRpc {
 
@@ -56,9 +59,47 @@ namespace XmlRpc {
     //! set it in listen mode to make it available for clients.
     bool bindAndListen(int port, int backlog = 5);
 
+    //! Serve the port from nReactors event loops. Each additional reactor
+    //! has its own listening socket (SO_REUSEPORT), dispatcher thread and
+    //! workers, and shares the methods of this server, which must not change
+    //! while they run. Deferred methods always run on this server's thread.
+    //! With pin, reactor i is pinned to CPU i (modulo the CPUs online).
+    //! Call before bindAndListen.
+    void setReactors(int nReactors, bool pin = false);
+
+    //! Number of reactors serving the port, this server included
+    int getReactors() const { return 1 + int(_reactors.size()); }
+
+    //! Execute blocking methods on nThreads worker threads instead of the
+    //! dispatcher thread, for each reactor. Call after bindAndListen. Returns
+    //! false if the threads could not be started; methods are then executed inline.
+    bool setWorkerThreads(int nThreads);
+
+    //! Number of worker threads of this reactor
+    int getWorkerThreads() const { return _pool.size(); }
+
     //! Process client requests for the specified time
     void work(double msTime);
 
+    //! The event dispatcher serving the server's connections
+    XmlRpcDispatch* getDispatch() { return &_disp; }
+
+    //! The server running the deferred methods of this one: itself,
+    //! unless this is an additional reactor
+    XmlRpcServer* getHome() { return _home; }
+
+    //! Have the dispatcher thread call job->complete(). Methods running on a
+    //! worker use this to touch the dispatcher, which is not thread safe.
+    void post(XmlRpcThreadPool::Job* job) { _pool.post(job); }
+
+    //! Run a job on a worker thread, then have the dispatcher thread call its
+    //! complete(). Without workers both are called at once. Dispatcher thread only.
+    void submit(XmlRpcThreadPool::Job* job) { _pool.submit(job); }
+
+    //! Run the items of a batch on the calling thread and the idle workers.
+    //! Worker threads only, see XmlRpcThreadPool::runBatch.
+    void runBatch(XmlRpcThreadPool::Batch* batch, int n) { _pool.runBatch(batch, n); }
+
     //! Temporarily stop processing client requests and exit the work() method.
     void exit();
 
@@ -76,6 +117,31 @@ namespace XmlRpc {
     //! Remove a connection from the dispatcher
     virtual void removeConnection(XmlRpcServerConnection*);
 
+    //! Queue the parsed request of a connection on a worker thread if its
+    //! method may block. Returns false if the caller should execute it.
+    virtual bool queueRequest(XmlRpcServerConnection* sc, const std::string& methodName,
+                              XmlRpcValue& params);
+
+    //! Resume monitoring a connection once a worker has done its part
+    virtual void resumeConnection(XmlRpcServerConnection*);
+
+    //! Counts of the connections and requests of the server
+    struct Stats {
+      Stats() : connections(0), requests(0), cancelled(0) {}
+      int connections;          //!< open client connections
+      unsigned long requests;   //!< requests started
+      unsigned long cancelled;  //!< requests whose client disconnected before the answer
+    };
+
+    //! The counts so far, summed over the reactors
+    Stats getStats() const;
+
+    //! Count a request started by a connection
+    void recordRequest();
+
+    //! Count a request cancelled because its client has gone
+    void recordCancel();
+
   protected:
 
     //! Accept a client connection request
@@ -84,12 +150,29 @@ namespace XmlRpc {
     //! Create a new connection object for processing requests from a specific client.
     virtual XmlRpcServerConnection* createConnection(int socket);
 
+    // An additional reactor of home
+    XmlRpcServer(XmlRpcServer* home);
+
+    // Start and stop the threads of the additional reactors
+    void startReactors();
+    void stopReactors();
+#if ! defined(_WINDOWS)
+    static void* reactorMain(void* server);
+#endif
+
     // Whether the introspection API is supported by this server
     bool _introspectionEnabled;
 
+    // Whether a method (or any method of a multicall) should run on a worker.
+    // Deferred methods block unless they are called at the top level.
+    bool isBlocking(const std::string& methodName, XmlRpcValue& params, bool topLevel) const;
+
     // Event dispatcher
     XmlRpcDispatch _disp;
 
+    // Worker threads for blocking methods
+    XmlRpcThreadPool _pool;
+
     // Collection of methods. This could be a set keyed on method name if we wanted...
     typedef std::map< std::string, XmlRpcServerMethod* > MethodMap;
     MethodMap _methods;
@@ -98,6 +181,28 @@ namespace XmlRpc {
     XmlRpcServerMethod* _listMethods;
     XmlRpcServerMethod* _methodHelp;
 
+    // Connection and request counts, which the other reactors read
+    Stats _stats;
+    mutable XmlRpcMutex _statsLock;
+
+    // The server whose methods this one serves (this, unless it is a reactor)
+    XmlRpcServer* _home;
+
+    // Reactors requested, whether to pin them, and the additional ones created
+    int _nReactors;
+    bool _pinReactors;
+    std::vector< XmlRpcServer* > _reactors;
+#if ! defined(_WINDOWS)
+    std::vector< pthread_t > _reactorThreads;
+#endif
+    // Set while the reactor threads run; the methods are then read only
+    bool _reactorsRunning;
+
+    // For an additional reactor: the CPU to pin its thread to (or -1),
+    // and the request to leave its loop
+    int _cpu;
+    volatile bool _stopping;
+
   };
 } // namespace XmlRpc
 
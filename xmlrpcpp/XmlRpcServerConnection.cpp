@@ -1,12 +1,17 @@
 
 #include "XmlRpcServerConnection.h"
 
+#include "XmlRpcDispatch.h"
 #include "XmlRpcSocket.h"
 #include "XmlRpc.h"
 
+#include "base64.h"
+
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <vector>
 
 using namespace XmlRpc;
 
@@ -18,22 +23,77 @@ const char XmlRpcServerConnection::PARAM_TAG[] = "<param>";
 const char XmlRpcServerConnection::PARAM_ETAG[] = "</param>";
 
 const std::string XmlRpcServerConnection::SYSTEM_MULTICALL = "system.multicall";
+const std::string XmlRpcServerConnection::SYSTEM_MULTICALL_PARALLEL = "system.multicall_parallel";
 const std::string XmlRpcServerConnection::METHODNAME = "methodName";
 const std::string XmlRpcServerConnection::PARAMS = "params";
 
 const std::string XmlRpcServerConnection::FAULTCODE = "faultCode";
 const std::string XmlRpcServerConnection::FAULTSTRING = "faultString";
 
+// The response around the result XML
+static const char RESPONSE_1[] = 
+  "<?xml version=\"1.0\"?>\r\n"
+  "<methodResponse><params><param>\r\n\t";
+static const char RESPONSE_2[] =
+  "\r\n</param></params></methodResponse>\r\n";
+
+// Pieces of a streamed result written in one go before the dispatcher
+// serves other connections
+static const int STREAM_PIECES = 16;
+
+// Requests from this length on are parsed as they are read, so that a large
+// value for a method with a sink is never held in memory whole
+static const long SINK_MIN = 1024*1024;
+
+// Bytes read from the client at a time, and blocks of a large request
+// read in one go before the dispatcher serves other connections
+static const int READ_BLOCK = 256*1024;
+static const int READ_BLOCKS = 16;
+
+// The start and end of the value of a parameter with a sink
+static const char VALUE_TAG[] = "<value>";
+static const char VALUE_ETAG[] = "</value>";
+static const char STRING_TAG[] = "<string>";
+static const char STRING_ETAG[] = "</string>";
+static const char BASE64_TAG[] = "<base64>";
+static const char BASE64_ETAG[] = "</base64>";
+
 
 
 // The server delegates handling client requests to a serverConnection object.
 XmlRpcServerConnection::XmlRpcServerConnection(int fd, XmlRpcServer* server, bool deleteOnClose /*= false*/) :
-  XmlRpcSource(fd, deleteOnClose)
+  XmlRpcSource(fd, deleteOnClose),
+  _executeAtHome(this, &XmlRpcServerConnection::executeAtHome),
+  _cancelAtHome(this, &XmlRpcServerConnection::cancelAtHome),
+  _cancelDone(this, &XmlRpcServerConnection::cancelDone),
+  _fillStream(this, &XmlRpcServerConnection::streamFilled, &XmlRpcServerConnection::fillStream),
+  _writeSink(this, &XmlRpcServerConnection::sinkWritten, &XmlRpcServerConnection::sinkWrite)
 {
   XmlRpcUtil::log(2,"XmlRpcServerConnection: new socket %d.", fd);
   _server = server;
   _connectionState = READ_HEADER;
+  _headerScanned = 0;
+  _contentLength = 0;
+  _parseState = PARSE_WHOLE;
+  _requestOffset = 0;
+  _nArgs = 0;
+  _sink = 0;
+  _sinkIndex = -1;
+  _sinkType = XmlRpcValue::TypeInvalid;
+  _sinkFailed = false;
+  _bytesWritten = 0;
   _keepAlive = true;
+  _chunkedOk = false;
+  _stream = 0;
+  _chunked = false;
+  _streamLeft = -1;
+  _streamRead = 0;
+  _session = 0;
+  _cancelled = false;
+  _cancellable = 0;
+  _atHome = false;
+  _cancelling = false;
+  _resumePending = false;
 }
 
 
@@ -41,6 +101,9 @@ XmlRpcServerConnection::~XmlRpcServerConnection()
 {
   XmlRpcUtil::log(4,"XmlRpcServerConnection dtor.");
   _server->removeConnection(this);
+  delete _stream;
+  delete _sink;
+  delete _session;
 }
 
 
@@ -48,19 +111,66 @@ XmlRpcServerConnection::~XmlRpcServerConnection()
 // and reading the rpc request. Return true to continue to monitor
 // the socket for events, false to remove it from the dispatcher.
 unsigned
-XmlRpcServerConnection::handleEvent(unsigned /*eventType*/)
+XmlRpcServerConnection::handleEvent(unsigned eventType)
 {
-  if (_connectionState == READ_HEADER)
-    if ( ! readHeader()) return 0;
+  // The client has gone; an answer given meanwhile resumes the connection
+  if (eventType == XmlRpcDispatch::ErrorEvent) {
+    if (_connectionState == EXECUTE_REQUEST && ! _cancelled)
+      cancelRequest();
+    return 0;
+  }
 
-  if (_connectionState == READ_REQUEST)
-    if ( ! readRequest()) return 0;
+  // The client has shut down its side, which it may do while still waiting
+  // for the answer. Whether it has gone shows once something is written.
+  if (eventType == XmlRpcDispatch::HangupEvent) {
+    if (_connectionState == EXECUTE_REQUEST && ! _cancelled) {
+      if (probeClient())
+        return XmlRpcDispatch::ErrorEvent;
+      cancelRequest();
+    }
+    return 0;
+  }
 
-  if (_connectionState == WRITE_RESPONSE)
-    if ( ! writeResponse()) return 0;
+  // Close the connection once the cancelled request is answered
+  if (_cancelled)
+    return 0;
+
+  for (;;) {
+    if (_connectionState == READ_HEADER)
+      if ( ! readHeader()) return 0;
+
+    if (_connectionState == READ_REQUEST)
+      if ( ! readRequest()) return 0;
+
+    // Resumed once a worker has written the block to the sink
+    if (_connectionState == WRITE_SINK)
+      return 0;
+
+    // The request is executing; only watch for the client going away
+    // (which select() cannot tell)
+    if (_connectionState == EXECUTE_REQUEST)
+#if defined(XMLRPC_USE_EPOLL)
+      return XmlRpcDispatch::HangupEvent;
+#else
+      return 0;
+#endif
+
+    if (_connectionState == WRITE_RESPONSE) {
+      if ( ! writeResponse()) return 0;
+
+      // Resumed once a worker has read the next piece of the response
+      if (_connectionState == READ_STREAM)
+        return 0;
+
+      // The next request of a pipelining client may be buffered already,
+      // in which case there may be nothing more to read from the socket
+      if (_connectionState == READ_HEADER && _header.length() > 0)
+        continue;
+    }
 
-  return (_connectionState == WRITE_RESPONSE) 
-        ? XmlRpcDispatch::WritableEvent : XmlRpcDispatch::ReadableEvent;
+    return (_connectionState == WRITE_RESPONSE) 
+          ? XmlRpcDispatch::WritableEvent : XmlRpcDispatch::ReadableEvent;
+  }
 }
 
 
@@ -69,7 +179,7 @@ XmlRpcServerConnection::readHeader()
 {
   // Read available data
   bool eof;
-  if ( ! XmlRpcSocket::nbRead(this->getfd(), _header, &eof)) {
+  if ( ! XmlRpcSocket::nbRead(this->getfd(), _header, &eof, READ_BLOCK)) {
     // Its only an error if we already have read some data
     if (_header.length() > 0)
       XmlRpcUtil::error("XmlRpcServerConnection::readHeader: error while reading header (%s).",XmlRpcSocket::getErrorMsg().c_str());
@@ -77,25 +187,17 @@ XmlRpcServerConnection::readHeader()
   }
 
   XmlRpcUtil::log(4, "XmlRpcServerConnection::readHeader: read %d bytes.", _header.length());
-  char *hp = (char*)_header.c_str();  // Start of header
-  char *ep = hp + _header.length();   // End of string
-  char *bp = 0;                       // Start of body
-  char *lp = 0;                       // Start of content-length value
-  char *kp = 0;                       // Start of connection value
 
-  for (char *cp = hp; (bp == 0) && (cp < ep); ++cp) {
-	if ((ep - cp > 16) && (strncasecmp(cp, "Content-length: ", 16) == 0))
-	  lp = cp + 16;
-	else if ((ep - cp > 12) && (strncasecmp(cp, "Connection: ", 12) == 0))
-	  kp = cp + 12;
-	else if ((ep - cp > 4) && (strncmp(cp, "\r\n\r\n", 4) == 0))
-	  bp = cp + 4;
-	else if ((ep - cp > 2) && (strncmp(cp, "\n\n", 2) == 0))
-	  bp = cp + 2;
-  }
+  // Search for the end of the headers from where the last read left off
+  // (less the length of the separator, which may have been split)
+  std::string::size_type from = _headerScanned > 3 ? _headerScanned - 3 : 0;
+  std::string::size_type crlf = _header.find("\r\n\r\n", from);
+  std::string::size_type lf = _header.find("\n\n", from);
 
   // If we haven't gotten the entire header yet, return (keep reading)
-  if (bp == 0) {
+  if (crlf == std::string::npos && lf == std::string::npos) {
+    _headerScanned = int(_header.length());
+
     // EOF in the middle of a request is an error, otherwise its ok
     if (eof) {
       XmlRpcUtil::log(4, "XmlRpcServerConnection::readHeader: EOF");
@@ -107,26 +209,48 @@ XmlRpcServerConnection::readHeader()
     return true;  // Keep reading
   }
 
+  std::string::size_type end, body;   // End of the headers, start of the body
+  if (lf == std::string::npos || (crlf != std::string::npos && crlf < lf)) {
+    end = crlf;
+    body = crlf + 4;
+  } else {
+    end = lf;
+    body = lf + 2;
+  }
+
+  // The headers are scanned once, when they are complete
+  char *hp = (char*)_header.c_str();  // Start of header
+  char *ep = hp + end;                // End of header
+  char *lp = 0;                       // Start of content-length value
+  char *kp = 0;                       // Start of connection value
+
+  for (char *cp = hp; cp < ep; ++cp) {
+	if ((ep - cp > 16) && (strncasecmp(cp, "Content-length: ", 16) == 0))
+	  lp = cp + 16;
+	else if ((ep - cp > 12) && (strncasecmp(cp, "Connection: ", 12) == 0))
+	  kp = cp + 12;
+  }
+
   // Decode content length
   if (lp == 0) {
     XmlRpcUtil::error("XmlRpcServerConnection::readHeader: No Content-length specified");
     return false;   // We could try to figure it out by parsing as we read, but for now...
   }
 
-  _contentLength = atoi(lp);
+  _contentLength = atol(lp);
   if (_contentLength <= 0) {
-    XmlRpcUtil::error("XmlRpcServerConnection::readHeader: Invalid Content-length specified (%d).", _contentLength);
+    XmlRpcUtil::error("XmlRpcServerConnection::readHeader: Invalid Content-length specified (%ld).", _contentLength);
     return false;
   }
   	
-  XmlRpcUtil::log(3, "XmlRpcServerConnection::readHeader: specified content length is %d.", _contentLength);
-
-  // Otherwise copy non-header data to request buffer and set state to read request.
-  _request = bp;
+  XmlRpcUtil::log(3, "XmlRpcServerConnection::readHeader: specified content length is %ld.", _contentLength);
 
   // Parse out any interesting bits from the header (HTTP version, connection)
   _keepAlive = true;
-  if (_header.find("HTTP/1.0") != std::string::npos) {
+  _chunkedOk = true;
+  std::string::size_type version = _header.find("HTTP/1.0");
+  if (version != std::string::npos && version < end) {
+    _chunkedOk = false;
     if (kp == 0 || strncasecmp(kp, "keep-alive", 10) != 0)
       _keepAlive = false;           // Default for HTTP 1.0 is to close the connection
   } else {
@@ -135,8 +259,12 @@ XmlRpcServerConnection::readHeader()
   }
   XmlRpcUtil::log(3, "KeepAlive: %d", _keepAlive);
 
-
-  _header = ""; 
+  // Otherwise move non-header data to the request buffer and set state to read request.
+  _request = _header.substr(body);
+  _header = "";
+  _headerScanned = 0;
+  _requestOffset = 0;
+  _parseState = _contentLength >= SINK_MIN ? PARSE_NAME : PARSE_WHOLE;
   _connectionState = READ_REQUEST;
   return true;    // Continue monitoring this source
 }
@@ -144,8 +272,11 @@ XmlRpcServerConnection::readHeader()
 bool
 XmlRpcServerConnection::readRequest()
 {
+  if (_parseState != PARSE_WHOLE)
+    return readSinkRequest();
+
   // If we dont have the entire request yet, read available data
-  if (int(_request.length()) < _contentLength) {
+  if (long(_request.length()) < _contentLength) {
     bool eof;
     if ( ! XmlRpcSocket::nbRead(this->getfd(), _request, &eof)) {
       XmlRpcUtil::error("XmlRpcServerConnection::readRequest: read error (%s).",XmlRpcSocket::getErrorMsg().c_str());
@@ -153,7 +284,7 @@ XmlRpcServerConnection::readRequest()
     }
 
     // If we haven't gotten the entire request yet, return (keep reading)
-    if (int(_request.length()) < _contentLength) {
+    if (long(_request.length()) < _contentLength) {
       if (eof) {
         XmlRpcUtil::error("XmlRpcServerConnection::readRequest: EOF while reading request");
         return false;   // Either way we close the connection
@@ -162,45 +293,486 @@ XmlRpcServerConnection::readRequest()
     }
   }
 
+  // What follows the body belongs to the next requests of a pipelining client
+  _header = _request.substr(_contentLength);
+  _request.resize(_contentLength);
+
   // Otherwise, parse and dispatch the request
   XmlRpcUtil::log(3, "XmlRpcServerConnection::readRequest read %d bytes.", _request.length());
   //XmlRpcUtil::log(5, "XmlRpcServerConnection::readRequest:\n%s\n", _request.c_str());
 
-  _connectionState = WRITE_RESPONSE;
+  _methodName = parseRequest(_params);
+  _request = "";
+  startRequest();
 
   return true;    // Continue monitoring this source
 }
 
 
 bool
-XmlRpcServerConnection::writeResponse()
+XmlRpcServerConnection::readSinkRequest()
 {
-  if (_response.length() == 0) {
-    executeRequest();
-    _bytesWritten = 0;
-    if (_response.length() == 0) {
-      XmlRpcUtil::error("XmlRpcServerConnection::writeResponse: empty response.");
+  for (int blocks = 0; ; ++blocks) {
+    if ( ! parseSinkRequest())
+      return false;
+    if (_connectionState == WRITE_SINK)
+      return true;
+
+    if (_requestOffset + long(_request.length()) >= _contentLength)
+      break;
+
+    // Nothing has been dropped: read the rest as usual
+    if (_parseState == PARSE_WHOLE)
+      return readRequest();
+
+    if (blocks == READ_BLOCKS)
+      return true;        // Let the other connections have a go
+
+    bool eof;
+    std::string::size_type had = _request.length();
+    if ( ! XmlRpcSocket::nbRead(this->getfd(), _request, &eof, READ_BLOCK)) {
+      XmlRpcUtil::error("XmlRpcServerConnection::readRequest: read error (%s).",XmlRpcSocket::getErrorMsg().c_str());
       return false;
     }
+    if (_request.length() == had) {
+      if (eof) {
+        XmlRpcUtil::error("XmlRpcServerConnection::readRequest: EOF while reading request");
+        return false;
+      }
+      return true;        // Keep reading
+    }
   }
 
-  // Try to write the response
-  if ( ! XmlRpcSocket::nbWrite(this->getfd(), _response, &_bytesWritten)) {
-    XmlRpcUtil::error("XmlRpcServerConnection::writeResponse: write error (%s).",XmlRpcSocket::getErrorMsg().c_str());
+  // What follows the body belongs to the next requests of a pipelining client
+  std::string::size_type end = std::string::size_type(_contentLength - _requestOffset);
+  _header = _request.substr(end);
+  _request.resize(end);
+  XmlRpcUtil::log(3, "XmlRpcServerConnection::readRequest read %ld bytes.", _contentLength);
+
+  if (_parseState == PARSE_DATA) {
+    XmlRpcUtil::error("XmlRpcServerConnection::readRequest: unterminated value in a call of '%s'.", _methodName.c_str());
     return false;
   }
-  XmlRpcUtil::log(3, "XmlRpcServerConnection::writeResponse: wrote %d of %d bytes.", _bytesWritten, _response.length());
 
-  // Prepare to read the next request
-  if (_bytesWritten == int(_response.length())) {
-    _header = "";
-    _request = "";
-    _response = "";
-    _connectionState = READ_HEADER;
-  } else {
-    return true;        // Continue writing the response
+  if (_parseState == PARSE_NAME || _parseState == PARSE_WHOLE)
+    _methodName = parseRequest(_params);
+  else {
+    // The end of the value of the sink, then the params after it
+    int offset = 0;
+    if (_sink) {
+      (void) XmlRpcUtil::nextTagIs(_sinkType == XmlRpcValue::TypeBase64 ? BASE64_ETAG : STRING_ETAG, _request, &offset);
+      (void) XmlRpcUtil::nextTagIs(VALUE_ETAG, _request, &offset);
+      (void) XmlRpcUtil::nextTagIs(PARAM_ETAG, _request, &offset);
+    }
+    parseParams(_params, _nArgs, &offset);
+  }
+  _request = "";
+  _parseState = PARSE_WHOLE;
+  startRequest();
+
+  return true;    // Continue monitoring this source
+}
+
+
+// The parsed parts of the request are dropped, so the search for the next
+// one starts from the front of _request. A request whose method has no sink,
+// or which has too much before the value, is read whole after all.
+bool
+XmlRpcServerConnection::parseSinkRequest()
+{
+  std::string::size_type end = std::string::size_type(_contentLength - _requestOffset);
+  bool tooLong = long(_request.length()) > SINK_MIN;
+
+  if (_parseState == PARSE_NAME) {
+    int offset = 0;
+    if (_request.find(PARAMS_TAG) == std::string::npos) {
+      if (tooLong)
+        _parseState = PARSE_WHOLE;
+      return true;
+    }
+    _methodName = XmlRpcUtil::parseTag(METHODNAME_TAG, _request, &offset);
+    XmlRpcServerMethod* method = _server->findMethod(_methodName);
+    if ( ! method || method->sinkParam() < 0 ||
+         ! XmlRpcUtil::findTag(PARAMS_TAG, _request, &offset)) {
+      _parseState = PARSE_WHOLE;
+      return true;
+    }
+    _request.erase(0, offset);
+    _requestOffset += offset;
+    _nArgs = 0;
+    _sinkIndex = method->sinkParam();
+    _parseState = PARSE_PARAMS;
+  }
+
+  while (_parseState == PARSE_PARAMS && _nArgs < _sinkIndex) {
+    int offset = 0;
+    if (_request.find(PARAM_ETAG) == std::string::npos) {
+      if (tooLong)
+        _parseState = PARSE_REST;
+      return true;
+    }
+    if ( ! XmlRpcUtil::nextTagIs(PARAM_TAG, _request, &offset)) {
+      _parseState = PARSE_REST;   // Fewer params than that
+      return true;
+    }
+    _params[_nArgs++] = XmlRpcValue(_request, &offset);
+    (void) XmlRpcUtil::nextTagIs(PARAM_ETAG, _request, &offset);
+    _request.erase(0, offset);
+    _requestOffset += offset;
+  }
+
+  if (_parseState == PARSE_PARAMS) {
+    // Wait for the tag of the value's type
+    std::string::size_type v = _request.find(VALUE_TAG);
+    if (v == std::string::npos || _request.find('>', v + sizeof(VALUE_TAG) - 1) == std::string::npos) {
+      if (tooLong)
+        _parseState = PARSE_REST;
+      return true;
+    }
+
+    int offset = 0;
+    _sinkType = XmlRpcValue::TypeInvalid;
+    if (XmlRpcUtil::nextTagIs(PARAM_TAG, _request, &offset) &&
+        XmlRpcUtil::nextTagIs(VALUE_TAG, _request, &offset)) {
+      if (XmlRpcUtil::nextTagIs(BASE64_TAG, _request, &offset))
+        _sinkType = XmlRpcValue::TypeBase64;
+      else if (XmlRpcUtil::nextTagIs(STRING_TAG, _request, &offset))
+        _sinkType = XmlRpcValue::TypeString;
+    }
+    _parseState = PARSE_REST;
+    if (_sinkType == XmlRpcValue::TypeInvalid)
+      return true;
+
+    // The method may use the session of the client, as in a call
+    XmlRpcServerMethod* method = _server->findMethod(_methodName);
+    {
+      XmlRpcSession::Scope scope(&_session, &_cancelled);
+      _sink = method ? method->openSink(_params, _sinkType) : 0;
+    }
+    if ( ! _sink)
+      return true;
+
+    XmlRpcUtil::log(3, "XmlRpcServerConnection::parseSinkRequest: decoding parameter %d of '%s' into its sink.",
+                    _sinkIndex, _methodName.c_str());
+    _request.erase(0, offset);
+    _requestOffset += offset;
+    _params.setSize(_sinkIndex + 1);
+    _sinkFailed = false;
+    _parseState = PARSE_DATA;
+    end = std::string::size_type(_contentLength - _requestOffset);
+  }
+
+  if (_parseState == PARSE_DATA) {
+    // The value ends at the next tag, within the body
+    std::string::size_type n = _request.find('<');
+    if (n != std::string::npos && n < end) {
+      writeSink(n);
+      _nArgs = _sinkIndex + 1;
+      _parseState = PARSE_REST;
+      return true;
+    }
+
+    // Decode whole groups of base64, and no partial entity of a string
+    n = (_request.length() < end) ? _request.length() : end;
+    if (_sinkType == XmlRpcValue::TypeBase64) {
+      std::string::size_type whole = 0;
+      int chars = 0;
+      for (std::string::size_type i = 0; i < n; ++i) {
+        char c = _request[i];
+        if (isalnum((unsigned char) c) || c == '+' || c == '/' || c == '=')
+          if (++chars % 4 == 0)
+            whole = i + 1;
+      }
+      n = whole;
+    } else if (n > 0) {
+      std::string::size_type amp = _request.rfind('&', n - 1);
+      if (amp != std::string::npos && _request.find(';', amp) >= n)
+        n = amp;
+    }
+    writeSink(n);
+  }
+
+  return true;
+}
+
+
+void
+XmlRpcServerConnection::writeSink(std::string::size_type n)
+{
+  if (n == 0)
+    return;
+
+  if ( ! _sinkFailed) {
+    _sinkBuf.clear();
+    if (_sinkType == XmlRpcValue::TypeBase64) {
+      _sinkBuf.reserve(n / 4 * 3);
+      int iostatus = 0;
+      base64<char> decoder;
+      std::back_insert_iterator<std::string> ins = std::back_inserter(_sinkBuf);
+      decoder.get(_request.begin(), _request.begin() + n, ins, iostatus);
+    } else
+      _sinkBuf = XmlRpcUtil::xmlDecode(_request.substr(0, n));
+  }
+  _request.erase(0, n);
+  _requestOffset += long(n);
+  if (_sinkFailed || _sinkBuf.empty())
+    return;
+
+  // The sink may do file IO, which is left to the workers. Reading stops
+  // until the block is written, so a slow sink holds back its client.
+  if (_server->getWorkerThreads() > 0) {
+    _connectionState = WRITE_SINK;
+    setKeepOpen(true);
+    _server->submit(&_writeSink);
+    return;
+  }
+  sinkWrite();
+}
+
+
+// Run on a worker thread when the server has any: only the sink is touched
+void
+XmlRpcServerConnection::sinkWrite()
+{
+  if ( ! _sink->write(_sinkBuf.data(), int(_sinkBuf.size()))) {
+    XmlRpcUtil::log(2, "XmlRpcServerConnection::sinkWrite: the sink of '%s' failed.", _methodName.c_str());
+    _sinkFailed = true;
+  }
+  _sinkBuf.clear();
+}
+
+
+// Back on the dispatcher thread. The rest of the request may be read
+// already, so the connection is resumed as writable to be parsed at once.
+void
+XmlRpcServerConnection::sinkWritten()
+{
+  setKeepOpen(false);
+  _connectionState = READ_REQUEST;
+  _server->resumeConnection(this);
+}
+
+
+void
+XmlRpcServerConnection::startRequest()
+{
+  // The connection stays open while it is not monitored. This must be
+  // set before a worker or a deferred call may complete the request.
+  _connectionState = EXECUTE_REQUEST;
+  setKeepOpen(true);
+  _server->recordRequest();
+
+  if (_server->queueRequest(this, _methodName, _params))
+    return;
+
+  // An additional reactor leaves deferred methods to its home
+  XmlRpcServer* home = _server->getHome();
+  if (home != _server) {
+    XmlRpcServerMethod* method = _server->findMethod(_methodName);
+    if (method && method->execution() == XmlRpcServerMethod::Deferred) {
+      _atHome = true;
+      home->post(&_executeAtHome);
+      return;
+    }
+  }
+
+  executeRequest();
+  if (_response.length() > 0) {
+    setKeepOpen(false);
+    _bytesWritten = 0;
+    _connectionState = WRITE_RESPONSE;
+  }
+}
+
+
+// Send an interim response, which an HTTP/1.1 client skips, so that a client
+// which has closed the connection resets it. False if the write fails, or
+// for an HTTP/1.0 client, which has no interim responses and ends the
+// request by closing the connection, not by shutting down its side.
+bool
+XmlRpcServerConnection::probeClient()
+{
+  if ( ! _chunkedOk)
+    return false;
+  std::string probe = "HTTP/1.1 100 Continue\r\n\r\n";
+  int written = 0;
+  if ( ! XmlRpcSocket::nbWrite(this->getfd(), probe, &written)) {
+    XmlRpcUtil::log(3, "XmlRpcServerConnection::probeClient: write error (%s).", XmlRpcSocket::getErrorMsg().c_str());
+    return false;
+  }
+  return true;
+}
+
+
+void
+XmlRpcServerConnection::cancelRequest()
+{
+  XmlRpcUtil::log(2, "XmlRpcServerConnection::cancelRequest: client of socket %d has gone, cancelling '%s'.",
+                  getfd(), _methodName.c_str());
+  _cancelled = true;
+  _server->recordCancel();
+
+  if (_atHome) {
+    _cancelling = true;
+    _server->getHome()->post(&_cancelAtHome);
+    return;
   }
 
+  // The work may answer at once, which resumes the connection
+  XmlRpcCancellable* c = _cancellable;
+  _cancellable = 0;
+  if (c)
+    c->cancel();
+}
+
+
+void
+XmlRpcServerConnection::resume()
+{
+  if (_atHome)
+    _server->post(this);
+  else
+    complete();
+}
+
+
+void
+XmlRpcServerConnection::executeAtHome()
+{
+  executeRequest();
+  if (_response.length() > 0) {
+    _bytesWritten = 0;
+    resume();
+  }
+}
+
+
+void
+XmlRpcServerConnection::cancelAtHome()
+{
+  XmlRpcCancellable* c = _cancellable;
+  _cancellable = 0;
+  if (c)
+    c->cancel();
+  _server->post(&_cancelDone);
+}
+
+
+void
+XmlRpcServerConnection::cancelDone()
+{
+  _cancelling = false;
+  if (_resumePending) {
+    _resumePending = false;
+    complete();
+  }
+}
+
+
+// Run on a worker thread: only the request and response are touched
+void
+XmlRpcServerConnection::run()
+{
+  executeRequest();
+  _bytesWritten = 0;
+}
+
+
+// Back on the dispatcher thread
+void
+XmlRpcServerConnection::complete()
+{
+  // The home still refers to the connection
+  if (_cancelling) {
+    _resumePending = true;
+    return;
+  }
+  _atHome = false;
+  setKeepOpen(false);
+  _connectionState = WRITE_RESPONSE;
+  _server->resumeConnection(this);
+}
+
+
+// A deferred method has its result
+void
+XmlRpcServerConnection::succeed(XmlRpcValue& result)
+{
+  _cancellable = 0;
+  if ( ! result.valid())
+    result = std::string();
+  generateResponse(result.toXml());
+  _bytesWritten = 0;
+  resume();
+}
+
+
+void
+XmlRpcServerConnection::fail(std::string const& msg, int errorCode)
+{
+  XmlRpcUtil::log(2, "XmlRpcServerConnection::fail: fault %s.", msg.c_str());
+  _cancellable = 0;
+  generateFaultResponse(msg, errorCode);
+  _bytesWritten = 0;
+  resume();
+}
+
+
+XmlRpcDispatch*
+XmlRpcServerConnection::dispatch()
+{
+  return _server->getHome()->getDispatch();
+}
+
+
+void
+XmlRpcServerConnection::setCancellable(XmlRpcCancellable* c)
+{
+  _cancellable = _cancelled ? 0 : c;
+  if (c && _cancelled)
+    c->cancel();
+}
+
+
+bool
+XmlRpcServerConnection::writeResponse()
+{
+  if (_response.length() == 0) {
+    XmlRpcUtil::error("XmlRpcServerConnection::writeResponse: empty response.");
+    return false;
+  }
+
+  // Try to write the response, refilling it from a streamed result
+  for (int pieces = 0; ; ++pieces) {
+    if ( ! XmlRpcSocket::nbWrite(this->getfd(), _response, &_bytesWritten)) {
+      XmlRpcUtil::error("XmlRpcServerConnection::writeResponse: write error (%s).",XmlRpcSocket::getErrorMsg().c_str());
+      return false;
+    }
+    XmlRpcUtil::log(3, "XmlRpcServerConnection::writeResponse: wrote %d of %d bytes.", _bytesWritten, _response.length());
+
+    if (_bytesWritten < int(_response.length()))
+      return true;        // Continue writing the response
+    if ( ! _stream)
+      break;
+    if (pieces == STREAM_PIECES)
+      return true;        // Let the other connections have a go
+
+    // The stream may do file IO, which is left to the workers
+    if (_server->getWorkerThreads() > 0) {
+      _connectionState = READ_STREAM;
+      setKeepOpen(true);
+      _server->submit(&_fillStream);
+      return true;
+    }
+    if ( ! readStream())
+      return false;
+  }
+
+  // Prepare to read the next request
+  _request = "";
+  _response = "";
+  _connectionState = READ_HEADER;
+
   return _keepAlive;    // Continue monitoring this source if true
 }
 
@@ -208,17 +780,32 @@ XmlRpcServerConnection::writeResponse()
 void
 XmlRpcServerConnection::executeRequest()
 {
-  XmlRpcValue params, resultValue;
-  std::string methodName = parseRequest(params);
+  XmlRpcValue resultValue;
+  std::string const& methodName = _methodName;
+  XmlRpcValue& params = _params;
   XmlRpcUtil::log(2, "XmlRpcServerConnection::executeRequest: server calling method '%s'", 
                     methodName.c_str());
 
+  // Requests of a connection are executed one at a time, so the
+  // session is never used by two threads at once
+  XmlRpcSession::Scope scope(&_session, &_cancelled);
+
   try {
 
-    if ( ! executeMethod(methodName, params, resultValue) &&
+    bool pending = false;
+    XmlRpcStream* stream = 0;
+    if (_sink) {
+      _sink->finish(params, resultValue);
+      if ( ! resultValue.valid())
+        resultValue = std::string();
+      generateResponse(resultValue.toXml());
+    }
+    else if ( ! executeMethod(methodName, params, resultValue, &pending, &stream) &&
          ! executeMulticall(methodName, params, resultValue))
       generateFaultResponse(methodName + ": unknown method name");
-    else
+    else if (stream)
+      generateStreamResponse(stream);
+    else if ( ! pending)
       generateResponse(resultValue.toXml());
 
   } catch (const XmlRpcException& fault) {
@@ -226,6 +813,9 @@ XmlRpcServerConnection::executeRequest()
                     fault.getMessage().c_str()); 
     generateFaultResponse(fault.getMessage(), fault.getCode());
   }
+  _params.clear();
+  delete _sink;
+  _sink = 0;
 }
 
 // Parse the method name and the argument values from the request.
@@ -237,29 +827,42 @@ XmlRpcServerConnection::parseRequest(XmlRpcValue& params)
   std::string methodName = XmlRpcUtil::parseTag(METHODNAME_TAG, _request, &offset);
 
   if (methodName.size() > 0 && XmlRpcUtil::findTag(PARAMS_TAG, _request, &offset))
-  {
-    int nArgs = 0;
-    while (XmlRpcUtil::nextTagIs(PARAM_TAG, _request, &offset)) {
-      params[nArgs++] = XmlRpcValue(_request, &offset);
-      (void) XmlRpcUtil::nextTagIs(PARAM_ETAG, _request, &offset);
-    }
+    parseParams(params, 0, &offset);
+
+  return methodName;
+}
 
-    (void) XmlRpcUtil::nextTagIs(PARAMS_ETAG, _request, &offset);
+void
+XmlRpcServerConnection::parseParams(XmlRpcValue& params, int nArgs, int* offset)
+{
+  while (XmlRpcUtil::nextTagIs(PARAM_TAG, _request, offset)) {
+    params[nArgs++] = XmlRpcValue(_request, offset);
+    (void) XmlRpcUtil::nextTagIs(PARAM_ETAG, _request, offset);
   }
 
-  return methodName;
+  (void) XmlRpcUtil::nextTagIs(PARAMS_ETAG, _request, offset);
 }
 
 // Execute a named method with the specified params.
 bool
 XmlRpcServerConnection::executeMethod(const std::string& methodName, 
-                                      XmlRpcValue& params, XmlRpcValue& result)
+                                      XmlRpcValue& params, XmlRpcValue& result,
+                                      bool* pending, XmlRpcStream** stream)
 {
   XmlRpcServerMethod* method = _server->findMethod(methodName);
 
   if ( ! method) return false;
 
-  method->execute(params, result);
+  if (pending && method->execution() == XmlRpcServerMethod::Deferred) {
+    *pending = ! method->executeDeferred(params, result, this);
+    if (*pending)
+      return true;
+  } else if (stream) {
+    *stream = method->executeStream(params, result);
+    if (*stream)
+      return true;
+  } else
+    method->execute(params, result);
 
   // Ensure a valid result value
   if ( ! result.valid())
@@ -273,6 +876,11 @@ bool
 XmlRpcServerConnection::executeMulticall(const std::string& methodName, 
                                          XmlRpcValue& params, XmlRpcValue& result)
 {
+  if (methodName == SYSTEM_MULTICALL_PARALLEL) {
+    executeMulticallParallel(params, result);
+    return true;
+  }
+
   if (methodName != SYSTEM_MULTICALL) return false;
 
   // There ought to be 1 parameter, an array of structs
@@ -282,38 +890,141 @@ XmlRpcServerConnection::executeMulticall(const std::string& methodName,
   int nc = params[0].size();
   result.setSize(nc);
 
-  for (int i=0; i<nc; ++i) {
+  for (int i=0; i<nc; ++i)
+    executeSubcall(params[0][i], result[i]);
 
-    if ( ! params[0][i].hasMember(METHODNAME) ||
-         ! params[0][i].hasMember(PARAMS)) {
-      result[i][FAULTCODE] = -1;
-      result[i][FAULTSTRING] = SYSTEM_MULTICALL +
-              ": Invalid argument (expected a struct with members methodName and params)";
-      continue;
-    }
+  return true;
+}
 
-    const std::string& methodName = params[0][i][METHODNAME];
-    XmlRpcValue& methodParams = params[0][i][PARAMS];
-
-    XmlRpcValue resultValue;
-    resultValue.setSize(1);
-    try {
-      if ( ! executeMethod(methodName, methodParams, resultValue[0]) &&
-           ! executeMulticall(methodName, params, resultValue[0]))
-      {
-        result[i][FAULTCODE] = -1;
-        result[i][FAULTSTRING] = methodName + ": unknown method name";
-      }
-      else
-        result[i] = resultValue;
 
-    } catch (const XmlRpcException& fault) {
-        result[i][FAULTCODE] = fault.getCode();
-        result[i][FAULTSTRING] = fault.getMessage();
+void
+XmlRpcServerConnection::executeSubcall(XmlRpcValue& call, XmlRpcValue& result)
+{
+  if ( ! call.hasMember(METHODNAME) || ! call.hasMember(PARAMS)) {
+    result[FAULTCODE] = -1;
+    result[FAULTSTRING] = SYSTEM_MULTICALL +
+            ": Invalid argument (expected a struct with members methodName and params)";
+    return;
+  }
+
+  XmlRpcValue resultValue;
+  resultValue.setSize(1);
+  try {
+    const std::string& methodName = call[METHODNAME];
+    XmlRpcValue& methodParams = call[PARAMS];
+
+    if ( ! executeMethod(methodName, methodParams, resultValue[0]) &&
+         ! executeMulticall(methodName, methodParams, resultValue[0]))
+    {
+      result[FAULTCODE] = -1;
+      result[FAULTSTRING] = methodName + ": unknown method name";
     }
+    else
+      result = resultValue;
+
+  } catch (const XmlRpcException& fault) {
+      result[FAULTCODE] = fault.getCode();
+      result[FAULTSTRING] = fault.getMessage();
   }
+}
 
-  return true;
+
+// Runs the calls _first.. of a parallel multicall, each under the session
+// of the connection, which the methods may read but not change
+class XmlRpcServerConnection::Subcalls : public XmlRpcThreadPool::Batch {
+public:
+  Subcalls(XmlRpcServerConnection* conn, XmlRpcValue& calls, XmlRpcValue& results,
+           std::vector<double>& times) :
+    _conn(conn), _calls(calls), _results(results), _times(times), _first(0) {}
+
+  void run(int first, int n)
+  {
+    _first = first;
+    _conn->_server->runBatch(this, n);
+  }
+
+  virtual void runItem(int item)
+  {
+    int i = _first + item;
+    XmlRpcSession::Scope scope(&_conn->_session, &_conn->_cancelled);
+    double t0 = XmlRpcDispatch::getTime();
+    if (_conn->_cancelled) {
+      _results[i][FAULTCODE] = -1;
+      _results[i][FAULTSTRING] = SYSTEM_MULTICALL_PARALLEL + ": the client has disconnected";
+    } else
+      _conn->executeSubcall(_calls[i], _results[i]);
+    _times[i] = XmlRpcDispatch::getTime() - t0;
+  }
+
+private:
+  XmlRpcServerConnection* _conn;
+  XmlRpcValue& _calls;
+  XmlRpcValue& _results;
+  std::vector<double>& _times;
+  int _first;
+};
+
+
+void
+XmlRpcServerConnection::executeMulticallParallel(XmlRpcValue& params, XmlRpcValue& result)
+{
+  // An array of structs, and optionally a struct of options
+  if (params.size() < 1 || params.size() > 2 || params[0].getType() != XmlRpcValue::TypeArray ||
+      (params.size() == 2 && params[1].getType() != XmlRpcValue::TypeStruct))
+    throw XmlRpcException(SYSTEM_MULTICALL_PARALLEL + ": Invalid argument (expected an array and an optional struct)");
+
+  bool timings = false;
+  if (params.size() == 2 && params[1].hasMember("timings")) {
+    XmlRpcValue& t = params[1]["timings"];
+    timings = t.getType() == XmlRpcValue::TypeBoolean ? bool(t) :
+              t.getType() == XmlRpcValue::TypeInt && int(t) != 0;
+  }
+
+  XmlRpcValue& calls = params[0];
+  int nc = calls.size();
+  XmlRpcValue results;
+  results.setSize(nc);    // Not resized while the workers fill it in
+  std::vector<double> times(nc);
+
+  double t0 = XmlRpcDispatch::getTime();
+  Subcalls subcalls(this, calls, results, times);
+  int batches = 0;
+  for (int first = 0; first < nc; ++batches) {
+    int end = first + 1;
+    if (isParallelSafe(calls[first]))
+      while (end < nc && isParallelSafe(calls[end]))
+        ++end;
+    subcalls.run(first, end - first);
+    first = end;
+  }
+
+  if ( ! timings) {
+    result = results;
+    return;
+  }
+  result["results"] = results;
+  XmlRpcValue& diagnostics = result["diagnostics"];
+  diagnostics["elapsed"] = XmlRpcDispatch::getTime() - t0;
+  diagnostics["batches"] = batches;
+  XmlRpcValue& t = diagnostics["timings"];
+  t.setSize(nc);
+  for (int i = 0; i < nc; ++i)
+    t[i] = times[i];
+}
+
+
+// Methods which are not parallel safe, and nested multicalls, run on their own
+bool
+XmlRpcServerConnection::isParallelSafe(XmlRpcValue& call)
+{
+  if ( ! call.hasMember(METHODNAME) || call[METHODNAME].getType() != XmlRpcValue::TypeString)
+    return true;    // Answered with a fault
+
+  const std::string& methodName = call[METHODNAME];
+  if (methodName == SYSTEM_MULTICALL || methodName == SYSTEM_MULTICALL_PARALLEL)
+    return false;
+  XmlRpcServerMethod* method = _server->findMethod(methodName);
+  return ! method || method->parallelSafe();
 }
 
 
@@ -321,12 +1032,6 @@ XmlRpcServerConnection::executeMulticall(const std::string& methodName,
 void
 XmlRpcServerConnection::generateResponse(std::string const& resultXml)
 {
-  const char RESPONSE_1[] = 
-    "<?xml version=\"1.0\"?>\r\n"
-    "<methodResponse><params><param>\r\n\t";
-  const char RESPONSE_2[] =
-    "\r\n</param></params></methodResponse>\r\n";
-
   std::string body = RESPONSE_1 + resultXml + RESPONSE_2;
   std::string header = generateHeader(body);
 
@@ -334,6 +1039,115 @@ XmlRpcServerConnection::generateResponse(std::string const& resultXml)
   XmlRpcUtil::log(5, "XmlRpcServerConnection::generateResponse:\n%s\n", _response.c_str()); 
 }
 
+// Append a piece of a streamed response, as a chunk if it is sent in chunks
+static void
+appendPiece(std::string& response, std::string const& piece, bool chunked)
+{
+  if ( ! chunked) {
+    response += piece;
+    return;
+  }
+  char size[20];
+  sprintf(size, "%lx\r\n", (unsigned long) piece.size());
+  response += size;
+  response += piece;
+  response += "\r\n";
+}
+
+
+// Start a response whose result is streamed. Without its length in advance
+// it is sent in chunks, or (to an HTTP/1.0 client) up to the end of the connection.
+void
+XmlRpcServerConnection::generateStreamResponse(XmlRpcStream* stream)
+{
+  _stream = stream;
+  _streamLeft = stream->length();
+  _chunked = _streamLeft < 0 && _chunkedOk;
+
+  _response =
+    "HTTP/1.1 200 OK\r\n"
+    "Server: ";
+  _response += XMLRPC_VERSION;
+  _response += "\r\n"
+    "Content-Type: text/xml\r\n";
+  if (_streamLeft >= 0) {
+    char buffLen[60];
+    sprintf(buffLen, "Content-length: %ld\r\n\r\n",
+            long(sizeof(RESPONSE_1) - 1 + _streamLeft + sizeof(RESPONSE_2) - 1));
+    _response += buffLen;
+  } else if (_chunked) {
+    _response += "Transfer-Encoding: chunked\r\n\r\n";
+  } else {
+    _response += "Connection: close\r\n\r\n";
+    _keepAlive = false;
+  }
+  appendPiece(_response, RESPONSE_1, _chunked);
+}
+
+
+// Replace the response written with the next piece of the stream
+bool
+XmlRpcServerConnection::readStream()
+{
+  fillStream();
+  return streamPiece();
+}
+
+
+// Run on a worker thread when the server has any: only the stream is touched
+void
+XmlRpcServerConnection::fillStream()
+{
+  _streamBuf.clear();
+  _streamRead = _stream->read(_streamBuf);
+}
+
+
+// Back on the dispatcher thread. A stream which has failed closes the
+// connection, as if its client had gone.
+void
+XmlRpcServerConnection::streamFilled()
+{
+  if ( ! streamPiece())
+    _cancelled = true;
+  setKeepOpen(false);
+  _connectionState = WRITE_RESPONSE;
+  _server->resumeConnection(this);
+}
+
+
+bool
+XmlRpcServerConnection::streamPiece()
+{
+  _response.clear();
+  _bytesWritten = 0;
+  int n = _streamRead;
+
+  // A stream must produce the length it gave
+  if (n < 0 || (_streamLeft >= 0 && (n > _streamLeft || (n == 0 && _streamLeft > 0)))) {
+    XmlRpcUtil::error("XmlRpcServerConnection::streamPiece: the result stream of '%s' failed.", _methodName.c_str());
+    return false;
+  }
+
+  if (n > 0) {
+    if (_streamLeft >= 0)
+      _streamLeft -= n;
+    if (_chunked)
+      appendPiece(_response, _streamBuf, true);
+    else
+      _response.swap(_streamBuf);
+    return true;
+  }
+
+  delete _stream;
+  _stream = 0;
+  appendPiece(_response, RESPONSE_2, _chunked);
+  if (_chunked)
+    _response += "0\r\n\r\n";
+  return true;
+}
+
+
 // Prepend http headers
 std::string
 XmlRpcServerConnection::generateHeader(std::string const& body)
@@ -12,7 +12,9 @@
 #endif
 
 #include "XmlRpcValue.h"
+#include "XmlRpcServerMethod.h"
 #include "XmlRpcSource.h"
+#include "XmlRpcThreadPool.h"
 
 namespace XmlRpc {
 
@@ -21,8 +23,11 @@ namespace XmlRpc {
   class XmlRpcServer;
   class XmlRpcServerMethod;
 
-  //! A class to handle XML RPC requests from a particular client
-  class XmlRpcServerConnection : public XmlRpcSource {
+  //! A class to handle XML RPC requests from a particular client.
+  //! Requests for blocking methods are executed as thread pool jobs,
+  //! and deferred methods answer through the connection's XmlRpcDeferred interface.
+  class XmlRpcServerConnection : public XmlRpcSource, public XmlRpcThreadPool::Job,
+                                 public XmlRpcDeferred {
   public:
     // Static data
     static const char METHODNAME_TAG[];
@@ -32,6 +37,7 @@ namespace XmlRpc {
     static const char PARAM_ETAG[];
 
     static const std::string SYSTEM_MULTICALL;
+    static const std::string SYSTEM_MULTICALL_PARALLEL;
     static const std::string METHODNAME;
     static const std::string PARAMS;
 
@@ -48,26 +54,129 @@ namespace XmlRpc {
     //!   @param eventType Type of IO event that occurred. @see XmlRpcDispatch::EventType.
     virtual unsigned handleEvent(unsigned eventType);
 
+    // XmlRpcThreadPool::Job interface implementation
+    //! Execute the request on a worker thread
+    virtual void run();
+    //! Resume writing the response once the worker is done
+    virtual void complete();
+
+    // XmlRpcDeferred interface implementation
+    //! Answer a deferred call with a result
+    virtual void succeed(XmlRpcValue& result);
+    //! Answer a deferred call with a fault
+    virtual void fail(std::string const& msg, int errorCode = -1);
+    //! The dispatcher running the deferred calls of this connection, which
+    //! belongs to the home of its server (see XmlRpcServer::getHome)
+    virtual XmlRpcDispatch* dispatch();
+    //! Register the work to stop if the client disconnects
+    virtual void setCancellable(XmlRpcCancellable* c);
+
   protected:
 
+    // A member function of the connection, posted as a job to the
+    // dispatcher thread of a server, after another on a worker if given
+    class Call : public XmlRpcThreadPool::Job {
+    public:
+      Call(XmlRpcServerConnection* conn, void (XmlRpcServerConnection::*fn)(),
+           void (XmlRpcServerConnection::*work)() = 0) :
+        _conn(conn), _fn(fn), _work(work) {}
+      virtual void run() { if (_work) (_conn->*_work)(); }
+      virtual void complete() { (_conn->*_fn)(); }
+    private:
+      XmlRpcServerConnection* _conn;
+      void (XmlRpcServerConnection::*_fn)();
+      void (XmlRpcServerConnection::*_work)();
+    };
+
     bool readHeader();
     bool readRequest();
     bool writeResponse();
 
-    // Parses the request, runs the method, generates the response xml.
+    // Read a large request a block at a time, parsing it as it arrives
+    bool readSinkRequest();
+
+    // Parse what has arrived of a large request, decoding the value of a
+    // parameter with a sink into it; false if the request is malformed.
+    bool parseSinkRequest();
+
+    // Decode the first n bytes of the value of the sink, and drop them.
+    // The decoded block is written by sinkWrite(), on a worker if the server
+    // has any; the connection is not read meanwhile.
+    void writeSink(std::string::size_type n);
+    void sinkWrite();
+
+    // Back on the dispatcher thread once a worker has written a block
+    void sinkWritten();
+
+    // Execute the parsed request, unless it is queued for a worker
+    // or its method defers the response.
+    void startRequest();
+
+    // The client has shut down its side of the connection while its request
+    // was executing: check whether it is still there.
+    bool probeClient();
+
+    // The client has disconnected while its request was executing.
+    void cancelRequest();
+
+    // Hand an answered request back to the thread monitoring the connection
+    void resume();
+
+    // On the home thread of an additional reactor: execute a deferred
+    // request, or cancel it and acknowledge the cancellation
+    void executeAtHome();
+    void cancelAtHome();
+
+    // Back on the reactor thread once the home has cancelled the request
+    void cancelDone();
+
+    // Runs the parsed method, generates the response xml. The response
+    // stays empty if the method deferred it.
     virtual void executeRequest();
 
     // Parse the methodName and parameters from the request.
     std::string parseRequest(XmlRpcValue& params);
 
-    // Execute a named method with the specified params.
-    bool executeMethod(const std::string& methodName, XmlRpcValue& params, XmlRpcValue& result);
+    // Parse the parameters of the request from *offset on, numbered from nArgs.
+    void parseParams(XmlRpcValue& params, int nArgs, int* offset);
+
+    // Execute a named method with the specified params. If pending is given,
+    // a Deferred method may defer its result, which sets *pending, and any
+    // other method may stream it, which sets *stream.
+    bool executeMethod(const std::string& methodName, XmlRpcValue& params, XmlRpcValue& result,
+                       bool* pending = 0, XmlRpcStream** stream = 0);
 
     // Execute multiple calls and return the results in an array.
     bool executeMulticall(const std::string& methodName, XmlRpcValue& params, XmlRpcValue& result);
 
+    // Execute the calls of a system.multicall_parallel on the workers, in
+    // batches separated by the calls which are not parallel safe.
+    void executeMulticallParallel(XmlRpcValue& params, XmlRpcValue& result);
+
+    // Execute one call of a multicall: result becomes an array of the
+    // method's result, or a fault struct.
+    void executeSubcall(XmlRpcValue& call, XmlRpcValue& result);
+
+    // Whether a call of a multicall may run alongside the others
+    bool isParallelSafe(XmlRpcValue& call);
+
+    // The calls of a system.multicall_parallel, run by the workers
+    class Subcalls;
+    friend class Subcalls;
+
     // Construct a response from the result XML.
     void generateResponse(std::string const& resultXml);
+    // Construct the start of a response whose result XML is streamed, and
+    // refill the response with the next piece; false on error. The piece is
+    // read by fillStream(), on a worker if the server has any, and then
+    // put in the response by streamPiece().
+    void generateStreamResponse(XmlRpcStream* stream);
+    bool readStream();
+    void fillStream();
+    bool streamPiece();
+
+    // Back on the dispatcher thread once a worker has read a piece
+    void streamFilled();
     void generateFaultResponse(std::string const& msg, int errorCode = -1);
     std::string generateHeader(std::string const& body);
 
@@ -75,19 +184,56 @@ namespace XmlRpc {
     // The XmlRpc server that accepted this connection
     XmlRpcServer* _server;
 
-    // Possible IO states for the connection
-    enum ServerConnectionState { READ_HEADER, READ_REQUEST, WRITE_RESPONSE };
+    // Possible IO states for the connection. While executing a request on a
+    // worker or waiting for a deferred response the connection is only
+    // monitored for a hangup of the client, and while a worker writes a
+    // block of a large request or reads the next piece of a streamed
+    // response it is not monitored.
+    enum ServerConnectionState { READ_HEADER, READ_REQUEST, EXECUTE_REQUEST, WRITE_RESPONSE, READ_STREAM, WRITE_SINK };
     ServerConnectionState _connectionState;
 
-    // Request headers
+    // Request headers, and what a pipelining client sent after the body
+    // of the request being executed
     std::string _header;
 
+    // Bytes of _header searched for the end of the headers so far
+    int _headerScanned;
+
     // Number of bytes expected in the request body (parsed from header)
-    int _contentLength;
+    long _contentLength;
 
     // Request body
     std::string _request;
 
+    // How far a large request is parsed while it is read. Parsed parameters
+    // (and the parts of the value decoded into a sink) are dropped from the
+    // front of _request.
+    enum ParseState {
+      PARSE_WHOLE,    // parse the whole request once it is read
+      PARSE_NAME,     // waiting for the method name and the start of the params
+      PARSE_PARAMS,   // parsing the params before the one with a sink
+      PARSE_DATA,     // decoding the value into the sink
+      PARSE_REST      // parse the remaining params once the request is read
+    };
+    ParseState _parseState;
+
+    // Bytes of the body dropped from _request, and the params parsed
+    long _requestOffset;
+    int _nArgs;
+
+    // The sink of a large parameter, its index and type, and whether it
+    // has failed (what is left of the value is then dropped), and the
+    // decoded block being written
+    XmlRpcSink* _sink;
+    int _sinkIndex;
+    int _sinkType;
+    bool _sinkFailed;
+    std::string _sinkBuf;
+
+    // Parsed request
+    std::string _methodName;
+    XmlRpcValue _params;
+
     // Response
     std::string _response;
 
@@ -96,6 +242,46 @@ namespace XmlRpc {
 
     // Whether to keep the current client connection open for further requests
     bool _keepAlive;
+
+    // Whether the client can take a chunked response (HTTP/1.1)
+    bool _chunkedOk;
+
+    // The streamed result being written, whether it is sent in chunks, the
+    // bytes it has still to produce if its length was given (else -1), and
+    // the buffer of the piece to send next with what the stream returned
+    XmlRpcStream* _stream;
+    bool _chunked;
+    long _streamLeft;
+    std::string _streamBuf;
+    int _streamRead;
+
+    // State the methods keep for this client, 0 until one creates it
+    XmlRpcSession* _session;
+
+    // Set when the client disconnects while a request executes; the
+    // response is dropped and the connection closed
+    volatile bool _cancelled;
+
+    // The work of a deferred request to stop in that case
+    XmlRpcCancellable* _cancellable;
+
+    // Set while a deferred request runs on the home of the server,
+    // and while a cancellation is on its way there and back. The
+    // connection is not resumed before the cancellation is done.
+    bool _atHome;
+    bool _cancelling;
+    bool _resumePending;
+
+    // Jobs posted to the home and back
+    Call _executeAtHome;
+    Call _cancelAtHome;
+    Call _cancelDone;
+
+    // Reads the next piece of a streamed response on a worker
+    Call _fillStream;
+
+    // Writes a block of a large request to its sink on a worker
+    Call _writeSink;
   };
 } // namespace XmlRpc
 
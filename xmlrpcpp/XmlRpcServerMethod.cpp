@@ -2,8 +2,78 @@
 #include "XmlRpcServerMethod.h"
 #include "XmlRpcServer.h"
 
+#ifndef MAKEDEPEND
+# if ! defined(_WINDOWS)
+#  include <pthread.h>
+# endif
+#endif
+
 namespace XmlRpc {
 
+  // The scope of the call a thread executes, which holds the session slot
+  // of its connection. There are no worker threads on Windows, so one will do.
+#if ! defined(_WINDOWS)
+  static pthread_key_t currentScope;
+  static pthread_once_t currentOnce = PTHREAD_ONCE_INIT;
+
+  static void createScopeKey() { pthread_key_create(&currentScope, 0); }
+
+  static XmlRpcSession::Scope* getScope()
+  {
+    pthread_once(&currentOnce, createScopeKey);
+    return (XmlRpcSession::Scope*) pthread_getspecific(currentScope);
+  }
+
+  static void setScope(XmlRpcSession::Scope* scope)
+  {
+    pthread_once(&currentOnce, createScopeKey);
+    pthread_setspecific(currentScope, scope);
+  }
+#else
+  static XmlRpcSession::Scope* currentScope = 0;
+
+  static XmlRpcSession::Scope* getScope() { return currentScope; }
+  static void setScope(XmlRpcSession::Scope* scope) { currentScope = scope; }
+#endif
+
+  XmlRpcSession* XmlRpcSession::current()
+  {
+    Scope* scope = getScope();
+    return scope && scope->_slot ? *scope->_slot : 0;
+  }
+
+  bool XmlRpcSession::setCurrent(XmlRpcSession* s)
+  {
+    Scope* scope = getScope();
+    if ( ! scope || ! scope->_slot) {
+      delete s;
+      return false;
+    }
+    XmlRpcSession** slot = scope->_slot;
+    if (*slot != s) {
+      delete *slot;
+      *slot = s;
+    }
+    return true;
+  }
+
+  bool XmlRpcSession::clientGone()
+  {
+    Scope* scope = getScope();
+    return scope && scope->_gone && *scope->_gone;
+  }
+
+  XmlRpcSession::Scope::Scope(XmlRpcSession** slot, const volatile bool* gone) :
+    _slot(slot), _gone(gone), _prev(getScope())
+  {
+    setScope(this);
+  }
+
+  XmlRpcSession::Scope::~Scope()
+  {
+    setScope(_prev);
+  }
+
 
   XmlRpcServerMethod::XmlRpcServerMethod(std::string const& name, XmlRpcServer* server)
   {
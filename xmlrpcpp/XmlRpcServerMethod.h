@@ -20,6 +20,109 @@ namespace XmlRpc {
   // The XmlRpcServer processes client requests to call RPCs
   class XmlRpcServer;
 
+  // Event dispatcher of the connection a deferred call belongs to
+  class XmlRpcDispatch;
+
+  //! Work started by a deferred call which can be stopped early
+  class XmlRpcCancellable {
+  public:
+    virtual ~XmlRpcCancellable() {}
+
+    //! Stop the work, on the dispatcher thread. The call must still be
+    //! answered (possibly later), but the answer is dropped.
+    virtual void cancel() = 0;
+  };
+
+  //! Handle through which a method that cannot answer at once delivers
+  //! its response later. Used only on the dispatcher thread; exactly one
+  //! of succeed() and fail() must be called, after which the handle is invalid.
+  class XmlRpcDeferred {
+  public:
+    virtual ~XmlRpcDeferred() {}
+
+    //! Answer the call with a result
+    virtual void succeed(XmlRpcValue& result) = 0;
+
+    //! Answer the call with a fault
+    virtual void fail(std::string const& msg, int errorCode = -1) = 0;
+
+    //! The dispatcher serving the call, on which to wait for the result
+    virtual XmlRpcDispatch* dispatch() = 0;
+
+    //! Have c->cancel() called if the client disconnects before the call
+    //! is answered (at once if it already has). 0 withdraws the request.
+    virtual void setCancellable(XmlRpcCancellable* /*c*/) {}
+  };
+
+  //! The XML of a result too large to build in memory, produced a piece at
+  //! a time while the response is written. See XmlRpcServerMethod::executeStream.
+  class XmlRpcStream {
+  public:
+    virtual ~XmlRpcStream() {}
+
+    //! The length of the whole XML (a <value> element) if it is known in
+    //! advance, or -1 to send the response in chunks
+    virtual long length() { return -1; }
+
+    //! Append the next piece of the XML to buf, of a bounded size. Returns the
+    //! number of bytes appended, 0 at the end, or -1 on error, which closes the
+    //! connection. Called on a worker thread if the server has any, one call
+    //! at a time, so it may do file IO.
+    virtual int read(std::string& buf) = 0;
+  };
+
+  //! Takes a large parameter of a call a block at a time as the request is
+  //! read, rather than having it built in memory. See XmlRpcServerMethod::openSink.
+  class XmlRpcSink {
+  public:
+    virtual ~XmlRpcSink() {}
+
+    //! Take the next block of the decoded value. Return false on error, after
+    //! which the rest of the value is dropped and finish() should throw the fault.
+    //! Called on a worker if the server has any; reading the request waits for it.
+    virtual bool write(const char* data, int n) = 0;
+
+    //! Execute the call once the whole request is read, in place of the method's
+    //! execute(), with the streamed parameter left invalid in params. The sink is
+    //! deleted afterwards, or without finish() being called if the request turns
+    //! out to be malformed or the client disconnects.
+    virtual void finish(XmlRpcValue& params, XmlRpcValue& result) = 0;
+  };
+
+  //! State which the methods of a server keep for one client connection,
+  //! such as its working directory. The connection deletes it when it closes.
+  class XmlRpcSession {
+  public:
+    virtual ~XmlRpcSession() {}
+
+    //! The session of the client whose call the calling thread is executing;
+    //! 0 if the client has none yet, or no call is being executed.
+    static XmlRpcSession* current();
+
+    //! Give the client of the current call a session, deleting any it had.
+    //! Returns false (and deletes s) if no call is being executed.
+    static bool setCurrent(XmlRpcSession* s);
+
+    //! Whether the client of the current call has disconnected. Methods
+    //! running on a worker thread may check it to give up early.
+    static bool clientGone();
+
+    //! Makes the session slot of a connection, and the flag telling that its
+    //! client has gone, current on the calling thread for the lifetime of the object
+    class Scope {
+    public:
+      Scope(XmlRpcSession** slot, const volatile bool* gone = 0);
+      ~Scope();
+    private:
+      friend class XmlRpcSession;
+      Scope(const Scope&);
+      Scope& operator=(const Scope&);
+      XmlRpcSession** _slot;
+      const volatile bool* _gone;
+      Scope* _prev;
+    };
+  };
+
   //! Abstract class representing a single RPC method
   class XmlRpcServerMethod {
   public:
@@ -28,12 +131,54 @@ namespace XmlRpc {
     //! Destructor
     virtual ~XmlRpcServerMethod();
 
+    //! How the server should execute the method
+    enum Execution {
+      Inline,       //!< cheap; run on the dispatcher thread
+      Blocking,     //!< may take a while; run on a worker thread if the server has any
+      Deferred      //!< started on the dispatcher thread with executeDeferred(),
+                    //!< blocking when called through execute() (e.g. in a multicall)
+    };
+
     //! Returns the name of the method
     std::string& name() { return _name; }
 
+    //! Returns how the method should be executed. Methods which do file
+    //! or process IO should return Blocking so they do not stall other clients.
+    virtual Execution execution() const { return Inline; }
+
+    //! Whether calls of the method may run alongside the other calls of a
+    //! system.multicall_parallel. Methods which change the state of the
+    //! client or depend on the order of its calls should return false;
+    //! they are then run on their own, after the calls before them.
+    virtual bool parallelSafe() const { return true; }
+
     //! Execute the method. Subclasses must provide a definition for this method.
     virtual void execute(XmlRpcValue& params, XmlRpcValue& result) = 0;
 
+    //! Start executing a Deferred method. Return true if the result is
+    //! available at once, or false to answer later through the deferred
+    //! handle (which must not be answered through before this returns).
+    virtual bool executeDeferred(XmlRpcValue& params, XmlRpcValue& result, XmlRpcDeferred* /*deferred*/)
+    { execute(params, result); return true; }
+
+    //! Execute the method with a result which may be streamed to the client
+    //! rather than built in memory. Return a stream, which the connection
+    //! deletes, or 0 with the result set. Only called for a top level call of
+    //! a method which is not Deferred; execute() is called in a multicall.
+    virtual XmlRpcStream* executeStream(XmlRpcValue& params, XmlRpcValue& result)
+    { execute(params, result); return 0; }
+
+    //! The index of a parameter which may be too large to hold in memory, or -1.
+    //! A string or base64 value there, in a large top level request, is decoded
+    //! into the sink returned by openSink() while the request is read.
+    virtual int sinkParam() const { return -1; }
+
+    //! Open the sink for the parameter sinkParam(), given the parameters before
+    //! it and the type of the value (XmlRpcValue::TypeString or TypeBase64).
+    //! Called on the dispatcher thread, in the session of the client. Return
+    //! 0 to have the value parsed in memory as usual.
+    virtual XmlRpcSink* openSink(XmlRpcValue& /*params*/, int /*type*/) { return 0; }
+
     //! Returns a help string for the method.
     //! Subclasses should define this method if introspection is being used.
     virtual std::string help() { return std::string(); }
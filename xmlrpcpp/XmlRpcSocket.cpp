@@ -74,7 +74,15 @@ int
 XmlRpcSocket::socket()
 {
   initWinSock();
+#if defined(_WINDOWS)
   return (int) ::socket(AF_INET, SOCK_STREAM, 0);
+#else
+  // Keep sockets out of spawned processes
+  int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (fd >= 0)
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+#endif
 }
 
 
@@ -113,6 +121,19 @@ XmlRpcSocket::setReuseAddr(int fd)
 }
 
 
+bool
+XmlRpcSocket::setReusePort(int fd)
+{
+#if defined(SO_REUSEPORT)
+  int sflag = 1;
+  return (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const char *)&sflag, sizeof(sflag)) == 0);
+#else
+  (void) fd;
+  return false;
+#endif
+}
+
+
 // Bind to a specified port
 bool 
 XmlRpcSocket::bind(int fd, int port)
@@ -158,7 +179,10 @@ XmlRpcSocket::accept(int fd)
   return (int) clear_inherit_flag((HANDLE)h0);
 #else
   socklen_t addrlen = sizeof(addr);
-  return (int) ::accept(fd, (struct sockaddr*)&addr, &addrlen);
+  int s = ::accept(fd, (struct sockaddr*)&addr, &addrlen);
+  if (s >= 0)
+    fcntl(s, F_SETFD, FD_CLOEXEC);
+  return s;
 #endif
 }
 
@@ -189,15 +213,16 @@ XmlRpcSocket::connect(int fd, std::string& host, int port)
 
 // Read available text from the specified socket. Returns false on error.
 bool 
-XmlRpcSocket::nbRead(int fd, std::string& s, bool *eof)
+XmlRpcSocket::nbRead(int fd, std::string& s, bool *eof, int max)
 {
   const int READ_SIZE = 4096;   // Number of bytes to attempt to read at a time
   char readBuf[READ_SIZE];
 
   bool wouldBlock = false;
   *eof = false;
+  std::string::size_type start = s.length();
 
-  while ( ! wouldBlock && ! *eof) {
+  while ( ! wouldBlock && ! *eof && (max < 0 || int(s.length() - start) < max)) {
 #if defined(_WINDOWS)
     int n = recv(fd, readBuf, READ_SIZE-1, 0);
 #else
@@ -27,8 +27,9 @@ namespace XmlRpc {
     //! Sets a stream (TCP) socket to perform non-blocking IO. Returns false on failure.
     static bool setNonBlocking(int socket);
 
-    //! Read text from the specified socket. Returns false on error.
-    static bool nbRead(int socket, std::string& s, bool *eof);
+    //! Read text from the specified socket, stopping once about max bytes
+    //! have been read if max is given. Returns false on error.
+    static bool nbRead(int socket, std::string& s, bool *eof, int max = -1);
 
     //! Write text to the specified socket. Returns false on error.
     static bool nbWrite(int socket, std::string& s, int *bytesSoFar);
@@ -40,6 +41,10 @@ namespace XmlRpc {
     //! server re-starts are not delayed. Returns false on failure.
     static bool setReuseAddr(int socket);
 
+    //! Allow several sockets to bind the same port, the kernel spreading
+    //! the incoming connections over them. Fails where SO_REUSEPORT is missing.
+    static bool setReusePort(int socket);
+
     //! Bind to a specified port
     static bool bind(int socket, int port);
 
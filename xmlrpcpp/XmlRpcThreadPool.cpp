@@ -0,0 +1,363 @@
+
+#include "XmlRpcThreadPool.h"
+#include "XmlRpcDispatch.h"
+#include "XmlRpcUtil.h"
+
+#if ! defined(_WINDOWS)
+# include <unistd.h>
+# include <fcntl.h>
+# include <errno.h>
+#endif
+
+using namespace XmlRpc;
+
+
+XmlRpcThreadPool::XmlRpcThreadPool() : _wakeFd(-1), _stopping(false)
+{
+#if ! defined(_WINDOWS)
+  pthread_mutex_init(&_lock, 0);
+  pthread_cond_init(&_ready, 0);
+#endif
+}
+
+
+XmlRpcThreadPool::~XmlRpcThreadPool()
+{
+  close();
+#if ! defined(_WINDOWS)
+  pthread_cond_destroy(&_ready);
+  pthread_mutex_destroy(&_lock);
+#endif
+}
+
+
+#if ! defined(_WINDOWS)
+
+// Start the workers and register the wakeup pipe with the dispatcher
+bool
+XmlRpcThreadPool::start(XmlRpcDispatch* disp, int nThreads)
+{
+  if (nThreads <= 0 || ! _threads.empty())
+    return false;
+
+  bool opened = _wakeFd < 0;
+  if ( ! open(disp))
+    return false;
+  _stopping = false;
+
+  for (int i = 0; i < nThreads; ++i)
+  {
+    pthread_t t;
+    if (pthread_create(&t, 0, threadMain, this) != 0)
+    {
+      XmlRpcUtil::error("XmlRpcThreadPool::start: Could not create thread (errno %d).", errno);
+      break;
+    }
+    _threads.push_back(t);
+  }
+  if (_threads.empty())
+  {
+    if (opened)
+    {
+      disp->removeSource(this);
+      close();
+    }
+    return false;
+  }
+
+  XmlRpcUtil::log(2, "XmlRpcThreadPool::start: %d worker threads", size());
+  return true;
+}
+
+
+bool
+XmlRpcThreadPool::open(XmlRpcDispatch* disp)
+{
+  if (_wakeFd >= 0)
+    return true;
+
+  int fds[2];
+  if (pipe(fds) != 0)
+  {
+    XmlRpcUtil::error("XmlRpcThreadPool::open: Could not create pipe (errno %d).", errno);
+    return false;
+  }
+  for (int i = 0; i < 2; ++i)
+  {
+    fcntl(fds[i], F_SETFL, O_NONBLOCK);
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  }
+  this->setfd(fds[0]);
+  _wakeFd = fds[1];
+
+  disp->addSource(this, XmlRpcDispatch::ReadableEvent);
+  return true;
+}
+
+
+void
+XmlRpcThreadPool::submit(Job* job)
+{
+  if (_threads.empty()) {
+    job->run();
+    job->complete();
+    return;
+  }
+  pthread_mutex_lock(&_lock);
+  _queue.push_back(job);
+  pthread_cond_signal(&_ready);
+  pthread_mutex_unlock(&_lock);
+}
+
+
+namespace {
+
+  // The progress of a batch, shared by the caller of runBatch() and the
+  // helper jobs; whoever lets go last deletes it
+  class BatchRun {
+  public:
+    BatchRun(XmlRpcThreadPool::Batch* batch, int n, int refs) :
+      _batch(batch), _n(n), _next(0), _done(0), _refs(refs)
+    {
+      pthread_mutex_init(&_lock, 0);
+      pthread_cond_init(&_finished, 0);
+    }
+
+    ~BatchRun()
+    {
+      pthread_cond_destroy(&_finished);
+      pthread_mutex_destroy(&_lock);
+    }
+
+    // Run items until there are none left to take
+    void work()
+    {
+      pthread_mutex_lock(&_lock);
+      while (_next < _n)
+      {
+        int i = _next++;
+        pthread_mutex_unlock(&_lock);
+        _batch->runItem(i);
+        pthread_mutex_lock(&_lock);
+        if (++_done == _n)
+          pthread_cond_broadcast(&_finished);
+      }
+      pthread_mutex_unlock(&_lock);
+    }
+
+    // Wait for the items taken by others
+    void wait()
+    {
+      pthread_mutex_lock(&_lock);
+      while (_done < _n)
+        pthread_cond_wait(&_finished, &_lock);
+      pthread_mutex_unlock(&_lock);
+    }
+
+    void release()
+    {
+      pthread_mutex_lock(&_lock);
+      bool last = --_refs == 0;
+      pthread_mutex_unlock(&_lock);
+      if (last)
+        delete this;
+    }
+
+  private:
+    XmlRpcThreadPool::Batch* _batch;
+    int _n, _next, _done, _refs;
+    pthread_mutex_t _lock;
+    pthread_cond_t _finished;
+  };
+
+  // Takes items of a batch on a worker. It may start after the batch is
+  // done, and is deleted on the dispatcher thread.
+  class BatchHelper : public XmlRpcThreadPool::Job {
+  public:
+    BatchHelper(BatchRun* run) : _run(run) {}
+    virtual void run() { _run->work(); _run->release(); }
+    virtual void complete() { delete this; }
+  private:
+    BatchRun* _run;
+  };
+}
+
+
+void
+XmlRpcThreadPool::runBatch(Batch* batch, int n)
+{
+  int helpers = n - 1 < size() ? n - 1 : size();
+  if (helpers <= 0)
+  {
+    for (int i = 0; i < n; ++i)
+      batch->runItem(i);
+    return;
+  }
+
+  BatchRun* run = new BatchRun(batch, n, helpers + 1);
+  pthread_mutex_lock(&_lock);
+  for (int i = 0; i < helpers; ++i)
+    _queue.push_back(new BatchHelper(run));
+  pthread_cond_broadcast(&_ready);
+  pthread_mutex_unlock(&_lock);
+
+  run->work();
+  run->wait();
+  run->release();
+}
+
+
+void
+XmlRpcThreadPool::post(Job* job)
+{
+  if (_wakeFd < 0)
+    job->complete();
+  else
+    finished(job);
+}
+
+
+void*
+XmlRpcThreadPool::threadMain(void* pool)
+{
+  static_cast<XmlRpcThreadPool*>(pool)->workerLoop();
+  return 0;
+}
+
+
+void
+XmlRpcThreadPool::workerLoop()
+{
+  pthread_mutex_lock(&_lock);
+  for (;;)
+  {
+    while (_queue.empty() && ! _stopping)
+      pthread_cond_wait(&_ready, &_lock);
+    if (_stopping)
+      break;
+
+    Job* job = _queue.front();
+    _queue.pop_front();
+    pthread_mutex_unlock(&_lock);
+    job->run();
+    finished(job);
+    pthread_mutex_lock(&_lock);
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void
+XmlRpcThreadPool::finished(Job* job)
+{
+  pthread_mutex_lock(&_lock);
+  bool wake = _done.empty();    // Otherwise a wakeup is already pending
+  _done.push_back(job);
+  pthread_mutex_unlock(&_lock);
+
+  if (wake)
+  {
+    char c = 0;
+    while (write(_wakeFd, &c, 1) < 0 && errno == EINTR)
+      ;
+  }
+}
+
+
+// Complete the finished jobs on the dispatcher thread
+unsigned
+XmlRpcThreadPool::handleEvent(unsigned /*eventType*/)
+{
+  char buf[64];
+  while (read(this->getfd(), buf, sizeof(buf)) > 0)
+    ;
+
+  std::deque< Job* > done;
+  pthread_mutex_lock(&_lock);
+  done.swap(_done);
+  pthread_mutex_unlock(&_lock);
+
+  for (std::deque< Job* >::iterator it = done.begin(); it != done.end(); ++it)
+    (*it)->complete();
+
+  return XmlRpcDispatch::ReadableEvent;
+}
+
+
+void
+XmlRpcThreadPool::close()
+{
+  pthread_mutex_lock(&_lock);
+  _stopping = true;
+  pthread_cond_broadcast(&_ready);
+  pthread_mutex_unlock(&_lock);
+
+  for (unsigned i = 0; i < _threads.size(); ++i)
+    pthread_join(_threads[i], 0);
+  _threads.clear();
+  _queue.clear();
+  _done.clear();
+
+  if (_wakeFd >= 0)
+  {
+    ::close(_wakeFd);
+    _wakeFd = -1;
+  }
+  XmlRpcSource::close();
+}
+
+#else  // _WINDOWS
+
+bool
+XmlRpcThreadPool::start(XmlRpcDispatch* /*disp*/, int nThreads)
+{
+  if (nThreads > 0)
+    XmlRpcUtil::log(1, "XmlRpcThreadPool::start: worker threads are not supported on this platform");
+  return false;
+}
+
+
+bool
+XmlRpcThreadPool::open(XmlRpcDispatch* /*disp*/)
+{
+  return false;
+}
+
+
+void
+XmlRpcThreadPool::submit(Job* job)
+{
+  job->run();
+  job->complete();
+}
+
+
+void
+XmlRpcThreadPool::runBatch(Batch* batch, int n)
+{
+  for (int i = 0; i < n; ++i)
+    batch->runItem(i);
+}
+
+
+void
+XmlRpcThreadPool::post(Job* job)
+{
+  job->complete();
+}
+
+
+unsigned
+XmlRpcThreadPool::handleEvent(unsigned /*eventType*/)
+{
+  return 0;
+}
+
+
+void
+XmlRpcThreadPool::close()
+{
+  XmlRpcSource::close();
+}
+
+#endif  // _WINDOWS
@@ -0,0 +1,115 @@
+#ifndef _XMLRPCTHREADPOOL_H_
+#define _XMLRPCTHREADPOOL_H_
+//
+// XmlRpc++ Copyright (c) 2002-2003 by Chris Morley
+//
+#if defined(_MSC_VER)
+# pragma warning(disable:4786)    // identifier was truncated in debug info
+#endif
+
+#ifndef MAKEDEPEND
+# include <deque>
+# include <vector>
+# if ! defined(_WINDOWS)
+#  include <pthread.h>
+# endif
+#endif
+
+#include "XmlRpcSource.h"
+
+namespace XmlRpc {
+
+  class XmlRpcDispatch;
+
+  //! A pool of worker threads running jobs on behalf of a dispatcher.
+  //! Finished jobs are handed back to the dispatcher thread through a pipe
+  //! which the pool monitors as an ordinary source.
+  //! Worker threads are not available on Windows; start() fails there.
+  class XmlRpcThreadPool : public XmlRpcSource {
+  public:
+    //! A unit of work
+    class Job {
+    public:
+      virtual ~Job() {}
+      //! Called on a worker thread.
+      virtual void run() = 0;
+      //! Called on the dispatcher thread after run() has returned.
+      virtual void complete() = 0;
+    };
+
+    //! Work split into independent items, run by runBatch()
+    class Batch {
+    public:
+      virtual ~Batch() {}
+      //! Run item i. Called on any thread, alongside other items.
+      virtual void runItem(int i) = 0;
+    };
+
+    //! Constructor
+    XmlRpcThreadPool();
+    //! Destructor
+    virtual ~XmlRpcThreadPool();
+
+    //! Start nThreads worker threads and register with the dispatcher.
+    //! Returns false if the threads could not be started.
+    bool start(XmlRpcDispatch* disp, int nThreads);
+
+    //! Register the wakeup pipe with the dispatcher without starting workers,
+    //! so that other threads can post() jobs to it. start() does this too.
+    bool open(XmlRpcDispatch* disp);
+
+    //! Number of running worker threads
+    int size() const { return int(_threads.size()); }
+
+    //! Queue a job for a worker thread. Without workers the job is run
+    //! and completed at once on the calling thread.
+    void submit(Job* job);
+
+    //! Run the items 0..n-1 of a batch on the calling thread and idle workers,
+    //! returning when all are done. The caller takes items too, so a busy pool
+    //! only makes it slower. Without workers the items are run in order.
+    //! Call from a worker: the dispatcher thread would stall meanwhile.
+    void runBatch(Batch* batch, int n);
+
+    //! Hand a job straight to the dispatcher thread, which calls its complete().
+    //! Before open() the caller is the dispatcher thread, so it is called at once.
+    void post(Job* job);
+
+    //! Stop the worker threads (waiting for running jobs) and close the pipe.
+    //! Jobs which have not completed yet are dropped.
+    virtual void close();
+
+    // XmlRpcSource interface implementation
+    //! Complete the jobs finished by the workers
+    virtual unsigned handleEvent(unsigned eventType);
+
+  protected:
+#if ! defined(_WINDOWS)
+    static void* threadMain(void* pool);
+
+    // Worker thread loop
+    void workerLoop();
+
+    // Pass a finished job to the dispatcher thread
+    void finished(Job* job);
+
+    pthread_mutex_t _lock;
+    pthread_cond_t _ready;
+    std::vector< pthread_t > _threads;
+#else
+    std::vector< int > _threads;
+#endif
+
+    // Jobs waiting for a worker and jobs waiting for completion
+    std::deque< Job* > _queue;
+    std::deque< Job* > _done;
+
+    // Write end of the wakeup pipe (the read end is the source fd)
+    int _wakeFd;
+
+    // Set when the workers should exit
+    bool _stopping;
+  };
+} // namespace XmlRpc
+
+#endif // _XMLRPCTHREADPOOL_H_